@@ -0,0 +1,115 @@
+/*
+  LittleFS cache & lookahead tuning benchmark
+
+  This program compares the fixed default settings used by begin(cspin)
+  against the settings computed by begin(cspin, port, ramBudget, workload)
+  for each workload hint.  Each configuration formats the chip, then
+  measures sequential write, sequential read, random small reads and
+  small file creation, printing one row of the results matrix.
+
+  Results on an emulated W25Q128JV with 30 MHz SPI and typical program
+  and erase times, from extras/host_test/nor_tuning.cpp:
+
+  config       write KB/s  read KB/s  rand reads/s  creates/s
+  default             268       3560          6267         30
+  mixed               268       3547          1591         30
+  logging             267       3471           869         29
+  random read         268       3560          6267         30
+
+  Writes are limited by the page program time, so larger caches don't
+  make them faster, and each 16 byte random read loads a whole cache, so
+  they make random reads slower.  Real hardware adds SPI overhead and
+  the chip's own timing, so run this on your board.
+
+  WARNING: all data on the flash chip is erased!
+
+  This example code is in the public domain.
+*/
+
+#include <LittleFS.h>
+
+#define chipSelect 6  // use pin 6 for access flash on audio or prop shield
+#define RAM_BUDGET 16384
+
+// begin() may only be called once per instance, so use one for each row
+LittleFS_SPIFlash myfs[4];
+
+const char *rowname[4] = {"default", "mixed", "logging", "random read"};
+
+uint8_t buf[4096];
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial) ; // wait for Arduino Serial Monitor
+  Serial.println("LittleFS Tuning Benchmark");
+  Serial.printf("RAM budget for tuned rows: %d bytes\n\n", RAM_BUDGET);
+  Serial.println("config       write KB/s  read KB/s  rand reads/s  creates/s");
+
+  for (int row=0; row < 4; row++) {
+    bool ok;
+    if (row == 0) {
+      ok = myfs[row].begin(chipSelect, SPI);
+    } else if (row == 1) {
+      ok = myfs[row].begin(chipSelect, SPI, RAM_BUDGET, LittleFS::WORKLOAD_MIXED);
+    } else if (row == 2) {
+      ok = myfs[row].begin(chipSelect, SPI, RAM_BUDGET, LittleFS::WORKLOAD_LOGGING);
+    } else {
+      ok = myfs[row].begin(chipSelect, SPI, RAM_BUDGET, LittleFS::WORKLOAD_RANDOM_READ);
+    }
+    if (!ok) {
+      Serial.printf("Error starting %s\n", "SPI FLASH");
+      while (1) ; // stop here
+    }
+    runRow(myfs[row], rowname[row]);
+  }
+  Serial.println("\nDone");
+}
+
+void runRow(LittleFS &fs, const char *name) {
+  const int total = 256 * 1024;
+  fs.quickFormat();
+  for (unsigned int i=0; i < sizeof(buf); i++) buf[i] = i * 7;
+
+  // sequential write, 512 bytes at a time like a data logger
+  elapsedMicros t = 0;
+  File f = fs.open("bench.bin", FILE_WRITE_BEGIN);
+  for (int n=0; n < total; n += 512) f.write(buf, 512);
+  f.close();
+  uint32_t write_us = t;
+
+  // sequential read, 4K at a time
+  t = 0;
+  f = fs.open("bench.bin");
+  while (f.read(buf, sizeof(buf)) > 0) ;
+  uint32_t read_us = t;
+
+  // random 16 byte record reads
+  randomSeed(1234);
+  t = 0;
+  for (int n=0; n < 500; n++) {
+    f.seek(random(total / 16) * 16);
+    f.read(buf, 16);
+  }
+  uint32_t rand_us = t;
+  f.close();
+
+  // small file creation
+  t = 0;
+  for (int n=0; n < 50; n++) {
+    char fname[16];
+    sprintf(fname, "f%d.txt", n);
+    f = fs.open(fname, FILE_WRITE);
+    f.print("small file contents");
+    f.close();
+  }
+  uint32_t create_us = t;
+
+  Serial.printf("%-12s %10u %10u %13u %10u\n", name,
+    (unsigned int)((uint64_t)total * 1000 / write_us),
+    (unsigned int)((uint64_t)total * 1000 / read_us),
+    (unsigned int)(500ull * 1000000 / rand_us),
+    (unsigned int)(50ull * 1000000 / create_us));
+}
+
+void loop() {
+}
@@ -0,0 +1,116 @@
+// SPI FRAM geometry.  Media formatted with the old 64 byte prog, 128
+// byte block geometry is still mounted, and keeps it, so the same
+// operations can be timed with both on the 1 MB CY15B108QN emulator.
+#include <LittleFS.h>
+#include "spi_fram.h"
+
+static const uint32_t framSize = 1 << 20;
+static const uint32_t cy15b108qn = 0x032EC2;
+
+static int mem_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buf, lfs_size_t size)
+{
+	memcpy(buf, fram_memory() + block * c->block_size + off, size);
+	return 0;
+}
+static int mem_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buf, lfs_size_t size)
+{
+	memcpy(fram_memory() + block * c->block_size + off, buf, size);
+	return 0;
+}
+static int mem_erase(const struct lfs_config *c, lfs_block_t block) { return 0; }
+static int mem_sync(const struct lfs_config *c) { return 0; }
+
+// Format the emulated chip as the driver did before
+static void format_legacy()
+{
+	struct lfs_config cfg = {};
+	cfg.read = mem_read;
+	cfg.prog = mem_prog;
+	cfg.erase = mem_erase;
+	cfg.sync = mem_sync;
+	cfg.read_size = 64;
+	cfg.prog_size = 64;
+	cfg.block_size = 128;
+	cfg.block_count = framSize / 128;
+	cfg.block_cycles = -1;
+	cfg.cache_size = 64;
+	cfg.lookahead_size = ((cfg.block_count + 63) / 64) * 8;
+	lfs_t lfs = {};
+	CHECK(lfs_format(&lfs, &cfg) == 0);
+}
+
+struct result {
+	double creates, updates, writeKB, readKB;
+};
+
+static double rate(double t, double count)
+{
+	return count / ((sim_now - t) / 1e6);
+}
+
+static result run(bool legacy)
+{
+	fram_init(cy15b108qn, framSize);
+	if (legacy) format_legacy();
+	LittleFS_SPIFram fs;
+	CHECK(fs.begin(10));
+	result r;
+	char name[16], text[32];
+	const int files = 50;
+	double t = sim_now;
+	for (int i = 0; i < files; i++) {
+		snprintf(name, sizeof(name), "f%d.txt", i);
+		snprintf(text, sizeof(text), "small file %d, first\n", i);
+		File f = fs.open(name, FILE_WRITE_BEGIN);
+		f.write(text, strlen(text));
+		f.close();
+	}
+	r.creates = rate(t, files);
+	t = sim_now;
+	for (int i = 0; i < files; i++) {
+		snprintf(name, sizeof(name), "f%d.txt", i);
+		snprintf(text, sizeof(text), "small file %d, again\n", i);
+		File f = fs.open(name, FILE_WRITE_BEGIN);
+		f.write(text, strlen(text));
+		f.close();
+	}
+	r.updates = rate(t, files);
+
+	static uint8_t buf[65536];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i * 7;
+	t = sim_now;
+	File f = fs.open("large.bin", FILE_WRITE_BEGIN);
+	CHECK(f.write(buf, sizeof(buf)) == sizeof(buf));
+	f.close();
+	r.writeKB = rate(t, 64);
+	memset(buf, 0, sizeof(buf));
+	t = sim_now;
+	f = fs.open("large.bin");
+	CHECK(f.read(buf, sizeof(buf)) == sizeof(buf));
+	f.close();
+	r.readKB = rate(t, 64);
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(buf); i++) ok = ok && buf[i] == (uint8_t)(i * 7);
+	CHECK(ok);
+
+	// the geometry is kept, and the files with it
+	LittleFS_SPIFram fs2;
+	CHECK(fs2.begin(10));
+	f = fs2.open("f49.txt");
+	CHECK(f.size() == strlen("small file 49, again\n"));
+	f.close();
+	return r;
+}
+
+int main()
+{
+	const result old = run(true);
+	const result now = run(false);
+	printf("             create/s  update/s  64K write  64K read\n");
+	printf("  64/128     %6.0f    %6.0f  %5.0f KB/s %5.0f KB/s\n", old.creates, old.updates, old.writeKB, old.readKB);
+	printf("  16/512     %6.0f    %6.0f  %5.0f KB/s %5.0f KB/s\n", now.creates, now.updates, now.writeKB, now.readKB);
+	CHECK(now.updates > old.updates);
+	CHECK(now.writeKB > old.writeKB * 1.2);
+	CHECK(now.readKB > old.readKB * 2);
+	return sim_result("fram_geometry");
+}
@@ -0,0 +1,60 @@
+// LittleFS_SPIFramT against LittleFS_SPIFram on the emulated CY15B108QN:
+// each reads the files the other wrote, and the template refuses another
+// chip.
+#include <LittleFS.h>
+#include "spi_fram.h"
+
+static const uint32_t cy15b108qn = 0x032EC2, framSize = 1 << 20;
+
+static void write_files(LittleFS &fs, const char *writer)
+{
+	char name[16], text[64];
+	for (int i = 0; i < 20; i++) {
+		snprintf(name, sizeof(name), "%s%d.txt", writer, i);
+		snprintf(text, sizeof(text), "file %d, written by %s\n", i, writer);
+		File f = fs.open(name, FILE_WRITE_BEGIN);
+		CHECK(f.write(text, strlen(text)) == strlen(text));
+		f.close();
+	}
+}
+
+static bool read_files(LittleFS &fs, const char *writer)
+{
+	char name[16], text[64], want[64];
+	for (int i = 0; i < 20; i++) {
+		snprintf(name, sizeof(name), "%s%d.txt", writer, i);
+		snprintf(want, sizeof(want), "file %d, written by %s\n", i, writer);
+		memset(text, 0, sizeof(text));
+		File f = fs.open(name);
+		if (!f || f.read(text, sizeof(text)) != strlen(want) || strcmp(text, want)) return false;
+		f.close();
+	}
+	return true;
+}
+
+int main()
+{
+	fram_init(cy15b108qn, framSize);
+	{
+		LittleFS_SPIFramT<LittleFS_CY15B108QN> fs;
+		CHECK(fs.begin(10));
+		write_files(fs, "t");
+	}
+	{
+		LittleFS_SPIFram fs;
+		CHECK(fs.begin(10));
+		CHECK(read_files(fs, "t"));
+		write_files(fs, "r");
+	}
+	LittleFS_SPIFramT<LittleFS_CY15B108QN> fs;
+	CHECK(fs.begin(10));
+	CHECK(read_files(fs, "t"));
+	CHECK(read_files(fs, "r"));
+
+	fram_init(0xC22400, 131072); // FM25V10
+	LittleFS_SPIFramT<LittleFS_CY15B108QN> other;
+	CHECK(!other.begin(10));
+	LittleFS_SPIFramT<LittleFS_FM25V10> right;
+	CHECK(right.begin(10));
+	return sim_result("fram_templates");
+}
@@ -0,0 +1,88 @@
+// Bad block management: factory bad block marks, blocks which fail to
+// program or erase, and parsing the chip's own BBM LUT.
+#include <LittleFS.h>
+#include "spi_nand.h"
+
+static uint8_t data[1 << 20], readback[1 << 20];
+
+static bool verify(LittleFS &fs)
+{
+	File f = fs.open("data.bin");
+	const size_t n = f.read(readback, sizeof(readback));
+	f.close();
+	return n == sizeof(data) && memcmp(readback, data, n) == 0;
+}
+
+static void write_file(LittleFS &fs)
+{
+	File f = fs.open("data.bin", FILE_WRITE_BEGIN);
+	CHECK(f.write(data, sizeof(data)) == sizeof(data));
+	f.close();
+}
+
+static void test_chip(uint32_t jedec, const char *pn, bool interleave)
+{
+	printf("%s%s\n", pn, interleave ? ", die interleave" : "");
+	nand_init(jedec);
+	const int last = nand_dies() - 1;
+	// a logical block, and one of the reserved blocks at the end of the
+	// chip.  badBlocks() counts both.
+	nand_mark_bad(0, 5);
+	nand_mark_bad(last, nand_blocks() - 3);
+	LittleFS_SPINAND fs;
+	if (interleave) fs.setDieInterleave();
+	CHECK(fs.begin(10));
+	CHECK(fs.badBlocks() == 2);
+	const uint32_t spares = fs.spareBlocks();
+
+	// failures while in use, on every die
+	for (uint32_t b = 2; b < nand_blocks() - 24; b += 97) {
+		nand_fail_block(last, b, true, false);
+		nand_fail_block(0, b + 18, false, true);
+	}
+	for (size_t i = 0; i < sizeof(data); i++) data[i] = i * 13 + (i >> 9);
+	for (int pass = 0; pass < 24; pass++) {
+		write_file(fs);
+		CHECK(verify(fs));
+	}
+	const uint32_t bad = fs.badBlocks();
+	CHECK(bad > 2);
+	CHECK(fs.spareBlocks() == spares - (bad - 2));
+
+	LittleFS_SPINAND fs2;
+	if (interleave) fs2.setDieInterleave();
+	CHECK(fs2.begin(10));
+	CHECK(fs2.badBlocks() == bad);
+	CHECK(verify(fs2));
+	CHECK(nand_violations() == 0);
+}
+
+// Read BBM LUT (0xA5) returns 20 entries of LBA with status bits, and PBA
+static void test_lut()
+{
+	printf("BBM LUT\n");
+	nand_init(NAND_W25N01);
+	LittleFS_SPINAND fs;
+	CHECK(fs.begin(10));
+	CHECK(nand_lut_link(0, 7, 1010));
+	CHECK(nand_lut_link(0, 300, 1011));
+	CHECK(nand_lut_link(0, 1000, 1012));
+	nand_lut_invalidate(0, 1);
+	uint16_t lba[20], pba[20];
+	uint8_t status[20];
+	fs.readBBLUT(lba, pba, status);
+	CHECK(lba[0] == 7 && pba[0] == 1010 && status[0] == 2);
+	CHECK(lba[1] == 300 && pba[1] == 1011 && status[1] == 3);
+	CHECK(lba[2] == 1000 && pba[2] == 1012 && status[2] == 2);
+	for (int i = 3; i < 20; i++) CHECK(status[i] == 0);
+}
+
+int main()
+{
+	test_chip(NAND_W25N01, "W25N01GVZEIG", false);
+	test_chip(NAND_W25N02, "W25N02KVZEIR", false);
+	test_chip(NAND_W25M02, "W25M02", false);
+	test_chip(NAND_W25M02, "W25M02", true);
+	test_lut();
+	return sim_result("nand_bbm");
+}
@@ -0,0 +1,63 @@
+// Every supported SPI NAND chip: format, write, read back, remount.  The
+// emulator counts protocol errors, such as rows past the end of a die.
+#include <LittleFS.h>
+#include "spi_nand.h"
+
+static uint8_t data[1 << 20], readback[1 << 20];
+
+static bool verify(LittleFS &fs, const char *name)
+{
+	File f = fs.open(name);
+	if (!f) return false;
+	const size_t n = f.read(readback, sizeof(readback));
+	f.close();
+	return n == sizeof(data) && memcmp(readback, data, n) == 0;
+}
+
+static void test_chip(uint32_t jedec, const char *pn, uint64_t size, bool interleave)
+{
+	printf("%s%s\n", pn, interleave ? ", die interleave" : "");
+	nand_init(jedec);
+	LittleFS_SPINAND fs;
+	if (interleave) fs.setDieInterleave();
+	CHECK(fs.begin(10));
+	CHECK(strcmp(fs.getMediaName(), pn) == 0);
+	CHECK(fs.totalSize() <= size && fs.totalSize() > size - size / 32);
+	CHECK(fs.badBlocks() == 0);
+
+	// enough files to reach the end of the chip, so the last die and
+	// the highest rows are used
+	for (size_t i = 0; i < sizeof(data); i++) data[i] = i * 7 + (i >> 11);
+	char name[16];
+	// each file needs one more block, up to 256K, for its skip list
+	const int files = fs.totalSize() / (sizeof(data) + 262144) - 2;
+	for (int i = 0; i < files; i++) {
+		snprintf(name, sizeof(name), "f%d.bin", i);
+		File f = fs.open(name, FILE_WRITE_BEGIN);
+		const size_t n = f.write(data, sizeof(data));
+		f.close();
+		CHECK(n == sizeof(data));
+		if (n != sizeof(data)) break;
+	}
+	for (int i = 0; i < files; i += 17) {
+		snprintf(name, sizeof(name), "f%d.bin", i);
+		CHECK(verify(fs, name));
+	}
+	CHECK(nand_violations() == 0);
+
+	LittleFS_SPINAND fs2;
+	if (interleave) fs2.setDieInterleave();
+	CHECK(fs2.begin(10));
+	snprintf(name, sizeof(name), "f%d.bin", files - 1);
+	CHECK(verify(fs2, name));
+	CHECK(nand_violations() == 0);
+}
+
+int main()
+{
+	test_chip(NAND_W25N01, "W25N01GVZEIG", 128ull << 20, false);
+	test_chip(NAND_W25N02, "W25N02KVZEIR", 256ull << 20, false);
+	test_chip(NAND_W25M02, "W25M02", 256ull << 20, false);
+	test_chip(NAND_W25M02, "W25M02", 256ull << 20, true);
+	return sim_result("nand_chips");
+}
@@ -0,0 +1,97 @@
+// ECC status decoding, for buffered and continuous reads.  Bit flips up
+// to the chip's ECC strength must read back as good data and count
+// toward scrubbing, more must fail the read and retire the block.
+#include <LittleFS.h>
+#include "spi_nand.h"
+
+static uint8_t data[262144], readback[262144];
+
+// The emulated chip's row holding len bytes of pattern, or -1
+static int find_row(const uint8_t *pattern, uint32_t len)
+{
+	static uint8_t page[2048];
+	const uint32_t rows = nand_blocks() * nand_pages_per_block();
+	for (uint32_t row = 0; row < rows; row++) {
+		nand_read_raw(0, row, 0, page, sizeof(page));
+		if (memmem(page, sizeof(page), pattern, len)) return row;
+	}
+	return -1;
+}
+
+static size_t read_file(LittleFS &fs, const char *name)
+{
+	memset(readback, 0, sizeof(readback));
+	File f = fs.open(name);
+	const size_t n = f.read(readback, sizeof(readback));
+	f.close();
+	return n;
+}
+
+static void test_chip(uint32_t jedec, const char *pn, int strength)
+{
+	printf("%s, %d bit ECC\n", pn, strength);
+	nand_init(jedec);
+	LittleFS_SPINAND fs;
+	CHECK(fs.begin(10));
+	CHECK(fs.enableScrub(1000)); // count, but don't move anything
+	uint32_t seed = jedec;
+	for (size_t i = 0; i < sizeof(data); i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+	File f = fs.open("data.bin", FILE_WRITE_BEGIN);
+	CHECK(f.write(data, sizeof(data)) == sizeof(data));
+	f.close();
+	const int row = find_row(data + 100000, 64);
+	CHECK(row >= 0);
+	if (row < 0) return;
+	const uint32_t block = row / nand_pages_per_block();
+	// readECC() addresses the chip in units of its ECC size
+	const uint32_t units = nand_page_size() / (nand_page_size() == 2112 ? 64 : 128);
+	uint8_t buf[16];
+
+	// correctable: the whole file is read at once, so continuous read
+	// sees the flips first, then the page is read again in buffered mode
+	CHECK(fs.readECC(row * units, buf, sizeof(buf)) == 0);
+	nand_flip_bits(0, row, 0, strength);
+	CHECK(fs.readECC(row * units, buf, sizeof(buf)) == 1);
+	CHECK(read_file(fs, "data.bin") == sizeof(data));
+	CHECK(memcmp(readback, data, sizeof(data)) == 0);
+	LittleFSWearStats stats;
+	CHECK(fs.getWearStats(stats));
+	CHECK(stats.totalCorrected >= 1);
+	CHECK(fs.correctedCount(block) >= 1);
+	CHECK(fs.badBlocks() == 0);
+
+	// uncorrectable in another sector of the same page
+	nand_flip_bits(0, row, 1, strength + 1);
+	CHECK(fs.readECC(row * units, buf, sizeof(buf)) == 2);
+	CHECK(read_file(fs, "data.bin") < sizeof(data));
+
+	// the block is replaced when it is next erased, keeping a spare
+	const uint32_t spares = fs.spareBlocks();
+	CHECK(fs.lowLevelFormat(0));
+	CHECK(fs.badBlocks() == 1);
+	CHECK(fs.spareBlocks() == spares - 1);
+	f = fs.open("data.bin", FILE_WRITE_BEGIN);
+	CHECK(f.write(data, sizeof(data)) == sizeof(data));
+	f.close();
+	CHECK(read_file(fs, "data.bin") == sizeof(data));
+	CHECK(memcmp(readback, data, sizeof(data)) == 0);
+
+	// the replacement is remembered
+	LittleFS_SPINAND fs2;
+	CHECK(fs2.begin(10));
+	CHECK(fs2.badBlocks() == 1);
+	CHECK(read_file(fs2, "data.bin") == sizeof(data));
+	CHECK(memcmp(readback, data, sizeof(data)) == 0);
+	CHECK(nand_violations() == 0);
+}
+
+int main()
+{
+	test_chip(NAND_W25N01, "W25N01GVZEIG", 1);
+	test_chip(NAND_W25N02, "W25N02KVZEIR", 8);
+	test_chip(NAND_W25M02, "W25M02", 1);
+	return sim_result("nand_ecc");
+}
@@ -0,0 +1,119 @@
+// Known erased blocks.  After background erase has run, writing needs no
+// erases and no blank checks, and lowLevelFormat() skips every block
+// already erased.  A fresh begin() knows nothing about the blocks, which
+// is how every session started before the state was kept.
+#include <LittleFS.h>
+#include "spi_nand.h"
+
+static uint8_t data[4096];
+static const uint32_t fileSize = 4 << 20;
+
+struct result {
+	double ms;
+	uint64_t reads, programs, erases;
+};
+
+static result measure_start()
+{
+	nand_reset_stats();
+	return result{sim_now / 1000, 0, 0, 0};
+}
+
+static void measure_end(result &r, const char *what)
+{
+	r.ms = sim_now / 1000 - r.ms;
+	r.reads = nand_stats.pageReads;
+	r.programs = nand_stats.pagePrograms;
+	r.erases = nand_stats.blockErases;
+	printf("  %s: %.0f ms, %u page reads, %u programs, %u erases\n", what, r.ms,
+	  (unsigned)r.reads, (unsigned)r.programs, (unsigned)r.erases);
+}
+
+static bool write_file(LittleFS &fs, const char *name)
+{
+	File f = fs.open(name, FILE_WRITE_BEGIN);
+	if (!f) return false;
+	for (uint32_t n = 0; n < fileSize; n += sizeof(data)) {
+		for (size_t i = 0; i < sizeof(data); i++) data[i] = (n >> 12) + i;
+		if (f.write(data, sizeof(data)) != sizeof(data)) return false;
+	}
+	f.close();
+	return true;
+}
+
+// A 4 MB file written and deleted, so its blocks are free but not erased
+static void prepare(LittleFS &fs)
+{
+	CHECK(write_file(fs, "old.bin"));
+	CHECK(fs.remove("old.bin"));
+}
+
+static void background_erase(LittleFS &fs)
+{
+	CHECK(fs.enableBackgroundErase());
+	int passes = 0;
+	while (fs.maintenance(1000000) && passes < 1000) passes++;
+	CHECK(passes < 1000);
+}
+
+static void test_write()
+{
+	printf("4 MB write into freed blocks\n");
+	nand_init(NAND_W25N01);
+	LittleFS_SPINAND fs;
+	CHECK(fs.begin(10));
+	prepare(fs);
+	background_erase(fs);
+	result known = measure_start();
+	CHECK(write_file(fs, "new.bin"));
+	measure_end(known, "after background erase");
+
+	LittleFS_SPINAND fs2;
+	CHECK(fs2.begin(10));
+	prepare(fs2);
+	LittleFS_SPINAND fs3; // knows nothing about the blocks
+	CHECK(fs3.begin(10));
+	result unknown = measure_start();
+	CHECK(write_file(fs3, "new.bin"));
+	measure_end(unknown, "fresh begin");
+
+	CHECK(known.erases == 0);
+	CHECK(unknown.erases > fileSize / (128 * 1024));
+	// littlefs's read back of each program, and metadata
+	CHECK(known.reads <= known.programs + known.programs / 16);
+	CHECK(known.ms < unknown.ms);
+	CHECK(nand_violations() == 0);
+}
+
+static void test_format()
+{
+	printf("lowLevelFormat\n");
+	nand_init(NAND_W25N01);
+	LittleFS_SPINAND fs;
+	CHECK(fs.begin(10));
+	prepare(fs);
+	background_erase(fs);
+	result known = measure_start();
+	CHECK(fs.lowLevelFormat(0));
+	measure_end(known, "after background erase");
+
+	CHECK(fs.begin(10));
+	prepare(fs);
+	LittleFS_SPINAND fs2;
+	CHECK(fs2.begin(10));
+	result unknown = measure_start();
+	CHECK(fs2.lowLevelFormat(0));
+	measure_end(unknown, "fresh begin");
+
+	CHECK(known.ms < 1000);
+	CHECK(known.ms * 100 < unknown.ms);
+	CHECK(known.erases < unknown.erases); // the reserved blocks are always erased
+	CHECK(nand_violations() == 0);
+}
+
+int main()
+{
+	test_write();
+	test_format();
+	return sim_result("nand_erased");
+}
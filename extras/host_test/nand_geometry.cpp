@@ -0,0 +1,162 @@
+// Addressing, both ways, for every entry of the SPI NAND chip table.
+// The driver source is included, so its geometry table can be checked
+// directly, then each littlefs block is programmed through the driver
+// and found at the die, row and column the datasheet layout gives, and
+// written there and read back through the driver.
+#include "LittleFS_NAND.cpp"
+#include "spi_nand.h"
+
+static const int numchips = sizeof(known_chips) / sizeof(struct chipinfo);
+
+// Every page of the chip at a few columns: split into die, row and
+// column, then put back together
+static void test_table(const struct chipinfo *info)
+{
+	const nand_geometry &g = info->geometry;
+	printf("%s geometry\n", info->pn);
+	const uint32_t id = (info->id[0] << 16) | (info->id[1] << 8) | info->id[2];
+	nand_init(id);
+	CHECK(g.pageSize() == info->progsize);
+	CHECK(g.blockSize() == info->erasesize);
+	CHECK(nand_page_size() >= g.pageSize() + 64); // the spare area follows
+	CHECK(g.pagesPerBlock() == nand_pages_per_block());
+	CHECK((1ul << g.blockBits) == nand_blocks());
+	CHECK((1ul << g.dieBits) == nand_dies());
+	CHECK(info->chipsize % g.blockSize() == 0);
+	CHECK(info->chipsize < (uint64_t)g.blocks() * g.blockSize());
+	CHECK((g.subPageSize() << g.nopBits) == g.pageSize());
+	// the erase count tag is in the first sector's 16 spare bytes
+	CHECK(g.tagColumn == 0 || g.tagColumn + TAG_SIZE <= (int)g.subPageSize() / 32);
+
+	const uint32_t cols[] = {0, 1, g.subPageSize() - 1, g.subPageSize(), g.pageSize() - 1};
+	const uint32_t pages = g.blocks() << g.pageBits;
+	for (uint32_t p = 0; p < pages; p++) {
+		for (uint32_t col : cols) {
+			const uint32_t a = g.pageAddress(p) + col;
+			const uint32_t die = g.die(a), row = g.row(a), block = g.block(a);
+			if (g.page(a) != p || g.column(a) != col) {
+				CHECK(g.page(a) == p && g.column(a) == col);
+				return;
+			}
+			if (die >= nand_dies() || row >= (nand_blocks() << g.pageBits)
+			  || row >= (1ul << 24) || die * g.dieSize() + g.pageAddress(row) + col != a) {
+				printf("address %08X: die %u row %u\n", a, die, row);
+				CHECK(false);
+				return;
+			}
+			if (block != p >> g.pageBits || g.blockAddress(block) > a
+			  || a - g.blockAddress(block) >= g.blockSize()) {
+				printf("address %08X: block %u\n", a, block);
+				CHECK(false);
+				return;
+			}
+		}
+	}
+}
+
+class Probe : public LittleFS_SPINAND
+{
+public:
+	uint32_t blocks() { return config.block_count; }
+	uint32_t blockSize() { return config.block_size; }
+	int erase(lfs_block_t block) { return config.erase(&config, block); }
+	int prog(lfs_block_t block, lfs_off_t off, const void *buf, lfs_size_t size) {
+		return config.prog(&config, block, off, buf, size);
+	}
+	int read(lfs_block_t block, lfs_off_t off, void *buf, lfs_size_t size) {
+		return config.read(&config, block, off, buf, size);
+	}
+};
+
+static void fill(uint8_t *buf, uint32_t len, uint32_t seed)
+{
+	for (uint32_t i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = seed >> 16;
+	}
+}
+
+// Each page of a littlefs block is on the die and row given by the
+// datasheet layout, with setDieInterleave() alternate pages on each die
+static void test_driver(const struct chipinfo *info, bool interleave)
+{
+	const nand_geometry &g = info->geometry;
+	printf("%s driver%s\n", info->pn, interleave ? ", die interleave" : "");
+	const uint32_t id = (info->id[0] << 16) | (info->id[1] << 8) | info->id[2];
+	nand_init(id);
+	Probe fs;
+	if (interleave) fs.setDieInterleave();
+	CHECK(fs.begin(10));
+	const uint32_t pageSize = g.pageSize();
+	const uint32_t pagesPerBlock = fs.blockSize() / pageSize;
+	const uint32_t chipBlocks = info->chipsize / g.blockSize();
+	CHECK(fs.blocks() * (fs.blockSize() / g.blockSize()) <= chipBlocks);
+	static uint8_t used[4][2048];
+	memset(used, 0, sizeof(used));
+	static uint8_t page[2048], readback[2048];
+	int errors = 0;
+	for (uint32_t b = 0; b < fs.blocks() && errors < 5; b++) {
+		if (fs.erase(b) != 0) {
+			printf("erase block %u failed\n", b);
+			errors++;
+			continue;
+		}
+		const uint32_t testPages[] = {0, 1, pagesPerBlock - 2, pagesPerBlock - 1};
+		for (uint32_t p : testPages) {
+			uint32_t die, chipBlock, chipPage;
+			if (interleave) {
+				die = p & 1;
+				chipBlock = b;
+				chipPage = p >> 1;
+			} else {
+				die = b >> g.blockBits;
+				chipBlock = b & ((1ul << g.blockBits) - 1);
+				chipPage = p;
+			}
+			const uint32_t row = (chipBlock << g.pageBits) | chipPage;
+			if (p == 0 && used[die][chipBlock]++) {
+				printf("block %u: die %u block %u used twice\n", b, die, chipBlock);
+				errors++;
+			}
+			// the reserved blocks at the top of the chip are never used
+			if (((die << g.blockBits) | chipBlock) >= chipBlocks) {
+				printf("block %u is on reserved die %u block %u\n", b, die, chipBlock);
+				errors++;
+			}
+
+			// driver to chip
+			fill(page, pageSize, (b << 8) | p);
+			if (fs.prog(b, p * pageSize, page, pageSize) != 0) {
+				printf("prog block %u page %u failed\n", b, p);
+				errors++;
+				continue;
+			}
+			nand_read_raw(die, row, 0, readback, pageSize);
+			if (memcmp(page, readback, pageSize) != 0) {
+				printf("block %u page %u is not at die %u row %u\n", b, p, die, row);
+				errors++;
+			}
+			// chip to driver
+			fill(page, pageSize, ~((b << 8) | p));
+			nand_write_raw(die, row, 0, page, pageSize);
+			memset(readback, 0, pageSize);
+			if (fs.read(b, p * pageSize, readback, pageSize) != 0
+			  || memcmp(page, readback, pageSize) != 0) {
+				printf("die %u row %u doesn't read as block %u page %u\n", die, row, b, p);
+				errors++;
+			}
+		}
+	}
+	CHECK(errors == 0);
+	CHECK(nand_violations() == 0);
+}
+
+int main()
+{
+	for (int i = 0; i < numchips; i++) {
+		test_table(known_chips + i);
+		test_driver(known_chips + i, false);
+		if (known_chips[i].geometry.dieBits) test_driver(known_chips + i, true);
+	}
+	return sim_result("nand_geometry");
+}
@@ -0,0 +1,50 @@
+// W25M02 die interleave.  With setDieInterleave() each littlefs block
+// holds alternate pages on the two dies, so a multi-page cache flush
+// programs one die while the next page loads into the other.
+// Continuous read doesn't cross the dies, so reads are a little slower.
+#include <LittleFS.h>
+#include "spi_nand.h"
+
+static uint8_t buf[65536];
+static const uint32_t fileSize = 4 << 20;
+
+static void run(bool interleave, double &writeRate, double &readRate)
+{
+	nand_init(NAND_W25M02);
+	LittleFS_SPINAND fs;
+	if (interleave) fs.setDieInterleave();
+	CHECK(fs.begin(10, SPI, 16384, LittleFS::WORKLOAD_LOGGING));
+	double t = sim_now;
+	File f = fs.open("data.bin", FILE_WRITE_BEGIN);
+	for (uint32_t pos = 0; pos < fileSize; pos += 4096) {
+		for (uint32_t i = 0; i < 4096; i++) buf[i] = (pos + i) * 11;
+		f.write(buf, 4096);
+	}
+	f.close();
+	writeRate = (fileSize / 1024) / ((sim_now - t) / 1e6);
+
+	t = sim_now;
+	f = fs.open("data.bin");
+	bool ok = f.size() == fileSize;
+	for (uint32_t pos = 0; pos < fileSize && ok; pos += sizeof(buf)) {
+		ok = f.read(buf, sizeof(buf)) == sizeof(buf);
+		for (uint32_t i = 0; i < sizeof(buf) && ok; i++) ok = buf[i] == (uint8_t)((pos + i) * 11);
+	}
+	f.close();
+	readRate = (fileSize / 1024) / ((sim_now - t) / 1e6);
+	CHECK(ok);
+	CHECK(nand_violations() == 0);
+}
+
+int main()
+{
+	double plainWrite, plainRead, interWrite, interRead;
+	run(false, plainWrite, plainRead);
+	run(true, interWrite, interRead);
+	printf("4 MB, 16 KB RAM budget: write %.0f -> %.0f KB/s (%+.0f%%), read %.0f -> %.0f KB/s (%+.0f%%)\n",
+	  plainWrite, interWrite, (interWrite / plainWrite - 1) * 100,
+	  plainRead, interRead, (interRead / plainRead - 1) * 100);
+	CHECK(interWrite > plainWrite * 1.1);
+	CHECK(interRead > plainRead * 0.9);
+	return sim_result("nand_interleave");
+}
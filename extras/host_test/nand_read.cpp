@@ -0,0 +1,69 @@
+// Sequential reads.  Reads of 64 KB stream their pages with continuous
+// read mode, one Page Data Read for the run, while 2 KB reads go
+// through the file cache a page at a time, in buffered mode.
+#include <LittleFS.h>
+#include "spi_nand.h"
+
+static uint8_t buf[65536];
+static const uint32_t fileSize = 4 << 20;
+
+static void fill(uint8_t *p, uint32_t len, uint32_t pos)
+{
+	for (uint32_t i = 0; i < len; i++) p[i] = (pos + i) * 7 + ((pos + i) >> 11);
+}
+
+// KB/s reading the whole file in chunks of size
+static double read_rate(LittleFS &fs, uint32_t size, uint64_t &loads)
+{
+	File f = fs.open("data.bin");
+	nand_reset_stats();
+	const double t = sim_now;
+	bool ok = true;
+	for (uint32_t pos = 0; pos < fileSize; pos += size) {
+		if (f.read(buf, size) != size) ok = false;
+		for (uint32_t i = 0; i < size; i++) {
+			if (buf[i] != (uint8_t)((pos + i) * 7 + ((pos + i) >> 11))) ok = false;
+		}
+	}
+	const double us = sim_now - t;
+	f.close();
+	CHECK(ok);
+	loads = nand_stats.pageDataReads;
+	return (fileSize / 1024) / (us / 1e6);
+}
+
+static void test_read(double mhz, double tRD)
+{
+	nand_byte_us = 8 / mhz;
+	nand_tRD = tRD;
+	nand_init(NAND_W25N01);
+	LittleFS_SPINAND fs;
+	CHECK(fs.begin(10));
+	File f = fs.open("data.bin", FILE_WRITE_BEGIN);
+	for (uint32_t pos = 0; pos < fileSize; pos += sizeof(buf)) {
+		fill(buf, sizeof(buf), pos);
+		f.write(buf, sizeof(buf));
+	}
+	f.close();
+
+	uint64_t pageLoads, contLoads;
+	const double paged = read_rate(fs, 2048, pageLoads);
+	const double cont = read_rate(fs, 65536, contLoads);
+	printf("%3.0f MHz, tRD %2.0f us: %5.0f KB/s a page at a time, %5.0f KB/s continuous (%+.0f%%), %u -> %u page loads\n",
+	  mhz, tRD, paged, cont, (cont / paged - 1) * 100, (unsigned)pageLoads, (unsigned)contLoads);
+	CHECK(cont > paged);
+	CHECK(pageLoads >= fileSize / 2048);
+	CHECK(contLoads * 8 < fileSize / 2048);
+	CHECK(nand_violations() == 0);
+}
+
+int main()
+{
+	test_read(30, 25);
+	test_read(30, 60);
+	test_read(120, 25);
+	test_read(120, 60);
+	nand_byte_us = 8.0 / 30;
+	nand_tRD = 25;
+	return sim_result("nand_read");
+}
@@ -0,0 +1,85 @@
+// Scrubbing.  Correctable bit flips in one block of a file are counted
+// as it's read, and once the block reaches the threshold maintenance()
+// moves the file.  Reading it again then needs no correction.
+#include <LittleFS.h>
+#include "spi_nand.h"
+
+static uint8_t data[262144], readback[262144];
+
+static int find_row(const uint8_t *pattern, uint32_t len)
+{
+	static uint8_t page[2048];
+	const uint32_t rows = nand_blocks() * nand_pages_per_block();
+	for (uint32_t row = 0; row < rows; row++) {
+		nand_read_raw(0, row, 0, page, sizeof(page));
+		if (memmem(page, sizeof(page), pattern, len)) return row;
+	}
+	return -1;
+}
+
+static bool read_file(LittleFS &fs)
+{
+	memset(readback, 0, sizeof(readback));
+	File f = fs.open("data.bin");
+	const size_t n = f.read(readback, sizeof(readback));
+	f.close();
+	return n == sizeof(data) && memcmp(readback, data, n) == 0;
+}
+
+int main()
+{
+	nand_init(NAND_W25N01);
+	LittleFS_SPINAND fs;
+	CHECK(fs.begin(10));
+	const uint32_t threshold = 4;
+	CHECK(fs.enableScrub(threshold));
+	uint32_t seed = 1;
+	for (size_t i = 0; i < sizeof(data); i++) {
+		seed = seed * 1103515245 + 12345;
+		data[i] = seed >> 16;
+	}
+	File f = fs.open("data.bin", FILE_WRITE_BEGIN);
+	CHECK(f.write(data, sizeof(data)) == sizeof(data));
+	f.close();
+
+	// a weak block: one flip in every page
+	const int row = find_row(data + 150000, 64);
+	CHECK(row >= 0);
+	if (row < 0) return sim_result("nand_scrub");
+	const uint32_t block = row / nand_pages_per_block();
+	for (uint32_t p = 0; p < nand_pages_per_block(); p++) {
+		nand_flip_bits(0, block * nand_pages_per_block() + p, 0, 1);
+	}
+
+	LittleFSWearStats stats;
+	for (uint32_t i = 0; i < threshold; i++) CHECK(read_file(fs));
+	CHECK(fs.correctedCount(block) >= threshold);
+	CHECK(fs.getWearStats(stats));
+	CHECK(stats.scrubPending == 1);
+	CHECK(stats.scrubbed == 0);
+
+	int calls = 0;
+	while (fs.maintenance(100000) && calls < 1000) calls++;
+	CHECK(fs.getWearStats(stats));
+	printf("moved in %d maintenance(100 ms) calls, %u corrected reads\n", calls + 1,
+	  (unsigned)stats.totalCorrected);
+	CHECK(stats.scrubbed == 1);
+	// the old block counts until it's erased
+	CHECK(fs.enableBackgroundErase());
+	while (fs.maintenance(1000000) && calls < 2000) calls++;
+	CHECK(fs.getWearStats(stats));
+	CHECK(stats.scrubPending == 0);
+	CHECK(fs.correctedCount(block) == 0);
+
+	const uint64_t corrected = stats.totalCorrected;
+	CHECK(read_file(fs));
+	CHECK(fs.getWearStats(stats));
+	CHECK(stats.totalCorrected == corrected);
+
+	LittleFS_SPINAND fs2;
+	CHECK(fs2.begin(10));
+	CHECK(read_file(fs2));
+	CHECK(fs2.badBlocks() == 0);
+	CHECK(nand_violations() == 0);
+	return sim_result("nand_scrub");
+}
@@ -0,0 +1,53 @@
+// Sub-page programming.  With setSubPageProgram() littlefs programs
+// 512 byte ECC sectors, so small commits use a quarter of a page.  The
+// emulator counts more than 4 partial programs of a page, or programs
+// over programmed bits, as violations.
+#include <LittleFS.h>
+#include "spi_nand.h"
+
+struct result {
+	double ms;
+	uint64_t pages, erases;
+};
+
+static result run(bool subPage)
+{
+	nand_init(NAND_W25N01);
+	LittleFS_SPINAND fs;
+	if (subPage) fs.setSubPageProgram();
+	CHECK(fs.begin(10));
+	CHECK(fs.mkdir("small"));
+	nand_reset_stats();
+	const double t = sim_now;
+	char name[32], text[64];
+	for (int i = 0; i < 250; i++) {
+		snprintf(name, sizeof(name), "small/file%d.txt", i);
+		snprintf(text, sizeof(text), "small file %d\n", i);
+		File f = fs.open(name, FILE_WRITE);
+		CHECK(f.write(text, strlen(text)) == strlen(text));
+		f.close();
+	}
+	result r = {(sim_now - t) / 1000, nand_stats.pagesConsumed, nand_stats.blockErases};
+	CHECK(nand_violations() == 0);
+
+	LittleFS_SPINAND fs2;
+	if (subPage) fs2.setSubPageProgram();
+	CHECK(fs2.begin(10));
+	File f = fs2.open("small/file249.txt");
+	CHECK(f.size() == strlen("small file 249\n"));
+	f.close();
+	return r;
+}
+
+int main()
+{
+	const result page = run(false);
+	const result sub = run(true);
+	printf("250 small files: pages %u -> %u, erases %u -> %u, %.0f -> %.0f s\n",
+	  (unsigned)page.pages, (unsigned)sub.pages, (unsigned)page.erases,
+	  (unsigned)sub.erases, page.ms / 1000, sub.ms / 1000);
+	CHECK(sub.pages * 3 < page.pages);
+	CHECK(sub.erases * 3 < page.erases);
+	CHECK(sub.ms < page.ms);
+	return sim_result("nand_subpage");
+}
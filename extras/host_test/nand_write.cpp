@@ -0,0 +1,57 @@
+// Sequential writes.  Program Execute doesn't wait for tPROG, erase
+// doesn't read the block first, and with a RAM budget littlefs programs
+// several pages per call.  littlefs reads back each page it programs, so
+// the limit is loading the page, tPROG and reading it back.
+#include <LittleFS.h>
+#include "spi_nand.h"
+
+static uint8_t buf[4096];
+static const uint32_t fileSize = 4 << 20;
+static const double tPROG = 250; // as in sim/spi_nand.cpp
+
+static void test_write(uint32_t ramBudget)
+{
+	nand_init(NAND_W25N01);
+	LittleFS_SPINAND fs;
+	if (ramBudget) {
+		CHECK(fs.begin(10, SPI, ramBudget, LittleFS::WORKLOAD_LOGGING));
+	} else {
+		CHECK(fs.begin(10));
+	}
+	nand_reset_stats();
+	const double t = sim_now;
+	File f = fs.open("data.bin", FILE_WRITE_BEGIN);
+	for (uint32_t pos = 0; pos < fileSize; pos += sizeof(buf)) {
+		for (uint32_t i = 0; i < sizeof(buf); i++) buf[i] = (pos + i) * 13;
+		f.write(buf, sizeof(buf));
+	}
+	f.close();
+	const double rate = (fileSize / 1024) / ((sim_now - t) / 1e6);
+	const double page = 2048 * nand_byte_us;
+	const double limit = 2048 / 1024 / ((page + tPROG + nand_tRD + page) / 1e6);
+	printf("%s: %4.0f KB/s, %.0f%% of %.0f KB/s, %u page programs, %u page reads, %u erases\n",
+	  ramBudget ? "setTuning(32768, WORKLOAD_LOGGING)" : "default settings",
+	  rate, rate / limit * 100, limit, (unsigned)nand_stats.pagePrograms,
+	  (unsigned)nand_stats.pageReads, (unsigned)nand_stats.blockErases);
+	CHECK(rate > limit * 0.9);
+	// the read back of each page, metadata and larger cache fills, but
+	// no blank checks, which read every page again
+	CHECK(nand_stats.pageReads < nand_stats.pagePrograms * 1.3);
+	CHECK(nand_violations() == 0);
+
+	f = fs.open("data.bin");
+	bool ok = f.size() == fileSize;
+	for (uint32_t pos = 0; pos < fileSize && ok; pos += sizeof(buf)) {
+		ok = f.read(buf, sizeof(buf)) == sizeof(buf);
+		for (uint32_t i = 0; i < sizeof(buf) && ok; i++) ok = buf[i] == (uint8_t)((pos + i) * 13);
+	}
+	f.close();
+	CHECK(ok);
+}
+
+int main()
+{
+	test_write(0);
+	test_write(32768);
+	return sim_result("nand_write");
+}
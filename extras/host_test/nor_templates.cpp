@@ -0,0 +1,142 @@
+// LittleFS_SPIFlashT against LittleFS_SPIFlash on the emulated W25Q128JV.
+// Each reads the files the other wrote, the template refuses another
+// chip, and the host CPU time of their reads and page programs is
+// compared, with programs taking no time.  The times include the
+// emulator's, which is the same for both.
+#include <LittleFS.h>
+#include "spi_nor.h"
+#include "fail_alloc.h"
+
+static const uint32_t w25q128jv = 0xEF4018, chipSize = 16 << 20;
+
+static void make_text(char *text, size_t size, const char *writer, int i)
+{
+	snprintf(text, size, "file %d, written by %s\n", i, writer);
+}
+
+static void write_files(LittleFS &fs, const char *writer)
+{
+	char name[16], text[64];
+	for (int i = 0; i < 20; i++) {
+		snprintf(name, sizeof(name), "%s%d.txt", writer, i);
+		make_text(text, sizeof(text), writer, i);
+		File f = fs.open(name, FILE_WRITE_BEGIN);
+		CHECK(f.write(text, strlen(text)) == strlen(text));
+		f.close();
+	}
+	static uint8_t buf[65536];
+	for (size_t i = 0; i < sizeof(buf); i++) buf[i] = i * 13 + writer[0];
+	snprintf(name, sizeof(name), "%s.bin", writer);
+	File f = fs.open(name, FILE_WRITE_BEGIN);
+	CHECK(f.write(buf, sizeof(buf)) == sizeof(buf));
+	f.close();
+}
+
+static bool read_files(LittleFS &fs, const char *writer)
+{
+	char name[16], text[64], want[64];
+	for (int i = 0; i < 20; i++) {
+		snprintf(name, sizeof(name), "%s%d.txt", writer, i);
+		make_text(want, sizeof(want), writer, i);
+		memset(text, 0, sizeof(text));
+		File f = fs.open(name);
+		if (!f || f.read(text, sizeof(text)) != strlen(want) || strcmp(text, want)) return false;
+		f.close();
+	}
+	static uint8_t buf[65536];
+	snprintf(name, sizeof(name), "%s.bin", writer);
+	File f = fs.open(name);
+	if (!f || f.read(buf, sizeof(buf)) != sizeof(buf)) return false;
+	f.close();
+	for (size_t i = 0; i < sizeof(buf); i++) {
+		if (buf[i] != (uint8_t)(i * 13 + writer[0])) return false;
+	}
+	return true;
+}
+
+static void test_interop()
+{
+	nor_init(w25q128jv, chipSize);
+	{
+		LittleFS_SPIFlashT<LittleFS_W25Q128JV> fs;
+		CHECK(fs.begin(6));
+		write_files(fs, "t");
+	}
+	{
+		LittleFS_SPIFlash fs;
+		CHECK(fs.begin(6));
+		CHECK(read_files(fs, "t"));
+		write_files(fs, "r");
+	}
+	LittleFS_SPIFlashT<LittleFS_W25Q128JV> fs;
+	CHECK(fs.begin(6));
+	CHECK(read_files(fs, "t"));
+	CHECK(read_files(fs, "r"));
+	CHECK(nor_stats.busyViolations == 0 && nor_stats.overwriteViolations == 0);
+
+	nor_init(0xEF4017, 8 << 20); // W25Q64JV
+	LittleFS_SPIFlashT<LittleFS_W25Q128JV> other;
+	CHECK(!other.begin(6));
+	LittleFS_SPIFlashT<LittleFS_W25Q64JV> right;
+	CHECK(right.begin(6));
+}
+
+// Calls the driver's read and prog callbacks directly
+template <class Base>
+class Probe : public Base
+{
+public:
+	// µs of CPU per 256 byte read and per page program
+	void time(double &readUs, double &progUs) {
+		static uint8_t buf[256];
+		const int count = 20000;
+		const lfs_block_t blocks = config.block_count;
+		const uint32_t pages = config.block_size / 256;
+		double t = cpu_ms();
+		for (int i = 0; i < count; i++) {
+			config.read(&config, i % blocks, (i / blocks) % pages * 256, buf, 256);
+		}
+		readUs = (cpu_ms() - t) * 1000 / count;
+		for (lfs_block_t b = 0; b * pages < (lfs_block_t)count; b++) config.erase(&config, b);
+		memset(buf, 0x5A, sizeof(buf));
+		t = cpu_ms();
+		for (int i = 0; i < count; i++) {
+			config.prog(&config, i / pages, i % pages * 256, buf, 256);
+		}
+		progUs = (cpu_ms() - t) * 1000 / count;
+	}
+private:
+	using Base::config;
+};
+
+template <class FS>
+static void best_time(double &readUs, double &progUs)
+{
+	readUs = progUs = 1e9;
+	for (int run = 0; run < 5; run++) {
+		nor_init(w25q128jv, chipSize);
+		Probe<FS> fs;
+		CHECK(fs.begin(6));
+		double r, p;
+		fs.time(r, p);
+		if (r < readUs) readUs = r;
+		if (p < progUs) progUs = p;
+	}
+}
+
+int main()
+{
+	test_interop();
+	const double tPP = nor_tPP;
+	nor_tPP = 0;
+	double runtimeRead, runtimeProg, fixedRead, fixedProg;
+	best_time<LittleFS_SPIFlash>(runtimeRead, runtimeProg);
+	best_time<LittleFS_SPIFlashT<LittleFS_W25Q128JV>>(fixedRead, fixedProg);
+	nor_tPP = tPP;
+	printf("host CPU, with the emulator   256 byte read  page program\n");
+	printf("  LittleFS_SPIFlash            %6.3f us     %6.3f us\n", runtimeRead, runtimeProg);
+	printf("  LittleFS_SPIFlashT           %6.3f us     %6.3f us\n", fixedRead, fixedProg);
+	CHECK(fixedRead < runtimeRead * 1.1);
+	CHECK(fixedProg < runtimeProg * 1.1);
+	return sim_result("nor_templates");
+}
@@ -0,0 +1,91 @@
+// The Tuning_Benchmark example on the emulated W25Q128JV: the default
+// settings against each workload with a 16K RAM budget.  The rates are
+// in emulated time, and are the ones quoted in the example.  Writes are
+// limited by page programs whatever the cache size, and a 16 byte read
+// loads a whole cache, so the larger caches of the mixed and logging
+// settings make random reads slower.
+#include <LittleFS.h>
+#include "spi_nor.h"
+
+static const uint32_t w25q128jv = 0xEF4018, chipSize = 16 << 20;
+static uint8_t buf[4096];
+
+struct result {
+	double writeKB, readKB, randReads, creates;
+};
+
+static double rate(double t, double count)
+{
+	return count / ((sim_now - t) / 1e6);
+}
+
+static result run_row(LittleFS &fs)
+{
+	const int total = 256 * 1024;
+	CHECK(fs.quickFormat());
+	for (unsigned int i = 0; i < sizeof(buf); i++) buf[i] = i * 7;
+	result r;
+
+	double t = sim_now;
+	File f = fs.open("bench.bin", FILE_WRITE_BEGIN);
+	for (int n = 0; n < total; n += 512) f.write(buf, 512);
+	f.close();
+	r.writeKB = rate(t, total / 1024);
+
+	t = sim_now;
+	f = fs.open("bench.bin");
+	int bytes = 0, n;
+	while ((n = f.read(buf, sizeof(buf))) > 0) bytes += n;
+	r.readKB = rate(t, total / 1024);
+	CHECK(bytes == total);
+
+	uint32_t seed = 1234;
+	t = sim_now;
+	for (int i = 0; i < 500; i++) {
+		seed = seed * 1103515245 + 12345;
+		f.seek((seed >> 8) % (total / 16) * 16);
+		f.read(buf, 16);
+	}
+	r.randReads = rate(t, 500);
+	f.close();
+
+	t = sim_now;
+	for (int i = 0; i < 50; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "f%d.txt", i);
+		f = fs.open(name, FILE_WRITE);
+		f.write("small file contents", 19);
+		f.close();
+	}
+	r.creates = rate(t, 50);
+	return r;
+}
+
+static result row(const char *name, uint32_t ramBudget, LittleFS::workload_t workload)
+{
+	nor_init(w25q128jv, chipSize);
+	LittleFS_SPIFlash fs;
+	if (ramBudget) {
+		CHECK(fs.begin(6, SPI, ramBudget, workload));
+	} else {
+		CHECK(fs.begin(6));
+	}
+	const result r = run_row(fs);
+	printf("  %-12s %10.0f %10.0f %13.0f %10.0f\n", name, r.writeKB, r.readKB, r.randReads, r.creates);
+	CHECK(nor_stats.busyViolations == 0 && nor_stats.overwriteViolations == 0);
+	return r;
+}
+
+int main()
+{
+	printf("  config       write KB/s  read KB/s  rand reads/s  creates/s\n");
+	const result def = row("default", 0, LittleFS::WORKLOAD_MIXED);
+	const result mixed = row("mixed", 16384, LittleFS::WORKLOAD_MIXED);
+	const result logging = row("logging", 16384, LittleFS::WORKLOAD_LOGGING);
+	const result random = row("random read", 16384, LittleFS::WORKLOAD_RANDOM_READ);
+	CHECK(mixed.writeKB > def.writeKB * 0.95 && logging.writeKB > def.writeKB * 0.95);
+	CHECK(mixed.readKB > def.readKB * 0.95 && logging.readKB > def.readKB * 0.95);
+	CHECK(random.randReads > def.randReads * 0.95);
+	CHECK(logging.randReads < mixed.randReads && mixed.randReads < def.randReads);
+	return sim_result("nor_tuning");
+}
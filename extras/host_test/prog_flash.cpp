@@ -0,0 +1,204 @@
+// Teensy 4.1 program flash: write combining into 256 byte pages, erases
+// kept inside the filesystem's region and aligned to the block size,
+// blank sectors not erased again, erases moved out of writes by
+// background erase, and a combined page which fails its verify.
+#include <LittleFS.h>
+#include "program_flash.h"
+
+// Counts littlefs's prog calls, each of which was a page program command
+// (or two, where it crossed a page) before write combining
+class Probe : public LittleFS_Program
+{
+public:
+	bool begin(uint32_t size) {
+		if (!LittleFS_Program::begin(size)) return false;
+		inner = config.prog;
+		config.prog = &count_prog;
+		return true;
+	}
+	static uint32_t progs;
+private:
+	static int count_prog(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size) {
+		progs += (offset % 256 + size + 255) / 256;
+		return inner(c, block, offset, buffer, size);
+	}
+	static int (*inner)(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size);
+};
+uint32_t Probe::progs;
+int (*Probe::inner)(const struct lfs_config *, lfs_block_t, lfs_off_t, const void *, lfs_size_t);
+
+static uint8_t record[64];
+
+static void make_record(uint32_t n)
+{
+	for (size_t i = 0; i < sizeof(record); i++) record[i] = n * 31 + i;
+}
+
+static bool check_log(LittleFS &fs, const char *name, uint32_t records)
+{
+	File f = fs.open(name);
+	if (!f || f.size() != records * sizeof(record)) return false;
+	uint8_t buf[sizeof(record)];
+	for (uint32_t n = 0; n < records; n++) {
+		make_record(n);
+		if (f.read(buf, sizeof(buf)) != sizeof(buf) || memcmp(buf, record, sizeof(buf))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// A logger writing 64 byte records.  littlefs programs 128 bytes at a
+// time, each a page program command without combining.
+static void test_combining(bool flushEach)
+{
+	printf("combining, %s\n", flushEach ? "flush after each record" : "no flush");
+	pf_init();
+	Probe fs;
+	CHECK(fs.begin(1 << 20));
+	pf_reset_stats();
+	Probe::progs = 0;
+	File f = fs.open("log.bin", FILE_WRITE);
+	// each sync copies the part of the last block written so far
+	const uint32_t records = flushEach ? 400 : 4000;
+	for (uint32_t n = 0; n < records; n++) {
+		make_record(n);
+		f.write(record, sizeof(record));
+		if (flushEach) f.flush();
+	}
+	f.close();
+	printf("  %u page programs combined into %u, %u partial\n", Probe::progs,
+	  (unsigned)pf_stats.writes, (unsigned)pf_stats.partialWrites);
+	CHECK(pf_stats.writes * 10 <= Probe::progs * (flushEach ? 8 : 6));
+	CHECK(pf_stats.overwrites == 0);
+	CHECK(check_log(fs, "log.bin", records));
+	Probe fs2;
+	CHECK(fs2.begin(1 << 20));
+	CHECK(check_log(fs2, "log.bin", records));
+}
+
+// Files rewritten until every block has been erased several times.
+// Flash outside the filesystem is filled with zeros, as if it held the
+// program, and must not change.
+static void test_placement(uint32_t blockSize, uint32_t offset)
+{
+	printf("erase placement, %u byte blocks, offset %u\n", blockSize, offset);
+	pf_init();
+	uint8_t *mem = pf_memory();
+	const uint32_t size = blockSize == 65536 ? 1024 * 1024 : 512 * 1024;
+	const uint32_t start = offset ? offset : 0x7C0000 - size;
+	memset(mem, 0, start);
+	memset(mem + start + size, 0, 0x800000 - start - size);
+	Probe fs;
+	fs.setBlockSize(blockSize);
+	fs.setOffset(offset);
+	CHECK(fs.begin(size));
+	CHECK(pf_stats.erases == 0); // formatting blank flash needs no erase
+	static uint8_t data[20000];
+	char name[16];
+	for (int pass = 0; pass < 40; pass++) {
+		for (int i = 0; i < 4; i++) {
+			for (size_t j = 0; j < sizeof(data); j++) data[j] = pass + i + j;
+			snprintf(name, sizeof(name), "f%d", i);
+			File f = fs.open(name, FILE_WRITE_BEGIN);
+			CHECK(f.write(data, sizeof(data)) == sizeof(data));
+			f.truncate(sizeof(data));
+			f.close();
+		}
+	}
+	printf("  %u erases\n", (unsigned)pf_stats.erases);
+	CHECK(pf_stats.erases > size / blockSize);
+	CHECK(pf_stats.overwrites == 0);
+	bool outside = false;
+	for (uint32_t i = 0; i < 0x800000; i++) {
+		if ((i < start || i >= start + size) && mem[i] != 0) outside = true;
+	}
+	CHECK(!outside);
+}
+
+// A logger writing bursts of 64 byte records to a new file each time,
+// keeping the last two, with a safe point between bursts.  Without
+// background erase littlefs erases blocks in the middle of the bursts.
+static void test_background(bool background)
+{
+	printf("logging in bursts, background erase %s\n", background ? "on" : "off");
+	pf_init();
+	Probe fs;
+	CHECK(fs.begin(1024 * 1024));
+	if (background) CHECK(fs.enableBackgroundErase());
+	double longest = 0;
+	uint64_t erasesInWrites = 0;
+	char name[16];
+	const uint32_t records = 1500;
+	for (int burst = 0; burst < 24; burst++) {
+		if (background) fs.maintenance(1000000); // safe point
+		if (burst >= 2) {
+			snprintf(name, sizeof(name), "log%d", burst - 2);
+			fs.remove(name);
+		}
+		snprintf(name, sizeof(name), "log%d", burst);
+		File f = fs.open(name, FILE_WRITE);
+		for (uint32_t n = 0; n < records; n++) {
+			make_record(n);
+			const double t = sim_now;
+			const uint64_t erases = pf_stats.erases;
+			f.write(record, sizeof(record));
+			if (n == records - 1) f.close();
+			erasesInWrites += pf_stats.erases - erases;
+			if (sim_now - t > longest) longest = sim_now - t;
+			if (background) fs.maintenance(1000); // from loop(), never erases
+		}
+	}
+	printf("  %u erases during writes, longest write %.1f ms\n",
+	  (unsigned)erasesInWrites, longest / 1000);
+	if (background) {
+		CHECK(erasesInWrites == 0);
+		CHECK(longest < 1000);
+	} else {
+		CHECK(erasesInWrites > 0);
+		CHECK(longest >= 150000);
+	}
+	CHECK(check_log(fs, "log23", records));
+}
+
+// A combined page which doesn't match after it's written is reported to
+// littlefs, which moves the data to another block
+static void test_verify(long at)
+{
+	printf("verify failure at partial write %ld\n", at);
+	pf_init();
+	Probe fs;
+	CHECK(fs.begin(1 << 20));
+	pf_reset_stats();
+	pf_corrupt_at = at;
+	File f = fs.open("log.bin", FILE_WRITE);
+	const uint32_t records = 1000;
+	for (uint32_t n = 0; n < records; n++) {
+		make_record(n);
+		CHECK(f.write(record, sizeof(record)) == sizeof(record));
+		f.flush();
+	}
+	f.close();
+	CHECK((long)pf_stats.partialWrites > at); // the failure happened
+	CHECK(check_log(fs, "log.bin", records));
+	Probe fs2;
+	CHECK(fs2.begin(1 << 20));
+	CHECK(check_log(fs2, "log.bin", records));
+}
+
+int main()
+{
+	test_combining(false);
+	test_combining(true);
+	test_placement(4096, 0);
+	test_placement(32768, 0);
+	test_placement(65536, 0);
+	test_placement(4096, 0x100000);
+	test_placement(65536, 0x200000);
+	test_background(false);
+	test_background(true);
+	for (long at = 1; at < 1000; at += 97) test_verify(at);
+	return sim_result("prog_flash");
+}
@@ -0,0 +1,49 @@
+// Writing past the end of a file fills the gap with zeros.  It's
+// written a cache line at a time, or a byte at a time when there's no
+// memory for the buffer, which was how every gap was filled before.
+#include <LittleFS.h>
+#include "sim.h"
+#include "fail_alloc.h"
+
+static uint8_t disk[4 << 20];
+static uint8_t buf[1 << 20];
+
+// Best of a few runs of creating a 1 MB file by writing its last byte
+static double gap_ms(LittleFS &fs, bool fallback)
+{
+	const uint32_t size = sizeof(buf);
+	double best = 1e9;
+	for (int run = 0; run < 5; run++) {
+		fs.remove("gap.bin");
+		File f = fs.open("gap.bin", FILE_WRITE_BEGIN);
+		const double t = cpu_ms();
+		if (fallback) fail_alloc_size = 256; // LittleFS_RAM's cache size
+		f.seek(size - 1);
+		const uint8_t last = 0x5A;
+		f.write(&last, 1);
+		f.close();
+		fail_alloc_size = 0;
+		const double ms = cpu_ms() - t;
+		if (ms < best) best = ms;
+
+		f = fs.open("gap.bin");
+		memset(buf, 0xFF, size);
+		bool ok = f.size() == size && f.read(buf, size) == size && buf[size - 1] == 0x5A;
+		for (uint32_t i = 0; i < size - 1 && ok; i++) ok = buf[i] == 0;
+		f.close();
+		CHECK(ok);
+	}
+	return best;
+}
+
+int main()
+{
+	LittleFS_RAM fs;
+	CHECK(fs.begin(disk, sizeof(disk)));
+	const double bytes = gap_ms(fs, true);
+	const double lines = gap_ms(fs, false);
+	printf("1 MB file by seeking to its last byte: %.1f ms a byte at a time, %.1f ms a cache line at a time\n",
+	  bytes, lines);
+	CHECK(lines * 3 < bytes);
+	return sim_result("ram_gap");
+}
@@ -0,0 +1,174 @@
+// FILE_WRITE_INPLACE on a RAM disk: 64 byte record updates in a 4 KB
+// file, against copy on write with a flush after each update, and an
+// in place update cut short after each of its programs.
+#include <LittleFS.h>
+#include "sim.h"
+#include "fail_alloc.h"
+
+static const uint32_t recordSize = 64, records = 64;
+
+// Counts the bytes programmed, and can keep a copy of the disk after
+// each program
+class Probe : public LittleFS_RAM
+{
+public:
+	bool begin(void *ptr, uint32_t size) {
+		if (!LittleFS_RAM::begin(ptr, size)) return false;
+		inner = config.prog;
+		config.prog = &count_prog;
+		disk = (uint8_t *)ptr;
+		diskSize = size;
+		return true;
+	}
+	static uint64_t progBytes;
+	static uint8_t *snapshots[64];
+	static int snapshotCount;
+	static bool snapshot;
+private:
+	static int count_prog(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size) {
+		progBytes += size;
+		const int r = inner(c, block, offset, buffer, size);
+		if (snapshot && snapshotCount < 64) {
+			snapshots[snapshotCount] = (uint8_t *)realloc(snapshots[snapshotCount], diskSize);
+			memcpy(snapshots[snapshotCount++], disk, diskSize);
+		}
+		return r;
+	}
+	static int (*inner)(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size);
+	static uint8_t *disk;
+	static uint32_t diskSize;
+};
+uint64_t Probe::progBytes;
+uint8_t *Probe::snapshots[64];
+int Probe::snapshotCount;
+bool Probe::snapshot;
+uint8_t *Probe::disk;
+uint32_t Probe::diskSize;
+int (*Probe::inner)(const struct lfs_config *, lfs_block_t, lfs_off_t, const void *, lfs_size_t);
+
+static void make_record(uint8_t *rec, uint32_t n, uint32_t version)
+{
+	for (uint32_t i = 0; i < recordSize; i++) rec[i] = n * 5 + version * 17 + i;
+}
+
+static bool create(LittleFS &fs)
+{
+	uint8_t rec[recordSize];
+	File f = fs.open("records.bin", FILE_WRITE_BEGIN);
+	if (!f) return false;
+	for (uint32_t n = 0; n < records; n++) {
+		make_record(rec, n, 0);
+		if (f.write(rec, recordSize) != recordSize) return false;
+	}
+	f.close();
+	return true;
+}
+
+// Each record as of version[n]
+static bool check(LittleFS &fs, const uint32_t *version)
+{
+	uint8_t rec[recordSize], want[recordSize];
+	File f = fs.open("records.bin");
+	if (!f || f.size() != records * recordSize) return false;
+	for (uint32_t n = 0; n < records; n++) {
+		make_record(want, n, version[n]);
+		if (f.read(rec, recordSize) != recordSize || memcmp(rec, want, recordSize)) return false;
+	}
+	return true;
+}
+
+struct result {
+	double perSecond;
+	double progBytes;
+};
+
+static result updates(uint32_t diskSize, uint8_t mode, uint32_t count)
+{
+	uint8_t *disk = (uint8_t *)calloc(1, diskSize);
+	Probe fs;
+	CHECK(fs.begin(disk, diskSize));
+	CHECK(create(fs));
+	uint32_t version[records] = {};
+	uint8_t rec[recordSize];
+	File f = fs.open("records.bin", mode);
+	Probe::progBytes = 0;
+	const double t = cpu_ms();
+	for (uint32_t i = 0; i < count; i++) {
+		const uint32_t n = (i * 37) % records;
+		make_record(rec, n, ++version[n]);
+		f.seek(n * recordSize);
+		f.write(rec, recordSize);
+		if (mode != FILE_WRITE_INPLACE) f.flush();
+	}
+	const double ms = cpu_ms() - t;
+	f.close();
+	CHECK(check(fs, version));
+	free(disk);
+	return result{count / (ms / 1000), (double)Probe::progBytes / count};
+}
+
+// Copies of the disk after each program of one update, as if power
+// was lost there.  begin() finishes or drops the update.
+static void test_power_loss()
+{
+	const uint32_t diskSize = 65536;
+	uint8_t *disk = (uint8_t *)calloc(1, diskSize);
+	Probe fs;
+	fs.setPersistent();
+	CHECK(fs.begin(disk, diskSize));
+	CHECK(create(fs));
+	File f = fs.open("records.bin", FILE_WRITE_INPLACE);
+	uint8_t rec[recordSize];
+	// the first update creates the journal file
+	make_record(rec, 0, 1);
+	CHECK(f.write(rec, recordSize) == recordSize);
+	const uint32_t n = 10;
+	make_record(rec, n, 1);
+	f.seek(n * recordSize);
+	Probe::snapshotCount = 0;
+	Probe::snapshot = true;
+	CHECK(f.write(rec, recordSize) == recordSize);
+	Probe::snapshot = false;
+	f.close();
+	printf("update cut short after each of its %d programs:", Probe::snapshotCount);
+	CHECK(Probe::snapshotCount >= 4 && Probe::snapshotCount < 64);
+	int oldCount = 0, newCount = 0;
+	for (int i = 0; i < Probe::snapshotCount; i++) {
+		LittleFS_RAM fs2;
+		fs2.setPersistent();
+		CHECK(fs2.begin(Probe::snapshots[i], diskSize));
+		uint32_t version[records] = {1};
+		if (check(fs2, version)) {
+			oldCount++;
+		} else {
+			version[n] = 1;
+			if (check(fs2, version)) {
+				newCount++;
+			} else {
+				printf(" program %d lost the record", i + 1);
+				CHECK(false);
+			}
+		}
+	}
+	printf(" %d old, %d new\n", oldCount, newCount);
+	CHECK(newCount > 0);
+	free(disk);
+}
+
+int main()
+{
+	const result cow = updates(65536, FILE_WRITE_BEGIN, 20000);
+	const result inplace = updates(65536, FILE_WRITE_INPLACE, 20000);
+	printf("64 KB disk, 64 byte records: %.0f bytes programmed per update, in place %.0f\n",
+	  cow.progBytes, inplace.progBytes);
+	CHECK(inplace.progBytes * 4 < cow.progBytes);
+	const result cowLarge = updates(1 << 20, FILE_WRITE_BEGIN, 20000);
+	const result inplaceLarge = updates(1 << 20, FILE_WRITE_INPLACE, 200000);
+	printf("1 MB disk: %.0f updates/s, in place %.0f (%.0f times)\n",
+	  cowLarge.perSecond, inplaceLarge.perSecond, inplaceLarge.perSecond / cowLarge.perSecond);
+	CHECK(inplaceLarge.perSecond > cowLarge.perSecond * 4);
+	test_power_loss();
+	return sim_result("ram_inplace");
+}
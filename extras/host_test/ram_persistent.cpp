@@ -0,0 +1,178 @@
+// Persistent RAM disk.  A copy of the memory after each program while a
+// log is appended and flushed stands for a warm reboot at that point:
+// begin() must mount it with the other file intact and the log at a
+// flushed size.  A bad or mismatched header, or no setPersistent(),
+// formats.
+#include <LittleFS.h>
+#include "sim.h"
+
+static const uint32_t diskSize = 65536, recordSize = 48, records = 40;
+
+struct snapshot {
+	uint8_t *mem;
+	uint32_t flushed;	// log size flushed before this program
+};
+static snapshot snaps[2000];
+static int snapCount;
+static uint32_t flushedSize;
+
+class Probe : public LittleFS_RAM
+{
+public:
+	bool begin(void *ptr, uint32_t size) {
+		if (!LittleFS_RAM::begin(ptr, size)) return false;
+		inner = config.prog;
+		config.prog = &snap_prog;
+		disk = (uint8_t *)ptr;
+		return true;
+	}
+	static bool recording;
+private:
+	static int snap_prog(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size) {
+		const int r = inner(c, block, offset, buffer, size);
+		if (recording && snapCount < 2000) {
+			snaps[snapCount].mem = (uint8_t *)malloc(diskSize);
+			memcpy(snaps[snapCount].mem, disk, diskSize);
+			snaps[snapCount++].flushed = flushedSize;
+		}
+		return r;
+	}
+	static int (*inner)(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size);
+	static uint8_t *disk;
+};
+bool Probe::recording;
+uint8_t *Probe::disk;
+int (*Probe::inner)(const struct lfs_config *, lfs_block_t, lfs_off_t, const void *, lfs_size_t);
+
+static void make_record(uint8_t *rec, uint32_t n)
+{
+	for (uint32_t i = 0; i < recordSize; i++) rec[i] = n * 3 + i;
+}
+
+static const char keep[] = "calibration data, written once\n";
+
+static bool check_keep(LittleFS &fs)
+{
+	char buf[64] = {};
+	File f = fs.open("keep.txt");
+	if (!f) return false;
+	const size_t n = f.read(buf, sizeof(buf));
+	f.close();
+	return n == strlen(keep) && memcmp(buf, keep, n) == 0;
+}
+
+// The log holds whole records, and is either the size flushed before
+// the snapshot or the size of the flush in progress
+static bool check_log(LittleFS &fs, uint32_t flushed)
+{
+	File f = fs.open("log.bin");
+	if (!f) return flushed == 0;
+	const uint32_t size = f.size();
+	bool ok = size == flushed || size == flushed + recordSize;
+	uint8_t rec[recordSize], want[recordSize];
+	for (uint32_t n = 0; n < size / recordSize && ok; n++) {
+		make_record(want, n);
+		ok = f.read(rec, recordSize) == recordSize && memcmp(rec, want, recordSize) == 0;
+	}
+	f.close();
+	return ok;
+}
+
+static void test_resets(uint32_t ramBudget)
+{
+	printf("%s geometry\n", ramBudget ? "tuned" : "default");
+	static uint8_t disk[diskSize];
+	memset(disk, 0x5A, sizeof(disk)); // memory at power up
+	Probe fs;
+	fs.setPersistent();
+	if (ramBudget) fs.setTuning(ramBudget, LittleFS::WORKLOAD_LOGGING);
+	CHECK(fs.begin(disk, sizeof(disk)));
+	File f = fs.open("keep.txt", FILE_WRITE_BEGIN);
+	f.write(keep, strlen(keep));
+	f.close();
+
+	snapCount = 0;
+	flushedSize = 0;
+	Probe::recording = true;
+	f = fs.open("log.bin", FILE_WRITE);
+	uint8_t rec[recordSize];
+	for (uint32_t n = 0; n < records; n++) {
+		make_record(rec, n);
+		f.write(rec, recordSize);
+		f.flush();
+		flushedSize += recordSize;
+	}
+	f.close();
+	Probe::recording = false;
+
+	int bad = 0;
+	for (int i = 0; i < snapCount; i++) {
+		LittleFS_RAM fs2;
+		fs2.setPersistent();
+		if (ramBudget) fs2.setTuning(ramBudget, LittleFS::WORKLOAD_LOGGING);
+		if (!fs2.begin(snaps[i].mem, diskSize) || !check_keep(fs2)
+		  || !check_log(fs2, snaps[i].flushed)) {
+			if (bad++ < 5) printf("  reset after program %d lost data\n", i + 1);
+		}
+		free(snaps[i].mem);
+	}
+	printf("  reset after each of %d programs, %d bad\n", snapCount, bad);
+	CHECK(snapCount > (int)records);
+	CHECK(bad == 0);
+
+	// the whole log after a reset once it's closed
+	LittleFS_RAM fs3;
+	fs3.setPersistent();
+	if (ramBudget) fs3.setTuning(ramBudget, LittleFS::WORKLOAD_LOGGING);
+	CHECK(fs3.begin(disk, sizeof(disk)));
+	CHECK(check_keep(fs3));
+	CHECK(check_log(fs3, records * recordSize));
+}
+
+static void test_formats()
+{
+	printf("formatting\n");
+	static uint8_t disk[diskSize];
+	LittleFS_RAM fs;
+	fs.setPersistent();
+	CHECK(fs.begin(disk, sizeof(disk)));
+	File f = fs.open("keep.txt", FILE_WRITE_BEGIN);
+	f.write(keep, strlen(keep));
+	f.close();
+
+	LittleFS_RAM same;
+	same.setPersistent();
+	CHECK(same.begin(disk, sizeof(disk)));
+	CHECK(check_keep(same));
+
+	disk[5] ^= 0x10; // a bad header
+	LittleFS_RAM corrupt;
+	corrupt.setPersistent();
+	CHECK(corrupt.begin(disk, sizeof(disk)));
+	CHECK(!check_keep(corrupt));
+
+	f = corrupt.open("keep.txt", FILE_WRITE_BEGIN);
+	f.write(keep, strlen(keep));
+	f.close();
+	LittleFS_RAM smaller; // a changed size
+	smaller.setPersistent();
+	CHECK(smaller.begin(disk, sizeof(disk) / 2));
+	CHECK(!check_keep(smaller));
+
+	f = smaller.open("keep.txt", FILE_WRITE_BEGIN);
+	f.write(keep, strlen(keep));
+	f.close();
+	LittleFS_RAM plain; // not persistent
+	CHECK(plain.begin(disk, sizeof(disk) / 2));
+	CHECK(!check_keep(plain));
+}
+
+int main()
+{
+	test_resets(0);
+	test_resets(16384);
+	test_formats();
+	return sim_result("ram_persistent");
+}
@@ -0,0 +1,96 @@
+// RAM disk speed on the host.  littlefs reads a RAM disk's memory
+// directly, without read callbacks or read back checks of programs, and
+// a RAM budget selects large blocks with small prog units.  Clearing
+// config.memory after begin() gives the callbacks back, as every RAM
+// disk used them before.
+#include <LittleFS.h>
+#include "sim.h"
+#include "fail_alloc.h"
+
+static uint8_t disk[8 << 20];
+static uint8_t buf[65536];
+static const uint32_t fileSize = 4 << 20;
+
+class Probe : public LittleFS_RAM
+{
+public:
+	void useCallbacks() { config.memory = nullptr; }
+};
+
+struct result {
+	double writeMB, readMB, randomMs;
+};
+
+static result run(uint32_t ramBudget, bool callbacks)
+{
+	Probe fs;
+	if (ramBudget) {
+		CHECK(fs.begin(disk, sizeof(disk), ramBudget, LittleFS::WORKLOAD_MIXED));
+	} else {
+		CHECK(fs.begin(disk, sizeof(disk)));
+	}
+	if (callbacks) fs.useCallbacks();
+	result r;
+	double t = cpu_ms();
+	File f = fs.open("data.bin", FILE_WRITE_BEGIN);
+	for (uint32_t pos = 0; pos < fileSize; pos += sizeof(buf)) {
+		for (uint32_t i = 0; i < sizeof(buf); i += 4) *(uint32_t *)(buf + i) = pos + i;
+		f.write(buf, sizeof(buf));
+	}
+	f.close();
+	r.writeMB = 4 / ((cpu_ms() - t) / 1000);
+
+	t = cpu_ms();
+	f = fs.open("data.bin");
+	bool ok = f.size() == fileSize;
+	for (uint32_t pos = 0; pos < fileSize && ok; pos += sizeof(buf)) {
+		ok = f.read(buf, sizeof(buf)) == sizeof(buf);
+	}
+	r.readMB = 4 / ((cpu_ms() - t) / 1000);
+
+	uint32_t seed = 1;
+	t = cpu_ms();
+	for (int i = 0; i < 20000 && ok; i++) {
+		seed = seed * 1103515245 + 12345;
+		const uint32_t pos = (seed >> 8) % (fileSize / 64) * 64;
+		f.seek(pos);
+		ok = f.read(buf, 64) == 64 && *(uint32_t *)buf == pos;
+	}
+	r.randomMs = cpu_ms() - t;
+	f.close();
+	CHECK(ok);
+	return r;
+}
+
+// Best of a few runs
+static result best(uint32_t ramBudget, bool callbacks)
+{
+	result b = run(ramBudget, callbacks);
+	for (int i = 0; i < 2; i++) {
+		const result r = run(ramBudget, callbacks);
+		if (r.writeMB > b.writeMB) b.writeMB = r.writeMB;
+		if (r.readMB > b.readMB) b.readMB = r.readMB;
+		if (r.randomMs < b.randomMs) b.randomMs = r.randomMs;
+	}
+	return b;
+}
+
+static void print(const char *name, const result &r)
+{
+	printf("  %-28s %6.0f MB/s  %6.0f MB/s  %5.1f ms\n", name, r.writeMB, r.readMB, r.randomMs);
+}
+
+int main()
+{
+	const result callbacks = best(0, true);
+	const result direct = best(0, false);
+	const result profile = best(32768, false);
+	printf("  8 MB RAM disk                4M write     4M read  20k rand64\n");
+	print("callbacks, default settings", callbacks);
+	print("direct, default settings", direct);
+	print("direct, 32K budget profile", profile);
+	CHECK(direct.writeMB > callbacks.writeMB * 1.5);
+	CHECK(profile.writeMB > callbacks.writeMB * 3);
+	CHECK(profile.randomMs < callbacks.randomMs);
+	return sim_result("ram_profile");
+}
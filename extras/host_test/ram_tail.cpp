@@ -0,0 +1,60 @@
+// Writing into the middle of a file copies the rest of it.  It's copied
+// a cache line at a time, or a byte at a time when there's no memory for
+// the buffer, which was how every copy was done before.
+#include <LittleFS.h>
+#include "sim.h"
+#include "fail_alloc.h"
+
+static uint8_t disk[12 << 20]; // room for the old and new copies
+static uint8_t data[4 << 20];
+
+static bool check(LittleFS &fs, uint32_t size)
+{
+	static uint8_t buf[4 << 20];
+	File f = fs.open("data.bin");
+	const bool ok = f.size() == size && f.read(buf, size) == size && memcmp(buf, data, size) == 0;
+	f.close();
+	return ok;
+}
+
+// Best of a few runs of overwriting 16 bytes at offset 0
+static double patch_ms(LittleFS &fs, uint32_t size, uint32_t cacheSize, bool fallback)
+{
+	double best = 1e9;
+	for (int run = 0; run < 5; run++) {
+		File f = fs.open("data.bin", FILE_WRITE_BEGIN);
+		for (int i = 0; i < 16; i++) data[i] = run + i + (fallback ? 100 : 0);
+		const double t = cpu_ms();
+		if (fallback) fail_alloc_size = cacheSize;
+		f.write(data, 16);
+		f.close();
+		fail_alloc_size = 0;
+		const double ms = cpu_ms() - t;
+		if (ms < best) best = ms;
+		CHECK(check(fs, size));
+	}
+	return best;
+}
+
+static void test_size(uint32_t size)
+{
+	LittleFS_RAM fs;
+	CHECK(fs.begin(disk, sizeof(disk)));
+	for (uint32_t i = 0; i < size; i++) data[i] = i * 3 + (i >> 10);
+	File f = fs.open("data.bin", FILE_WRITE_BEGIN);
+	CHECK(f.write(data, size) == size);
+	f.close();
+	const uint32_t cacheSize = 256; // LittleFS_RAM's default
+	const double bytes = patch_ms(fs, size, cacheSize, true);
+	const double lines = patch_ms(fs, size, cacheSize, false);
+	printf("%u KB file, 16 bytes at offset 0: %.1f ms a byte at a time, %.1f ms a cache line at a time\n",
+	  size / 1024, bytes, lines);
+	CHECK(lines * 3 < bytes);
+}
+
+int main()
+{
+	test_size(1 << 20);
+	test_size(4 << 20);
+	return sim_result("ram_tail");
+}
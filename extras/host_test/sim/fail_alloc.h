@@ -0,0 +1,23 @@
+// Make malloc() of one size fail, to run littlefs's fallbacks for when
+// there's no memory for a temporary buffer.  Include in one file of a
+// test only, it replaces the C library's malloc().
+#pragma once
+#include <stdlib.h>
+#include <time.h>
+
+extern "C" void *__libc_malloc(size_t size);
+static size_t fail_alloc_size = 0;	// 0 fails nothing
+
+extern "C" void *malloc(size_t size)
+{
+	if (fail_alloc_size && size == fail_alloc_size) return NULL;
+	return __libc_malloc(size);
+}
+
+// Host CPU time, for comparing code paths which use the same media time
+static inline double cpu_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
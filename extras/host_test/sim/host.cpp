@@ -0,0 +1,16 @@
+// Globals of the Teensy core, shared by every test
+#include <Arduino.h>
+#include <SPI.h>
+#include "sim.h"
+
+Print Serial;
+teensy3_clock_class Teensy3Clock;
+SPIClass SPI;
+double sim_now = 0;
+int sim_failures = 0;
+
+int sim_result(const char *name)
+{
+	printf("%s: %s\n", name, sim_failures ? "FAIL" : "ok");
+	return sim_failures ? 1 : 0;
+}
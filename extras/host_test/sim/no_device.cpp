@@ -0,0 +1,21 @@
+// No SPI device, for the RAM disk tests
+#include <SPI.h>
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+	return 0xFF;
+}
+
+void SPIClass::transfer(void *buf, size_t count)
+{
+	memset(buf, 0xFF, count);
+}
+
+void SPIClass::transfer(const void *txbuf, void *rxbuf, size_t count)
+{
+	if (rxbuf) memset(rxbuf, 0xFF, count);
+}
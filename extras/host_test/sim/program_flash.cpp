@@ -0,0 +1,88 @@
+// Teensy 4.1 program flash emulator, see program_flash.h
+#include <SPI.h>
+#include <sys/mman.h>
+#include "program_flash.h"
+
+#define PF_BASE  0x60000000
+#define PF_SIZE  0x800000
+
+volatile uint32_t FLEXSPI2_REGS[64];
+pf_stats_t pf_stats;
+long pf_corrupt_at = -1;
+static uint8_t *mem;
+
+void pf_reset_stats()
+{
+	memset(&pf_stats, 0, sizeof(pf_stats));
+}
+
+// LittleFS_Program keeps 32 bit addresses, so the flash must be mapped
+// where it is on the Teensy, and the test built with -no-pie
+void pf_init()
+{
+	if (!mem) {
+		mem = (uint8_t *)mmap((void *)PF_BASE, PF_SIZE, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+		if (mem != (uint8_t *)PF_BASE) {
+			perror("pf_init: mmap");
+			exit(1);
+		}
+	}
+	memset(mem, 0xFF, PF_SIZE);
+	pf_corrupt_at = -1;
+	pf_reset_stats();
+}
+
+uint8_t * pf_memory()
+{
+	return mem;
+}
+
+static void stall(double us)
+{
+	sim_now += us;
+	pf_stats.stall += us;
+	if (us > pf_stats.maxStall) pf_stats.maxStall = us;
+}
+
+extern "C" void eepromemu_flash_write(void *addr, const void *data, uint32_t len)
+{
+	uint8_t *p = (uint8_t *)addr;
+	const uint8_t *d = (const uint8_t *)data;
+	if (((uintptr_t)p & 255) + len > 256) {
+		printf("eepromemu_flash_write: crosses a page at %p\n", p);
+		exit(1);
+	}
+	for (uint32_t i = 0; i < len; i++) {
+		if ((p[i] & d[i]) != d[i]) pf_stats.overwrites++;
+		p[i] &= d[i];
+	}
+	if (len < 256) {
+		if ((long)pf_stats.partialWrites == pf_corrupt_at) p[len - 1] = 0;
+		pf_stats.partialWrites++;
+	}
+	pf_stats.writes++;
+	pf_stats.bytes += len;
+	stall(30 + 1.45 * len); // about 400 us for a whole page
+}
+
+static void erase(void *addr, uint32_t size, double us)
+{
+	if ((uintptr_t)addr % size) {
+		printf("eepromemu_flash_erase: %p not aligned to %u\n", addr, (unsigned)size);
+		exit(1);
+	}
+	memset(addr, 0xFF, size);
+	pf_stats.erases++;
+	stall(us);
+}
+
+extern "C" void eepromemu_flash_erase_sector(void *addr) { erase(addr, 4096, 45000); }
+extern "C" void eepromemu_flash_erase_32K_block(void *addr) { erase(addr, 32768, 120000); }
+extern "C" void eepromemu_flash_erase_64K_block(void *addr) { erase(addr, 65536, 150000); }
+
+// no SPI devices
+void digitalWrite(uint8_t pin, uint8_t val) { }
+uint8_t SPIClass::transfer(uint8_t data) { return 0xFF; }
+void SPIClass::transfer(void *buf, size_t count) { memset(buf, 0xFF, count); }
+void SPIClass::transfer(const void *txbuf, void *rxbuf, size_t count) { if (rxbuf) memset(rxbuf, 0xFF, count); }
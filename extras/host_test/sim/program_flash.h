@@ -0,0 +1,25 @@
+// Teensy 4.1 program flash emulator: 8 MB mapped at 0x60000000, where the
+// FlexSPI maps it, written with the core's eepromemu_flash_* calls.  The
+// time spent in those calls is time the real CPU is stalled with
+// interrupts disabled, W25Q64JV typical figures.
+#pragma once
+#include "sim.h"
+
+struct pf_stats_t {
+	uint64_t writes;	// eepromemu_flash_write() calls
+	uint64_t partialWrites;	// of those, less than a whole 256 byte page
+	uint64_t bytes;
+	uint64_t erases;
+	uint64_t overwrites;	// programming a 0 bit back to 1
+	double stall;		// microseconds, total and longest
+	double maxStall;
+};
+extern pf_stats_t pf_stats;
+// partialWrites count of the write which drops its last byte to 0, as
+// if it failed to program, or -1
+extern long pf_corrupt_at;
+
+// Whole flash erased
+void pf_init();
+void pf_reset_stats();
+uint8_t * pf_memory();
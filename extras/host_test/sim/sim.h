@@ -0,0 +1,17 @@
+// Shared by the emulators and the tests
+#pragma once
+#include <Arduino.h>
+
+extern double sim_now;	// microseconds, advanced by the emulators
+extern int sim_failures;
+
+// Count a failure and carry on, so one run reports every problem
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		sim_failures++; \
+	} \
+} while (0)
+
+// Print the result, returns the exit code for main()
+int sim_result(const char *name);
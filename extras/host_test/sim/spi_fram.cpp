@@ -0,0 +1,102 @@
+// SPI FRAM emulator, see spi_fram.h
+#include <SPI.h>
+#include "spi_fram.h"
+
+fram_stats_t fram_stats;
+static const double byte_us = 8.0 / 30.0;	// 30 MHz SPI
+static const double cs_us = 0.1;
+
+static uint8_t *mem;
+static uint32_t jedec_id, memsize;
+static bool selected, wel;
+static uint32_t n, addr;
+static uint8_t cmd[4];
+
+void fram_reset_stats()
+{
+	memset(&fram_stats, 0, sizeof(fram_stats));
+}
+
+void fram_init(uint32_t jedec, uint32_t size)
+{
+	jedec_id = jedec;
+	memsize = size;
+	free(mem);
+	mem = (uint8_t *)malloc(size);
+	if (!mem) {
+		printf("fram_init: out of memory\n");
+		exit(1);
+	}
+	memset(mem, 0x5A, size);
+	wel = false;
+	fram_reset_stats();
+}
+
+uint8_t * fram_memory()
+{
+	return mem;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	sim_now += cs_us;
+	if (val == LOW) {
+		selected = true;
+		n = 0;
+	} else if (selected) {
+		selected = false;
+		if (n) {
+			if (cmd[0] == 0x06) wel = true;
+			if (cmd[0] == 0x02) wel = false;
+			fram_stats.commands++;
+		}
+		n = 0;
+	}
+}
+
+static uint8_t transfer(uint8_t in)
+{
+	sim_now += byte_us;
+	fram_stats.bytes++;
+	if (n < sizeof(cmd)) cmd[n] = in;
+	if (n == 3) addr = (cmd[1] << 16) | (cmd[2] << 8) | cmd[3];
+	uint8_t out = 0xFF;
+	switch (cmd[0]) {
+	case 0x9F: // 6 continuation codes, then the ID
+		if (n >= 1 && n <= 6) out = 0x7F;
+		if (n >= 7 && n <= 9) out = jedec_id >> (8 * (9 - n));
+		break;
+	case 0x03: // Read
+		if (n >= 4) out = mem[addr++ % memsize];
+		break;
+	case 0x02: // Write
+		if (n >= 4) {
+			if (wel) mem[addr % memsize] = in;
+			addr++;
+		}
+		break;
+	}
+	n++;
+	return out;
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+	return ::transfer(data);
+}
+
+void SPIClass::transfer(void *buf, size_t count)
+{
+	uint8_t *p = (uint8_t *)buf;
+	for (size_t i = 0; i < count; i++) p[i] = ::transfer(p[i]);
+}
+
+void SPIClass::transfer(const void *txbuf, void *rxbuf, size_t count)
+{
+	const uint8_t *tx = (const uint8_t *)txbuf;
+	uint8_t *rx = (uint8_t *)rxbuf;
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t data = ::transfer(tx ? tx[i] : 0xFF);
+		if (rx) rx[i] = data;
+	}
+}
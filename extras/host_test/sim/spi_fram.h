@@ -0,0 +1,16 @@
+// SPI FRAM emulator, Cypress CY15B108QN style: 3 byte addresses, no
+// erase, writes take effect at once.  The memory starts as a pattern, not
+// blank, as FRAM does.
+#pragma once
+#include "sim.h"
+
+struct fram_stats_t {
+	uint64_t bytes;		// SPI bytes transferred
+	uint64_t commands;
+};
+extern fram_stats_t fram_stats;
+
+// jedec is the 3 bytes after the 0x7F continuation codes
+void fram_init(uint32_t jedec, uint32_t size);
+void fram_reset_stats();
+uint8_t * fram_memory();
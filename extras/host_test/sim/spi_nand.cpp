@@ -0,0 +1,466 @@
+// Winbond SPI NAND emulator, see spi_nand.h
+#include <SPI.h>
+#include "spi_nand.h"
+
+nand_stats_t nand_stats;
+
+// Times in microseconds
+double nand_tRD = 25;		// page load with ECC
+static const double tPROG = 250;
+static const double tBERS = 2000;
+static const double tRST = 5;
+double nand_byte_us = 8.0 / 30.0;	// 30 MHz SPI
+static const double cs_us = 0.05;
+
+#define PAGES_PER_BLOCK   64
+#define DATA_SIZE         2048
+#define SECTORS           4
+#define LUT_ENTRIES       20
+#define MAX_DIES          2
+
+// status register 3 (0xC0)
+#define STAT_BUSY         0x01
+#define STAT_WEL          0x02
+#define STAT_EFAIL        0x04
+#define STAT_PFAIL        0x08
+#define STAT_LUTF         0x40
+// configuration register (0xB0)
+#define CONF_ECCE         0x10
+#define CONF_BUF          0x08
+
+struct die_t {
+	// stored inverted, so the calloc()ed memory reads as erased and
+	// pages never written don't use host memory
+	uint8_t *mem;
+	uint8_t *flips;		// per ECC sector
+	uint8_t *nop;		// partial programs since erase
+	uint8_t *pfail, *efail;	// per block
+	uint8_t buf[DATA_SIZE + 128];
+	uint8_t regA0, regB0, regC0;
+	double busyUntil;
+	uint32_t contRow, contCol;
+	uint8_t contEcc;
+	uint16_t lutLBA[LUT_ENTRIES], lutPBA[LUT_ENTRIES];
+	int lutCount;
+};
+
+static die_t dies[MAX_DIES];
+static uint32_t jedec_id, ndies, blocks, page_size, ecc_strength;
+static int cur;			// selected die
+static bool selected;		// chip select low
+static uint32_t n;		// bytes since chip select
+static uint8_t cmd[8];
+
+static inline uint32_t pages() { return blocks * PAGES_PER_BLOCK; }
+static inline uint8_t *page_ptr(die_t &d, uint32_t row) { return d.mem + (size_t)row * page_size; }
+
+void nand_reset_stats()
+{
+	memset(&nand_stats, 0, sizeof(nand_stats));
+}
+
+uint64_t nand_violations()
+{
+	return nand_stats.busyViolations + nand_stats.weViolations + nand_stats.nopViolations
+	  + nand_stats.overwriteViolations + nand_stats.addressViolations;
+}
+
+void nand_init(uint32_t jedec)
+{
+	jedec_id = jedec;
+	ndies = (jedec == NAND_W25M02) ? 2 : 1;
+	blocks = (jedec == NAND_W25N02) ? 2048 : 1024;
+	page_size = DATA_SIZE + ((jedec == NAND_W25N02) ? 128 : 64);
+	ecc_strength = (jedec == NAND_W25N02) ? 8 : 1;
+	for (int i = 0; i < MAX_DIES; i++) {
+		die_t &d = dies[i];
+		free(d.mem);
+		free(d.flips);
+		free(d.nop);
+		free(d.pfail);
+		memset(&d, 0, sizeof(d));
+		if (i >= (int)ndies) continue;
+		d.mem = (uint8_t *)calloc(pages(), page_size);
+		d.flips = (uint8_t *)calloc(pages(), SECTORS);
+		d.nop = (uint8_t *)calloc(pages(), 1);
+		d.pfail = (uint8_t *)calloc(blocks, 2);
+		d.efail = d.pfail + blocks;
+		if (!d.mem || !d.flips || !d.nop || !d.pfail) {
+			printf("nand_init: out of memory\n");
+			exit(1);
+		}
+		d.regA0 = 0x7C;	// write protected until cleared
+		d.regB0 = CONF_ECCE | CONF_BUF;
+	}
+	cur = 0;
+	selected = false;
+	nand_reset_stats();
+}
+
+uint32_t nand_dies() { return ndies; }
+uint32_t nand_blocks() { return blocks; }
+uint32_t nand_page_size() { return page_size; }
+uint32_t nand_pages_per_block() { return PAGES_PER_BLOCK; }
+
+void nand_read_raw(int die, uint32_t row, uint32_t column, void *buf, uint32_t len)
+{
+	const uint8_t *p = page_ptr(dies[die], row) + column;
+	for (uint32_t i = 0; i < len; i++) ((uint8_t *)buf)[i] = ~p[i];
+}
+
+void nand_write_raw(int die, uint32_t row, uint32_t column, const void *buf, uint32_t len)
+{
+	uint8_t *p = page_ptr(dies[die], row) + column;
+	for (uint32_t i = 0; i < len; i++) p[i] = ~((const uint8_t *)buf)[i];
+}
+
+void nand_flip_bits(int die, uint32_t row, int sector, int bits)
+{
+	dies[die].flips[row * SECTORS + sector] += bits;
+}
+
+void nand_mark_bad(int die, uint32_t block)
+{
+	const uint8_t mark = 0;
+	nand_write_raw(die, block * PAGES_PER_BLOCK, DATA_SIZE, &mark, 1);
+}
+
+void nand_fail_block(int die, uint32_t block, bool prog, bool erase)
+{
+	dies[die].pfail[block] = prog;
+	dies[die].efail[block] = erase;
+}
+
+bool nand_lut_link(int die, uint16_t lba, uint16_t pba)
+{
+	die_t &d = dies[die];
+	if (d.lutCount >= LUT_ENTRIES) return false;
+	d.lutLBA[d.lutCount] = lba | 0x8000;	// enabled
+	d.lutPBA[d.lutCount] = pba;
+	if (++d.lutCount == LUT_ENTRIES) d.regC0 |= STAT_LUTF;
+	return true;
+}
+
+void nand_lut_invalidate(int die, int entry)
+{
+	dies[die].lutLBA[entry] |= 0x4000;
+}
+
+static bool busy(die_t &d)
+{
+	return sim_now < d.busyUntil;
+}
+
+// Block Erase, Program Execute and Page Data Read take a 24 bit row
+// address, the first byte is a dummy byte on W25N01 and W25M02
+static bool row_address(uint32_t &row)
+{
+	row = (cmd[1] << 16) | (cmd[2] << 8) | cmd[3];
+	if (row < pages()) return true;
+	nand_stats.addressViolations++;
+	return false;
+}
+
+// the BBM LUT redirects whole blocks
+static uint32_t remap(die_t &d, uint32_t row)
+{
+	const uint32_t block = row / PAGES_PER_BLOCK;
+	for (int i = 0; i < d.lutCount; i++) {
+		if ((d.lutLBA[i] & 0xC000) == 0x8000 && (d.lutLBA[i] & 0x3FFF) == block) {
+			return d.lutPBA[i] * PAGES_PER_BLOCK + row % PAGES_PER_BLOCK;
+		}
+	}
+	return row;
+}
+
+// Load a page into the data buffer, correcting what the ECC can.
+// Returns the ECC-1,0 status of this page.
+static uint8_t load_page(die_t &d, uint32_t row)
+{
+	row = remap(d, row);
+	const uint8_t *p = page_ptr(d, row);
+	for (uint32_t i = 0; i < page_size; i++) d.buf[i] = ~p[i];
+	uint8_t ecc = 0;
+	if (d.regB0 & CONF_ECCE) {
+		for (int s = 0; s < SECTORS; s++) {
+			const uint8_t f = d.flips[row * SECTORS + s];
+			if (f == 0) continue;
+			if (f <= ecc_strength) {
+				if (ecc < 1) ecc = 1;
+			} else {
+				ecc = 2;
+				for (int i = 0; i < f; i++) d.buf[s * 512 + i * 61 % 512] ^= 1 << (i & 7);
+			}
+		}
+	}
+	nand_stats.pageReads++;
+	return ecc;
+}
+
+static void set_ecc(die_t &d, uint8_t ecc)
+{
+	d.regC0 = (d.regC0 & ~0x30) | (ecc << 4);
+}
+
+static void page_data_read(die_t &d)
+{
+	uint32_t row;
+	if (!row_address(row)) return;
+	const uint8_t ecc = load_page(d, row);
+	set_ecc(d, ecc);
+	d.contRow = row;
+	d.contCol = 0;
+	d.contEcc = ecc;
+	d.busyUntil = sim_now + nand_tRD;
+	nand_stats.pageDataReads++;
+}
+
+static void program_execute(die_t &d)
+{
+	uint32_t row;
+	if (!row_address(row)) return;
+	if (!(d.regC0 & STAT_WEL)) {
+		nand_stats.weViolations++;
+		return;
+	}
+	d.regC0 &= ~(STAT_WEL | STAT_PFAIL);
+	d.busyUntil = sim_now + tPROG;
+	row = remap(d, row);
+	if (d.pfail[row / PAGES_PER_BLOCK]) {
+		d.regC0 |= STAT_PFAIL;
+		return;
+	}
+	uint8_t *p = page_ptr(d, row);
+	bool written = false;
+	for (uint32_t i = 0; i < page_size; i++) {
+		const uint8_t data = d.buf[i];
+		if (data == 0xFF) continue;
+		written = true;
+		if ((uint8_t)(~p[i] & data) != data) nand_stats.overwriteViolations++;
+		p[i] |= (uint8_t)~data; // stored inverted, programming sets bits
+	}
+	if (written) {
+		if (d.nop[row] == 0) nand_stats.pagesConsumed++;
+		if (++d.nop[row] > 4) nand_stats.nopViolations++;
+	}
+	memset(d.flips + row * SECTORS, 0, SECTORS);
+	nand_stats.pagePrograms++;
+}
+
+static void block_erase(die_t &d)
+{
+	uint32_t row;
+	if (!row_address(row)) return;
+	if (!(d.regC0 & STAT_WEL)) {
+		nand_stats.weViolations++;
+		return;
+	}
+	d.regC0 &= ~(STAT_WEL | STAT_EFAIL);
+	d.busyUntil = sim_now + tBERS;
+	const uint32_t block = remap(d, row) / PAGES_PER_BLOCK;
+	if (d.efail[block]) {
+		d.regC0 |= STAT_EFAIL;
+		return;
+	}
+	const uint32_t first = block * PAGES_PER_BLOCK;
+	memset(page_ptr(d, first), 0, (size_t)PAGES_PER_BLOCK * page_size);
+	memset(d.flips + first * SECTORS, 0, PAGES_PER_BLOCK * SECTORS);
+	memset(d.nop + first, 0, PAGES_PER_BLOCK);
+	nand_stats.blockErases++;
+}
+
+// Continuous read streams each page's data, without the spare area.
+// ECC-1,0 report the worst page.
+static void next_continuous(die_t &d)
+{
+	if (++d.contCol < DATA_SIZE) return;
+	d.contCol = 0;
+	if (++d.contRow >= pages()) return;
+	const uint8_t ecc = load_page(d, d.contRow);
+	if (ecc >= 2 && d.contEcc >= 2) {
+		d.contEcc = 3;	// several pages uncorrectable
+	} else if (ecc > d.contEcc) {
+		d.contEcc = ecc;
+	}
+	set_ecc(d, d.contEcc);
+}
+
+// The command ends when chip select goes high
+static void end_command()
+{
+	die_t &d = dies[cur];
+	const uint8_t c = cmd[0];
+	if (c == 0x05 || c == 0x9F) return;
+	// W25M02 selects the other die while this one works
+	if (busy(d) && c != 0xFF && c != 0xC2) {
+		nand_stats.busyViolations++;
+		return;
+	}
+	switch (c) {
+	case 0x01: // Write Status Register
+		if (n < 3) break;
+		if (cmd[1] == 0xA0) d.regA0 = cmd[2];
+		if (cmd[1] == 0xB0) d.regB0 = cmd[2];
+		break;
+	case 0x06: d.regC0 |= STAT_WEL; break;
+	case 0x04: d.regC0 &= ~STAT_WEL; break;
+	case 0xFF: // Reset
+		d.regC0 = 0;
+		d.regB0 = CONF_ECCE | CONF_BUF;
+		d.busyUntil = sim_now + tRST;
+		break;
+	case 0xC2: // Select Die
+		if (n >= 2 && ndies > 1) {
+			cur = cmd[1] & 1;
+			nand_stats.dieSelects++;
+		}
+		break;
+	case 0x13: if (n >= 4) page_data_read(d); break;
+	case 0x10: if (n >= 4) program_execute(d); break;
+	case 0xD8: if (n >= 4) block_erase(d); break;
+	case 0xA1: // Swap Blocks
+		if (n >= 5) nand_lut_link(cur, (cmd[1] << 8) | cmd[2], (cmd[3] << 8) | cmd[4]);
+		break;
+	}
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	sim_now += cs_us;
+	if (val == LOW) {
+		selected = true;
+		n = 0;
+	} else if (selected) {
+		selected = false;
+		if (n) end_command();
+		n = 0;
+	}
+}
+
+static uint8_t transfer(uint8_t in)
+{
+	die_t &d = dies[cur];
+	sim_now += nand_byte_us;
+	nand_stats.bytes++;
+	if (n < sizeof(cmd)) cmd[n] = in;
+	uint8_t out = 0xFF;
+	const uint8_t c = cmd[0];
+	if (n > 0) switch (c) {
+	case 0x9F: // JEDEC ID, after a dummy byte
+		if (n >= 2 && n <= 4) out = jedec_id >> (8 * (4 - n));
+		break;
+	case 0x05: // Read Status Register
+		if (n == 2) {
+			if (cmd[1] == 0xA0) {
+				out = d.regA0;
+			} else if (cmd[1] == 0xB0) {
+				out = d.regB0;
+			} else {
+				out = (d.regC0 & ~STAT_BUSY) | (busy(d) ? STAT_BUSY : 0);
+				nand_stats.polls++;
+			}
+		}
+		break;
+	case 0x02: // Program Data Load, the rest of the buffer is 0xFF
+	case 0x84: // Random Program Data Load keeps it
+		if (n == 1 && c == 0x02) memset(d.buf, 0xFF, sizeof(d.buf));
+		if (n >= 3) {
+			if (busy(d)) {
+				if (n == 3) nand_stats.busyViolations++;
+				break;
+			}
+			const uint32_t col = ((cmd[1] << 8) | cmd[2]) + (n - 3);
+			if (col < page_size) d.buf[col] = in;
+		}
+		break;
+	case 0x03: // Read Data
+		if (n < 4) break;
+		if (busy(d)) {
+			if (n == 4) nand_stats.busyViolations++;
+			break;
+		}
+		if (d.regB0 & CONF_BUF) {
+			const uint32_t col = ((cmd[1] << 8) | cmd[2]) + (n - 4);
+			if (col < page_size) out = d.buf[col];
+		} else {
+			// continuous read, 3 dummy bytes then the data
+			out = d.buf[d.contCol];
+			next_continuous(d);
+		}
+		break;
+	case 0xA5: // Read BBM LUT, after a dummy byte
+		if (n >= 2) {
+			const int i = (n - 2) / 4, k = (n - 2) % 4;
+			if (i < LUT_ENTRIES) {
+				const uint16_t v = (k < 2) ? d.lutLBA[i] : d.lutPBA[i];
+				out = (k & 1) ? v : v >> 8;
+				if (i >= d.lutCount) out = 0;
+			}
+		}
+		break;
+	}
+	n++;
+	return out;
+}
+
+// The data phase of buffered reads and program loads in one go, the
+// same as transfer() byte by byte but much faster.  Returns false when
+// the bytes must go one at a time.
+static bool transfer_bulk(const uint8_t *tx, uint8_t *rx, size_t count)
+{
+	die_t &d = dies[cur];
+	const uint8_t c = cmd[0];
+	if (busy(d)) return false;
+	if (c == 0x03 && (d.regB0 & CONF_BUF) && n >= 4) {
+		const uint32_t col = ((cmd[1] << 8) | cmd[2]) + (n - 4);
+		if (col + count > page_size) return false;
+		if (rx) memcpy(rx, d.buf + col, count);
+	} else if (c == 0x03 && n >= 4) {
+		for (size_t i = 0; i < count; ) {
+			size_t len = DATA_SIZE - d.contCol;
+			if (len > count - i) len = count - i;
+			if (rx) memcpy(rx + i, d.buf + d.contCol, len);
+			d.contCol += len - 1;
+			i += len;
+			next_continuous(d); // moves on at the end of the page
+		}
+	} else if ((c == 0x02 || c == 0x84) && n >= 3) {
+		const uint32_t col = ((cmd[1] << 8) | cmd[2]) + (n - 3);
+		if (col + count > page_size) return false;
+		if (tx) {
+			memcpy(d.buf + col, tx, count);
+		} else {
+			memset(d.buf + col, 0xFF, count);
+		}
+		if (rx) memset(rx, 0xFF, count);
+	} else {
+		return false;
+	}
+	n += count;
+	sim_now += count * nand_byte_us;
+	nand_stats.bytes += count;
+	return true;
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+	return ::transfer(data);
+}
+
+void SPIClass::transfer(void *buf, size_t count)
+{
+	uint8_t *p = (uint8_t *)buf;
+	if (transfer_bulk(p, p, count)) return;
+	for (size_t i = 0; i < count; i++) p[i] = ::transfer(p[i]);
+}
+
+void SPIClass::transfer(const void *txbuf, void *rxbuf, size_t count)
+{
+	const uint8_t *tx = (const uint8_t *)txbuf;
+	uint8_t *rx = (uint8_t *)rxbuf;
+	if (transfer_bulk(tx, rx, count)) return;
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t data = ::transfer(tx ? tx[i] : 0xFF);
+		if (rx) rx[i] = data;
+	}
+}
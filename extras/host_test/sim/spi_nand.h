@@ -0,0 +1,58 @@
+// Winbond SPI NAND emulator: W25N01GV, W25N02KV and W25M02GV (2 W25N01
+// dies).  It has each die's data buffer, status registers, buffered and
+// continuous reads, ECC which corrects injected bit flips, factory bad
+// block marks, program and erase failures, and the 20 entry BBM LUT.
+// Timing follows the datasheets, with the SPI bus at 30 MHz.
+#pragma once
+#include "sim.h"
+
+struct nand_stats_t {
+	uint64_t pageReads;	// Page Data Read, and pages streamed by continuous reads
+	uint64_t pageDataReads;	// Page Data Read commands only
+	uint64_t pagePrograms;	// Program Execute
+	uint64_t blockErases;
+	uint64_t pagesConsumed;	// erased pages programmed for the first time
+	uint64_t bytes;		// SPI bytes transferred
+	uint64_t polls;		// status register 3 reads
+	uint64_t dieSelects;
+	// protocol errors, which a correct driver never causes
+	uint64_t busyViolations;	// commands other than status while busy
+	uint64_t weViolations;		// program or erase without Write Enable
+	uint64_t nopViolations;		// more than 4 partial programs of a page
+	uint64_t overwriteViolations;	// programming a 0 bit back to 1
+	uint64_t addressViolations;	// rows past the end of the die
+};
+extern nand_stats_t nand_stats;
+// page load time and SPI time per byte, in microseconds
+extern double nand_tRD, nand_byte_us;
+
+#define NAND_W25N01	0xEFAA21
+#define NAND_W25N02	0xEFAA22
+#define NAND_W25M02	0xEFBB21
+
+// Blank chip, every block erased, no faults
+void nand_init(uint32_t jedec);
+void nand_reset_stats();
+uint64_t nand_violations();
+
+uint32_t nand_dies();
+uint32_t nand_blocks();		// per die
+uint32_t nand_page_size();	// including the spare area
+uint32_t nand_pages_per_block();
+
+// Raw page contents, row counts from 0 on each die.  Doesn't follow the
+// BBM LUT.
+void nand_read_raw(int die, uint32_t row, uint32_t column, void *buf, uint32_t len);
+void nand_write_raw(int die, uint32_t row, uint32_t column, const void *buf, uint32_t len);
+
+// Flip bits in a 512 byte ECC sector of a page.  Up to the chip's ECC
+// strength are corrected, ECC-1,0 = 01, more are not, 10 and the data is
+// returned with the bits flipped.  Programming or erasing clears them.
+void nand_flip_bits(int die, uint32_t row, int sector, int bits);
+// Factory bad block mark, a 0 in the first spare byte of the first page
+void nand_mark_bad(int die, uint32_t block);
+// Program Execute sets P-FAIL, Block Erase sets E-FAIL
+void nand_fail_block(int die, uint32_t block, bool prog, bool erase);
+// Link the chip's BBM LUT as Swap Blocks (0xA1) would
+bool nand_lut_link(int die, uint16_t lba, uint16_t pba);
+void nand_lut_invalidate(int die, int entry);
@@ -0,0 +1,157 @@
+// SPI NOR flash emulator, see spi_nor.h
+#include <SPI.h>
+#include "spi_nor.h"
+
+nor_stats_t nor_stats;
+double nor_tPP = 700, nor_tSE = 45000, nor_tBE32 = 120000, nor_tBE64 = 150000;
+static const double byte_us = 8.0 / 30.0;	// 30 MHz SPI
+static const double cs_us = 0.05;
+
+static uint8_t *mem;
+static uint32_t jedec_id, chipsize;
+static bool selected, wel, loaded;
+static uint32_t n, addr;
+static uint8_t cmd[5];
+static double busyUntil;
+
+void nor_reset_stats()
+{
+	memset(&nor_stats, 0, sizeof(nor_stats));
+}
+
+void nor_init(uint32_t jedec, uint32_t size)
+{
+	jedec_id = jedec;
+	chipsize = size;
+	free(mem);
+	mem = (uint8_t *)malloc(size);
+	if (!mem) {
+		printf("nor_init: out of memory\n");
+		exit(1);
+	}
+	memset(mem, 0xFF, size);
+	busyUntil = 0;
+	wel = false;
+	nor_reset_stats();
+}
+
+uint8_t * nor_memory()
+{
+	return mem;
+}
+
+static bool busy()
+{
+	return sim_now < busyUntil;
+}
+
+// bytes before the data, 4 byte address commands have one more
+static uint32_t header()
+{
+	return (cmd[0] == 0x13 || cmd[0] == 0x12 || cmd[0] == 0xDC || cmd[0] == 0x21
+	  || cmd[0] == 0x5C) ? 5 : 4;
+}
+
+static void erase(uint32_t size, double us)
+{
+	memset(mem + (addr & ~(size - 1)) % chipsize, 0xFF, size);
+	nor_stats.erases++;
+	busyUntil = sim_now + us;
+}
+
+// The command ends when chip select goes high
+static void end_command()
+{
+	const uint8_t c = cmd[0];
+	if (c == 0x05 || c == 0x9F) return;
+	if (busy()) {
+		nor_stats.busyViolations++;
+		return;
+	}
+	switch (c) {
+	case 0x06: wel = true; return;
+	case 0x02: case 0x12:
+		if (wel && loaded) {
+			nor_stats.pagePrograms++;
+			busyUntil = sim_now + nor_tPP;
+		}
+		break;
+	case 0x20: case 0x21: if (wel && n >= header()) erase(4096, nor_tSE); break;
+	case 0x52: case 0x5C: if (wel && n >= header()) erase(32768, nor_tBE32); break;
+	case 0xD8: case 0xDC: if (wel && n >= header()) erase(65536, nor_tBE64); break;
+	}
+	wel = false;
+	loaded = false;
+}
+
+void digitalWrite(uint8_t pin, uint8_t val)
+{
+	sim_now += cs_us;
+	if (val == LOW) {
+		selected = true;
+		n = 0;
+	} else if (selected) {
+		selected = false;
+		if (n) end_command();
+		n = 0;
+	}
+}
+
+static uint8_t transfer(uint8_t in)
+{
+	sim_now += byte_us;
+	nor_stats.bytes++;
+	if (n < sizeof(cmd)) cmd[n] = in;
+	if (n == 3 && header() == 4) addr = (cmd[1] << 16) | (cmd[2] << 8) | cmd[3];
+	if (n == 4 && header() == 5) addr = (cmd[1] << 24) | (cmd[2] << 16) | (cmd[3] << 8) | cmd[4];
+	uint8_t out = 0xFF;
+	switch (cmd[0]) {
+	case 0x9F: // JEDEC ID
+		if (n >= 1 && n <= 3) out = jedec_id >> (8 * (3 - n));
+		break;
+	case 0x05: // Read Status Register 1
+		if (n >= 1) out = busy() ? 1 : 0;
+		break;
+	case 0x03: case 0x13: // Read Data
+		if (n < header()) break;
+		if (busy()) {
+			if (n == header()) nor_stats.busyViolations++;
+			break;
+		}
+		out = mem[addr++ % chipsize];
+		break;
+	case 0x02: case 0x12: // Page Program, wraps within the page
+		if (n < header() || !wel || busy()) break;
+		{
+			const uint32_t a = (addr & ~255u) | ((addr + n - header()) & 255);
+			uint8_t &m = mem[a % chipsize];
+			if ((m & in) != in) nor_stats.overwriteViolations++;
+			m &= in;
+			loaded = true;
+		}
+		break;
+	}
+	n++;
+	return out;
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+	return ::transfer(data);
+}
+
+void SPIClass::transfer(void *buf, size_t count)
+{
+	uint8_t *p = (uint8_t *)buf;
+	for (size_t i = 0; i < count; i++) p[i] = ::transfer(p[i]);
+}
+
+void SPIClass::transfer(const void *txbuf, void *rxbuf, size_t count)
+{
+	const uint8_t *tx = (const uint8_t *)txbuf;
+	uint8_t *rx = (uint8_t *)rxbuf;
+	for (size_t i = 0; i < count; i++) {
+		const uint8_t data = ::transfer(tx ? tx[i] : 0xFF);
+		if (rx) rx[i] = data;
+	}
+}
@@ -0,0 +1,21 @@
+// SPI NOR flash emulator, Winbond W25Q style: 256 byte pages, 4K, 32K
+// and 64K erases, 3 byte addresses below 16 MB and 4 byte commands above.
+// Timing follows the W25Q128JV typical figures, with SPI at 30 MHz.
+#pragma once
+#include "sim.h"
+
+struct nor_stats_t {
+	uint64_t pagePrograms;
+	uint64_t erases;
+	uint64_t bytes;		// SPI bytes transferred
+	// protocol errors, which a correct driver never causes
+	uint64_t busyViolations;	// commands other than status while busy
+	uint64_t overwriteViolations;	// programming a 0 bit back to 1
+};
+extern nor_stats_t nor_stats;
+extern double nor_tPP, nor_tSE, nor_tBE32, nor_tBE64;
+
+// Blank chip, jedec is the 3 byte ID, for example 0xEF4018 for W25Q128JV
+void nor_init(uint32_t jedec, uint32_t size);
+void nor_reset_stats();
+uint8_t * nor_memory();
@@ -0,0 +1,84 @@
+// Just enough of the Teensy core to build LittleFS on a PC.  Time is
+// simulated: each emulator advances sim_now as the bus and the chip
+// would, and micros() reads it.
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define PROGMEM
+#define FLASHMEM
+#define DMAMEM
+#define F(s) (s)
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+typedef bool boolean;
+
+extern double sim_now; // microseconds
+static inline uint32_t micros() { return (uint32_t)sim_now; }
+static inline uint32_t millis() { return (uint32_t)(sim_now / 1000); }
+class elapsedMicros {
+	uint32_t start;
+public:
+	elapsedMicros(uint32_t val = 0) { start = micros() - val; }
+	operator uint32_t() const { return micros() - start; }
+	elapsedMicros & operator = (uint32_t val) { start = micros() - val; return *this; }
+};
+class elapsedMillis {
+	uint32_t start;
+public:
+	elapsedMillis(uint32_t val = 0) { start = millis() - val; }
+	operator uint32_t() const { return millis() - start; }
+	elapsedMillis & operator = (uint32_t val) { start = millis() - val; return *this; }
+};
+static inline void yield() { }
+static inline void delay(uint32_t msec) { sim_now += msec * 1000.0; }
+static inline void delayMicroseconds(uint32_t usec) { sim_now += usec; }
+static inline void delayNanoseconds(uint32_t nsec) { sim_now += nsec / 1000.0; }
+
+void digitalWrite(uint8_t pin, uint8_t val); // chip select, see sim/
+static inline void digitalWriteFast(uint8_t pin, uint8_t val) { }
+static inline void pinMode(uint8_t pin, uint8_t mode) { }
+static inline void __disable_irq() { }
+static inline void __enable_irq() { }
+
+static inline size_t strlcpy(char *dst, const char *src, size_t size) {
+	size_t len = strlen(src);
+	if (size) {
+		size_t n = len < size - 1 ? len : size - 1;
+		memcpy(dst, src, n);
+		dst[n] = 0;
+	}
+	return len;
+}
+
+class Print {
+public:
+	virtual size_t write(uint8_t c) { return putchar(c) == EOF ? 0 : 1; }
+	size_t print(const char *s) { return ::printf("%s", s); }
+	size_t println() { return write('\n'); }
+	size_t println(const char *s) { return ::printf("%s\n", s); }
+	template<typename... Args> int printf(const char *format, Args... args) {
+		return ::printf(format, args...);
+	}
+	operator bool() { return true; }
+};
+extern Print Serial;
+
+struct DateTimeFields { uint8_t sec, min, hour, wday, mday, mon, year; };
+static inline void breakTime(uint32_t time, DateTimeFields &tm) { memset(&tm, 0, sizeof(tm)); }
+static inline uint32_t makeTime(const DateTimeFields &tm) { return 0; }
+struct teensy3_clock_class { uint32_t get() { return 0; } };
+extern teensy3_clock_class Teensy3Clock;
+
+static inline void *extmem_malloc(size_t size) { return malloc(size); }
+static inline void extmem_free(void *ptr) { free(ptr); }
+
+template<class A, class B> constexpr auto max(A a, B b) { return a > b ? a : b; }
+template<class A, class B> constexpr auto min(A a, B b) { return a < b ? a : b; }
+
+#ifdef __IMXRT1062__
+#include "imxrt.h"
+#endif
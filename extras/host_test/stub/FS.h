@@ -0,0 +1,78 @@
+// The File and FS classes of the Teensy core, without reference counting.
+// A File copy shares the same FileImpl, so close only one of them.
+#pragma once
+#include <Arduino.h>
+
+#define FILE_READ 0
+#define FILE_WRITE 1
+#define FILE_WRITE_BEGIN 2
+
+enum SeekMode { SeekSet = 0, SeekCur = 1, SeekEnd = 2 };
+
+class File;
+
+class FileImpl {
+public:
+	virtual ~FileImpl() { }
+	virtual size_t read(void *buf, size_t nbyte) = 0;
+	virtual size_t write(const void *buf, size_t size) = 0;
+	virtual int available() = 0;
+	virtual int peek() = 0;
+	virtual void flush() = 0;
+	virtual bool truncate(uint64_t size=0) = 0;
+	virtual bool seek(uint64_t pos, int mode) = 0;
+	virtual uint64_t position() = 0;
+	virtual uint64_t size() = 0;
+	virtual void close() = 0;
+	virtual bool isOpen() = 0;
+	virtual const char * name() = 0;
+	virtual bool isDirectory() = 0;
+	virtual File openNextFile(uint8_t mode=0) = 0;
+	virtual void rewindDirectory(void) = 0;
+	virtual bool getCreateTime(DateTimeFields &tm) { return false; }
+	virtual bool getModifyTime(DateTimeFields &tm) { return false; }
+	virtual bool setCreateTime(const DateTimeFields &tm) { return false; }
+	virtual bool setModifyTime(const DateTimeFields &tm) { return false; }
+};
+
+class File {
+public:
+	File(FileImpl *file = nullptr) : f(file) { }
+	operator bool() { return f && f->isOpen(); }
+	size_t read(void *buf, size_t nbyte) { return f ? f->read(buf, nbyte) : 0; }
+	size_t write(const void *buf, size_t size) { return f ? f->write(buf, size) : 0; }
+	size_t print(const char *s) { return write(s, strlen(s)); }
+	int available() { return f ? f->available() : 0; }
+	void flush() { if (f) f->flush(); }
+	bool truncate(uint64_t size=0) { return f ? f->truncate(size) : false; }
+	bool seek(uint64_t pos, int mode = SeekSet) { return f ? f->seek(pos, mode) : false; }
+	uint64_t position() { return f ? f->position() : 0; }
+	uint64_t size() { return f ? f->size() : 0; }
+	const char * name() { return f ? f->name() : ""; }
+	bool isDirectory() { return f ? f->isDirectory() : false; }
+	File openNextFile(uint8_t mode=0) { return f ? f->openNextFile(mode) : File(); }
+	void close() {
+		if (f) {
+			f->close();
+			delete f;
+			f = nullptr;
+		}
+	}
+private:
+	FileImpl *f;
+};
+
+class FS {
+public:
+	virtual File open(const char *filename, uint8_t mode = FILE_READ) = 0;
+	virtual bool exists(const char *filepath) = 0;
+	virtual bool mkdir(const char *filepath) = 0;
+	virtual bool rename(const char *oldfilepath, const char *newfilepath) = 0;
+	virtual bool remove(const char *filepath) = 0;
+	virtual bool rmdir(const char *filepath) = 0;
+	virtual uint64_t usedSize() = 0;
+	virtual uint64_t totalSize() = 0;
+	virtual bool format(int type=0, char progressChar=0, Print& pr=Serial) { return false; }
+	virtual bool mediaPresent() { return true; }
+	virtual const char * name() { return ""; }
+};
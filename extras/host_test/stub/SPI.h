@@ -0,0 +1,25 @@
+// SPI port, each emulator in sim/ implements transfer()
+#pragma once
+#include <Arduino.h>
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+struct SPISettings {
+	SPISettings(uint32_t clock, int bitOrder, int dataMode) { }
+};
+
+class SPIClass {
+public:
+	void begin() { }
+	void beginTransaction(SPISettings settings) { }
+	void endTransaction() { }
+	uint8_t transfer(uint8_t data);
+	uint16_t transfer16(uint16_t data) {
+		uint8_t hi = transfer(data >> 8);
+		return (hi << 8) | transfer(data);
+	}
+	void transfer(void *buf, size_t count);
+	void transfer(const void *txbuf, void *rxbuf, size_t count);
+};
+extern SPIClass SPI;
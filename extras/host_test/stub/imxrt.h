@@ -0,0 +1,59 @@
+// FlexSPI registers and flash layout of the Teensy core, so the QSPI and
+// program flash code paths build.  Only LittleFS_Program runs, on the
+// emulator in sim/program_flash.cpp.
+#pragma once
+extern volatile uint32_t FLEXSPI2_REGS[64];
+#define FLEXSPI2_FLSHA1CR0 FLEXSPI2_REGS[0]
+#define FLEXSPI2_FLSHA2CR0 FLEXSPI2_REGS[0]
+#define FLEXSPI2_INTR FLEXSPI2_REGS[0]
+#define FLEXSPI2_IPCMD FLEXSPI2_REGS[0]
+#define FLEXSPI2_IPCR0 FLEXSPI2_REGS[0]
+#define FLEXSPI2_IPCR1 FLEXSPI2_REGS[0]
+#define FLEXSPI2_IPRXFCR FLEXSPI2_REGS[0]
+#define FLEXSPI2_IPRXFSTS FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT32 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT33 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT36 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT37 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT38 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT40 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT41 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT44 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT45 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT48 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT49 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT52 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT53 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT56 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT57 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUT60 FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUTCR FLEXSPI2_REGS[0]
+#define FLEXSPI2_LUTKEY FLEXSPI2_REGS[0]
+#define FLEXSPI2_RFDR0 FLEXSPI2_REGS[0]
+#define FLEXSPI2_TFDR0 FLEXSPI2_REGS[0]
+#define FLEXSPI_INTR_IPCMDDONE 1u
+#define FLEXSPI_INTR_IPCMDERR 1u
+#define FLEXSPI_INTR_IPRXWA 1u
+#define FLEXSPI_INTR_IPTXWE 1u
+#define FLEXSPI_IPCMD_TRG 1u
+#define FLEXSPI_IPRXFCR_CLRIPRXF 1u
+#define FLEXSPI_LUTCR_UNLOCK 1u
+#define FLEXSPI_LUTKEY_VALUE 1u
+#define FLEXSPI_LUT_NUM_PADS_1 1u
+#define FLEXSPI_LUT_NUM_PADS_4 1u
+#define FLEXSPI_LUT_OPCODE_CADDR_SDR 1u
+#define FLEXSPI_LUT_OPCODE_CMD_SDR 1u
+#define FLEXSPI_LUT_OPCODE_DUMMY_SDR 1u
+#define FLEXSPI_LUT_OPCODE_RADDR_SDR 1u
+#define FLEXSPI_LUT_OPCODE_READ_SDR 1u
+#define FLEXSPI_LUT_OPCODE_WRITE_SDR 1u
+#define FLEXSPI_IPCR1_IDATSZ(n) (n)
+#define FLEXSPI_IPCR1_ISEQID(n) (n)
+#define FLEXSPI_IPRXFCR_RXWMRK(n) (n)
+#define FLEXSPI_LUT_INSTRUCTION(a,b,c) ((a)|(b)|(c))
+#if !defined(ARDUINO_TEENSY40) && !defined(ARDUINO_TEENSY41)
+#define FLASH_SIZE 0x800000
+#define SECTOR_SIZE 4096
+#define ERASE_MICROS 45000
+#endif
+static inline void arm_dcache_flush(void *addr, uint32_t size) {}
@@ -22,6 +22,7 @@
 
 #include <Arduino.h>
 #include <LittleFS.h>
+#include "littlefs/lfs_util.h"
 
 #define SPICONFIG   SPISettings(30000000, MSBFIRST, SPI_MODE0)
 
@@ -61,16 +62,16 @@ PROGMEM static const struct chipinfo {
 {{0xC8, 0x40, 0x17}, 24, 256, 65536, 0xD8, 8388608, 4000, 3000000, "GD25Q64E"},  // GigaDevice GD25Q64E
 {{0xC8, 0x40, 0x18}, 24, 256, 65536, 0xD8, 16777216, 4000, 3000000, "GD25Q128E"},  // GigaDevice GD25Q128E
 {{0xC8, 0x40, 0x19}, 32, 256, 65536, 0xDC, 33554432, 2000, 1600000, "GD25Q256E"},  // GigaDevice GD25Q256E
-//FRAM
-{{0x03, 0x2E, 0xC2}, 24, 64, 128, 0, 1048576, 250, 1200, "CY15B108QN"}, //Cypress 8Mb FRAM, CY15B108QN
-{{0xC2, 0x24, 0x00}, 24, 64, 128, 0, 131072, 250, 1200, "FM25V10-G"},  //Cypress 1Mb FRAM, FM25V10-G
-{{0xC2, 0x24, 0x01}, 24, 64, 128, 0, 131072, 250, 1200, "FM25V10-G (rev 1)"},  //Cypress 1Mb FRAM, rev1
-{{0xAE, 0x83, 0x09}, 24, 64, 128, 0, 131072, 250, 1200, "MR45V100A"},  //ROHM MR45V100A 1 Mbit FeRAM Memory
-{{0xC2, 0x26, 0x08}, 24, 64, 128, 0, 524288, 250, 1200, "CY15B104Q"},  //Cypress 4Mb FRAM, CY15B104Q
-{{0x60, 0x2A, 0xC2}, 24, 64, 128, 0, 262144, 250, 1200, "CY15B102Q"},  //Cypress 2Mb FRAM, CY15B102Q
-{{0x60, 0x2A, 0xC2}, 24, 64, 128, 0, 262144, 250, 1200, "CY15B102Q"},  //Cypress 2Mb FRAM, CY15B102Q
-{{0x04, 0x7F, 0x48}, 24, 64, 128, 0, 262144, 250, 1200, "MB85RS2MTAPNF"},  //Fujitsu 2Mb FRAM, MB85RS2MTAPNF
-{{0x04, 0x7F, 0x49}, 24, 64, 128, 0, 524288, 250, 1200, "MB85RS4MT"},  //Fujitsu 4Mb FRAM, MB85RS2MT
+//FRAM: progsize is the read and prog size, erasesize the littlefs block size, as FRAM needs no erase
+{{0x03, 0x2E, 0xC2}, 24, 16, 512, 0, 1048576, 250, 1200, "CY15B108QN"}, //Cypress 8Mb FRAM, CY15B108QN
+{{0xC2, 0x24, 0x00}, 24, 16, 512, 0, 131072, 250, 1200, "FM25V10-G"},  //Cypress 1Mb FRAM, FM25V10-G
+{{0xC2, 0x24, 0x01}, 24, 16, 512, 0, 131072, 250, 1200, "FM25V10-G (rev 1)"},  //Cypress 1Mb FRAM, rev1
+{{0xAE, 0x83, 0x09}, 24, 16, 512, 0, 131072, 250, 1200, "MR45V100A"},  //ROHM MR45V100A 1 Mbit FeRAM Memory
+{{0xC2, 0x26, 0x08}, 24, 16, 512, 0, 524288, 250, 1200, "CY15B104Q"},  //Cypress 4Mb FRAM, CY15B104Q
+{{0x60, 0x2A, 0xC2}, 24, 16, 512, 0, 262144, 250, 1200, "CY15B102Q"},  //Cypress 2Mb FRAM, CY15B102Q
+{{0x60, 0x2A, 0xC2}, 24, 16, 512, 0, 262144, 250, 1200, "CY15B102Q"},  //Cypress 2Mb FRAM, CY15B102Q
+{{0x04, 0x7F, 0x48}, 24, 16, 512, 0, 262144, 250, 1200, "MB85RS2MTAPNF"},  //Fujitsu 2Mb FRAM, MB85RS2MTAPNF
+{{0x04, 0x7F, 0x49}, 24, 16, 512, 0, 524288, 250, 1200, "MB85RS4MT"},  //Fujitsu 4Mb FRAM, MB85RS2MT
 
 };
 
@@ -99,9 +100,63 @@ const char * LittleFS_RAM::getMediaName() {
 	return ram_pn_name;
 }
 
+// A persistent RAM disk starts with a header describing its geometry, so
+// begin() can tell a filesystem left by the program before a warm reboot
+// from whatever the memory held at power up.
+#define RAMDISK_MAGIC 0x4B534452 // "RDSK"
+
+struct ramdisk_header {
+	uint32_t magic;
+	uint32_t crc;
+	uint32_t read_size;
+	uint32_t prog_size;
+	uint32_t block_size;
+	uint32_t block_count;
+	uint32_t reserved[2];
+};
+
+static uint32_t ramdisk_crc(const struct ramdisk_header *h)
+{
+	return lfs_crc(0xFFFFFFFF, &h->read_size, sizeof(*h) - 8);
+}
+
+FLASHMEM
+bool LittleFS_RAM::mountPersistent()
+{
+	const struct ramdisk_header *h = (struct ramdisk_header *)config.context - 1;
+	if (h->magic != RAMDISK_MAGIC || h->crc != ramdisk_crc(h)) return false;
+	if (h->read_size != config.read_size || h->prog_size != config.prog_size
+	  || h->block_size != config.block_size || h->block_count != config.block_count) {
+		return false; // different size or tuning, start over
+	}
+	if (lfs_mount(&lfs, &config) < 0) return false;
+	//Serial.println("mounted existing RAM disk");
+	mounted = true;
+	recoverInPlace();
+	return true;
+}
+
+FLASHMEM
+void LittleFS_RAM::saveHeader()
+{
+	struct ramdisk_header *h = (struct ramdisk_header *)config.context - 1;
+	memset(h, 0, sizeof(*h));
+	h->read_size = config.read_size;
+	h->prog_size = config.prog_size;
+	h->block_size = config.block_size;
+	h->block_count = config.block_count;
+	h->crc = ramdisk_crc(h);
+	h->magic = RAMDISK_MAGIC;
+#if defined(__IMXRT1062__)
+	arm_dcache_flush(h, sizeof(*h));
+#endif
+}
+
 FLASHMEM
 bool LittleFS_SPIFlash::begin(uint8_t cspin, SPIClass &spiport)
 {
+	// the old media's queued writes must not be lost or land on new media
+	if (!flushWriteCache()) return false;
 	pin = cspin;
 	port = &spiport;
 
@@ -140,6 +195,8 @@ bool LittleFS_SPIFlash::begin(uint8_t cspin, SPIClass &spiport)
 	config.lookahead_size = info->progsize;
 	// config.lookahead_size = config.block_count/8;
 	config.name_max = LFS_NAME_MAX;
+	if (!tuneConfig(config.block_size)) return false; // RAM budget too small
+	hookCallbacks(); // track which blocks are erased
 	configured = true;
 
 	//Serial.println("attempting to mount existing media");
@@ -212,36 +269,57 @@ bool LittleFS_SPIFram::begin(uint8_t cspin, SPIClass &spiport)
 	config.prog = &static_prog;
 	config.erase = &static_erase;
 	config.sync = &static_sync;
-	config.read_size = info->progsize;
-	config.prog_size = info->progsize;
-	config.block_size = info->erasesize;
-	config.block_count = info->chipsize / info->erasesize;
-	config.block_cycles = 400;
-	config.cache_size = info->progsize;
-	config.lookahead_size = info->progsize;
 	config.name_max = LFS_NAME_MAX;
+	if (!setGeometry(false)) return false; // RAM budget too small
+	rewritable = true;
 	configured = true;
 
 	//Serial.println("attempting to mount existing media");
 	if (lfs_mount(&lfs, &config) < 0) {
-		//Serial.println("couldn't mount media, attemping to format");
-		if (lfs_format(&lfs, &config) < 0) {
-			//Serial.println("format failed :(");
-			port = nullptr;
-			return false;
-		}
-		//Serial.println("attempting to mount freshly formatted media");
+		// media formatted with the 128 byte blocks used before
+		setGeometry(true);
 		if (lfs_mount(&lfs, &config) < 0) {
-			//Serial.println("mount after format failed :(");
-			port = nullptr;
-			return false;
+			setGeometry(false);
+			//Serial.println("couldn't mount media, attemping to format");
+			if (lfs_format(&lfs, &config) < 0) {
+				//Serial.println("format failed :(");
+				port = nullptr;
+				return false;
+			}
+			//Serial.println("attempting to mount freshly formatted media");
+			if (lfs_mount(&lfs, &config) < 0) {
+				//Serial.println("mount after format failed :(");
+				port = nullptr;
+				return false;
+			}
 		}
 	}
+	hookCallbacks(); // track which blocks are erased
 	mounted = true;
+	recoverInPlace();
 	//Serial.println("success");
 	return true;
 }
 
+// Small read and prog sizes keep commit padding short, while 512 byte
+// blocks hold enough metadata that finding a file reads few blocks.  The
+// lookahead covers every block, so allocating never has to traverse the
+// filesystem more than once.
+FLASHMEM
+bool LittleFS_SPIFram::setGeometry(bool legacy)
+{
+	const struct chipinfo *info = (const struct chipinfo *)hwinfo;
+	const lfs_size_t progsize = legacy ? 64 : info->progsize;
+	config.read_size = progsize;
+	config.prog_size = progsize;
+	config.block_size = legacy ? 128 : info->erasesize;
+	config.block_count = info->chipsize / config.block_size;
+	config.block_cycles = -1; // FRAM doesn't wear out
+	config.cache_size = legacy ? progsize : progsize * 4;
+	config.lookahead_size = ((config.block_count + 63) / 64) * 8;
+	return legacy || tuneConfig(config.block_size, false);
+}
+
 FLASHMEM
 const char * LittleFS_SPIFram::getMediaName() {
 	if (!hwinfo) return nullptr;
@@ -252,6 +330,9 @@ FLASHMEM
 bool LittleFS::quickFormat()
 {
 	if (!configured) return false;
+	// queued writes would otherwise land on the new filesystem
+	if (!flushWriteCache()) return false;
+	maintenanceReset();
 	if (mounted) {
 		//Serial.println("unmounting filesystem");
 		lfs_unmount(&lfs);
@@ -275,6 +356,273 @@ bool LittleFS::quickFormat()
 	return true;
 }
 
+// In place writes.  A write of up to INPLACE_MAX bytes within a file
+// opened with FILE_WRITE_INPLACE is first copied to a journal file, then
+// written over the file's data, then the journal is cleared.  The journal
+// is larger than any inline file, so it is also written in place.  If
+// power is lost during the update, recoverInPlace() writes it again.
+#define INPLACE_FILE  "/.inplace"
+#define INPLACE_MAGIC 0x4C504E49 // "INPL"
+#define INPLACE_MAX   256
+#define INPLACE_SIZE  1024
+
+struct inplace_header {
+	uint32_t magic;		// INPLACE_MAGIC while an update is in progress
+	uint32_t crc;		// of the rest of the header, path and data
+	uint32_t pos;
+	uint16_t size;
+	uint16_t pathlen;
+};
+
+FLASHMEM
+bool LittleFS::openJournal()
+{
+	if (journal) return true;
+	journal = (lfs_file_t *)malloc(sizeof(lfs_file_t));
+	if (!journal) return false;
+	if (lfs_file_open(&lfs, journal, INPLACE_FILE, LFS_O_RDWR | LFS_O_CREAT) >= 0) {
+		if (lfs_file_size(&lfs, journal) == INPLACE_SIZE) return true;
+		// new journal, all zeros
+		if (lfs_file_truncate(&lfs, journal, INPLACE_SIZE) >= 0
+		  && lfs_file_sync(&lfs, journal) >= 0) return true;
+		lfs_file_close(&lfs, journal);
+	}
+	free(journal);
+	journal = nullptr;
+	return false;
+}
+
+lfs_ssize_t LittleFS::rewrite(lfs_file_t *file, const char *path, const void *buf, lfs_size_t size)
+{
+	const size_t pathlen = strlen(path);
+	if (!rewritable || size > INPLACE_MAX || pathlen >= 128) return LFS_ERR_INVAL;
+	const lfs_soff_t pos = lfs_file_tell(&lfs, file);
+	if (pos < 0) return pos;
+	// only data already in the file's blocks can be rewritten, check before
+	// journaling an update lfs_file_rewrite() would refuse
+	if (file->flags & LFS_F_WRITING) {
+		int err = lfs_file_sync(&lfs, file);
+		if (err < 0) return err;
+	}
+	if ((file->flags & LFS_F_INLINE) || pos + size > file->ctz.size) return LFS_ERR_INVAL;
+	if (!openJournal()) return LFS_ERR_INVAL;
+
+	uint8_t record[sizeof(inplace_header) + 128 + INPLACE_MAX];
+	struct inplace_header *h = (struct inplace_header *)record;
+	h->magic = 0;
+	h->pos = pos;
+	h->size = size;
+	h->pathlen = pathlen;
+	memcpy(record + sizeof(inplace_header), path, pathlen);
+	memcpy(record + sizeof(inplace_header) + pathlen, buf, size);
+	const lfs_size_t len = sizeof(inplace_header) + pathlen + size;
+	h->crc = lfs_crc(0xFFFFFFFF, record + 8, len - 8);
+
+	// the record, then the magic which makes it valid
+	const uint32_t magic = INPLACE_MAGIC, clear = 0;
+	lfs_ssize_t r = lfs_file_seek(&lfs, journal, 4, LFS_SEEK_SET);
+	if (r < 0) return r;
+	r = lfs_file_rewrite(&lfs, journal, record + 4, len - 4);
+	if (r < 0) return r;
+	r = lfs_file_seek(&lfs, journal, 0, LFS_SEEK_SET);
+	if (r < 0) return r;
+	r = lfs_file_rewrite(&lfs, journal, &magic, 4);
+	if (r < 0) return r;
+	r = lfs_file_rewrite(&lfs, file, buf, size);
+	// the file may be partly written, leave the journal for recoverInPlace()
+	if (r < 0 && r != LFS_ERR_INVAL) return r;
+	lfs_ssize_t rc = lfs_file_seek(&lfs, journal, 0, LFS_SEEK_SET);
+	if (rc >= 0) rc = lfs_file_rewrite(&lfs, journal, &clear, 4);
+	return (rc < 0 && r >= 0) ? rc : r;
+}
+
+lfs_ssize_t LittleFSFile::rewrite(const void *buf, size_t size)
+{
+	return inPlace->rewrite(file, fullpath, buf, size);
+}
+
+FLASHMEM
+void LittleFS::recoverInPlace()
+{
+	lfs_file_t file;
+	if (lfs_file_open(&lfs, &file, INPLACE_FILE, LFS_O_RDWR) < 0) return;
+	uint8_t record[sizeof(inplace_header) + 128 + INPLACE_MAX];
+	struct inplace_header *h = (struct inplace_header *)record;
+	lfs_ssize_t n = lfs_file_read(&lfs, &file, record, sizeof(record));
+	if (n >= (lfs_ssize_t)sizeof(inplace_header) && h->magic == INPLACE_MAGIC) {
+		const lfs_size_t len = sizeof(inplace_header) + h->pathlen + h->size;
+		if (h->size <= INPLACE_MAX && h->pathlen < 128 && (lfs_size_t)n >= len
+		  && h->crc == lfs_crc(0xFFFFFFFF, record + 8, len - 8)) {
+			char path[128];
+			memcpy(path, record + sizeof(inplace_header), h->pathlen);
+			path[h->pathlen] = 0;
+			lfs_file_t target;
+			if (lfs_file_open(&lfs, &target, path, LFS_O_WRONLY) >= 0) {
+				if (lfs_file_seek(&lfs, &target, h->pos, LFS_SEEK_SET) >= 0) {
+					lfs_file_rewrite(&lfs, &target,
+					  record + sizeof(inplace_header) + h->pathlen, h->size);
+				}
+				lfs_file_close(&lfs, &target);
+			}
+		}
+		const uint32_t clear = 0;
+		lfs_file_seek(&lfs, &file, 0, LFS_SEEK_SET);
+		lfs_file_rewrite(&lfs, &file, &clear, 4);
+	}
+	lfs_file_close(&lfs, &file);
+}
+
+// Compute cache_size, lookahead_size and block_cycles from the geometry
+// the media driver has already placed in config, within tuneBudget bytes
+// of RAM.  littlefs allocates a read cache, a prog cache, one more cache
+// per open file, and the lookahead bitmap.  max_cache is the largest
+// read/prog the driver can handle in one call.  Returns false if even the
+// smallest caches don't fit the budget.
+FLASHMEM
+bool LittleFS::tuneConfig(lfs_size_t max_cache, bool wear_leveling)
+{
+	if (!tuneBudget) return true; // keep the driver's fixed defaults
+	const lfs_size_t unit = max(config.read_size, config.prog_size);
+
+	// enough lookahead to cover the whole volume in a single traverse,
+	// but never more than a quarter of the budget
+	lfs_size_t lookahead = ((config.block_count + 63) / 64) * 8;
+	lfs_size_t lookahead_max = (tuneBudget / 4) & ~7ul;
+	if (lookahead_max < 8) lookahead_max = 8;
+	if (lookahead > lookahead_max) lookahead = lookahead_max;
+
+	unsigned int files;
+	lfs_size_t cache_max;
+	int32_t cycles;
+	if (tuneWorkload == WORKLOAD_LOGGING) {
+		// few files, long sequential writes: big caches mean fewer,
+		// longer prog calls.  Hot metadata, so wear level more often.
+		files = 1;
+		cache_max = config.block_size;
+		cycles = 200;
+	} else if (tuneWorkload == WORKLOAD_RANDOM_READ) {
+		// every cache miss reads a whole cache, so keep them small.
+		// Data rarely changes, so avoid metadata relocation overhead.
+		files = 2;
+		cache_max = unit;
+		cycles = 1000;
+	} else {
+		files = 2;
+		cache_max = max(unit, (lfs_size_t)4096);
+		cycles = 500;
+	}
+	if (cache_max > max_cache) cache_max = max_cache;
+
+	// caches can't be smaller than one read/prog unit, so give up
+	// lookahead first, down to littlefs' minimum of 8 bytes
+	const lfs_size_t cache_min = unit * (2 + files);
+	if (cache_min + 8 > tuneBudget) return false;
+	if (cache_min + lookahead > tuneBudget) {
+		lookahead = (tuneBudget - cache_min) & ~7ul;
+	}
+
+	lfs_size_t cache = unit;
+	while (cache * 2 <= cache_max && config.block_size % (cache * 2) == 0
+	  && (cache * 2) * (2 + files) + lookahead <= tuneBudget) {
+		cache *= 2;
+	}
+	config.cache_size = cache;
+	config.lookahead_size = lookahead;
+	config.block_cycles = wear_leveling ? cycles : -1;
+	return cache * (2 + files) + lookahead <= tuneBudget;
+}
+
+// Route the media driver's callbacks through LittleFS, for bookkeeping
+// which is the same for every type of media.  Must be called after the
+// driver has filled in config.
+FLASHMEM
+void LittleFS::hookCallbacks()
+{
+	config.fs = this;
+	if (config.erase != &static_hook_erase) {
+		// a new begin(), forget the old media's block state.  The arrays
+		// were sized for its block_count, so wear stats, scrubbing and
+		// background erase are enabled again for the new media.  lfs was
+		// already cleared, so maintenance files are only freed.
+		free(eraseCounts);
+		eraseCounts = nullptr;
+		free(eccCounts);
+		eccCounts = nullptr;
+		free(usedMap);
+		usedMap = nullptr;
+		mounted = false;
+		maintenanceReset();
+		if (wearMove) wearMoveFree();
+		eraseUnsaved = 0;
+		eraseTotal = 0;
+		const uint32_t len = 1+(config.block_count /8);
+		free(erasedMap);
+		erasedMap = (uint8_t *)malloc(len * 2);
+		dirtyMap = erasedMap ? erasedMap + len : nullptr;
+		if (erasedMap) memset(erasedMap, 0, len * 2);
+		writeCacheFree(); // anything unwritten was for the old media
+		driverRead = config.read;
+		driverProg = config.prog;
+		driverErase = config.erase;
+		config.read = &static_hook_read;
+		config.prog = &static_hook_prog;
+		config.erase = &static_hook_erase;
+	}
+}
+
+// hookDepth lets maintenance() know when it's been called from yield()
+// while a driver is waiting on the media, in the middle of another
+// filesystem operation.
+int LittleFS::static_hook_read(const struct lfs_config *c, lfs_block_t block,
+  lfs_off_t offset, void *buffer, lfs_size_t size)
+{
+	LittleFS *fs = ((const LittleFSConfig *)c)->fs;
+	fs->hookDepth++;
+	int err = fs->writeCache ? fs->cacheRead(block, offset, buffer, size)
+	  : fs->driverRead(c, block, offset, buffer, size);
+	fs->hookDepth--;
+	return err;
+}
+
+int LittleFS::static_hook_prog(const struct lfs_config *c, lfs_block_t block,
+  lfs_off_t offset, const void *buffer, lfs_size_t size)
+{
+	LittleFS *fs = ((const LittleFSConfig *)c)->fs;
+	fs->hookDepth++;
+	int err = fs->writeCache ? fs->cacheProg(block, offset, buffer, size)
+	  : fs->driverProg(c, block, offset, buffer, size);
+	fs->hookDepth--;
+	if (fs->usedMap) fs->usedMap[block/8] |= 1<<(block%8);
+	if (fs->erasedMap) {
+		fs->erasedMap[block/8] &= ~(1<<(block%8));
+		fs->dirtyMap[block/8] |= 1<<(block%8);
+	}
+	fs->mediaWritten = true;
+	return err;
+}
+
+int LittleFS::static_hook_erase(const struct lfs_config *c, lfs_block_t block)
+{
+	LittleFS *fs = ((const LittleFSConfig *)c)->fs;
+	if (fs->knownErased(block)) return 0; // nothing to erase or count
+	fs->hookDepth++;
+	int err = fs->writeCache ? fs->cacheErase(block) : fs->driverErase(c, block);
+	fs->hookDepth--;
+	if (err == 0 && fs->eraseCounts) {
+		fs->eraseCounts[block]++;
+		fs->eraseUnsaved++;
+		fs->eraseTotal++;
+	}
+	if (err == 0 && fs->eccCounts) fs->eccCounts[block] = 0; // fresh data from now on
+	// littlefs only erases blocks it's about to write
+	if (fs->usedMap) fs->usedMap[block/8] |= 1<<(block%8);
+	if (fs->erasedMap) {
+		if (err == 0) fs->erasedMap[block/8] |= 1<<(block%8);
+		fs->dirtyMap[block/8] &= ~(1<<(block%8));
+	}
+	return err;
+}
+
 static bool blockIsBlank(struct lfs_config *config, lfs_block_t block, void *readBuf, bool full=true );
 static bool blockIsBlank(struct lfs_config *config, lfs_block_t block, void *readBuf, bool full )
 {
@@ -292,6 +640,29 @@ static bool blockIsBlank(struct lfs_config *config, lfs_block_t block, void *rea
 	return true; // all bytes read as 0xFF
 }
 
+bool LittleFS::isBlank(lfs_block_t block)
+{
+	if (knownDirty(block)) return false;
+	void *buffer = malloc(config.read_size);
+	const bool blank = blockIsBlank(&config, block, buffer);
+	free(buffer);
+	return blank;
+}
+
+FLASHMEM
+bool LittleFS::mountOrFormat()
+{
+	//Serial.println("attempting to mount existing media");
+	if (lfs_mount(&lfs, &config) < 0) {
+		//Serial.println("couldn't mount media, attemping to format");
+		if (lfs_format(&lfs, &config) < 0) return false;
+		//Serial.println("attempting to mount freshly formatted media");
+		if (lfs_mount(&lfs, &config) < 0) return false;
+	}
+	mounted = true;
+	return true;
+}
+
 static int cb_usedBlocks( void *inData, lfs_block_t block )
 {
 	static lfs_block_t maxBlock;
@@ -315,7 +686,7 @@ static int cb_usedBlocks( void *inData, lfs_block_t block )
 
 FLASHMEM
 uint32_t LittleFS::formatUnused(uint32_t blockCnt, uint32_t blockStart) {
-	if ( !configured ) return 0;
+	if ( !configured || rewritable ) return 0;
 	uint32_t iiblk = 1+(config.block_count /8);
 	uint8_t *checkused = (uint8_t *)malloc( iiblk );
 	if ( checkused == nullptr) return 0;
@@ -340,8 +711,8 @@ uint32_t LittleFS::formatUnused(uint32_t blockCnt, uint32_t blockStart) {
 	while ( block<config.block_count && jj<blockCnt ) {
 		iiblk = block/8;
 		uint8_t jjbit = 1<<(block%8);
-		if ( !(checkused[iiblk] & jjbit) ) { // block not in use
-			if ( !blockIsBlank(&config, block, buffer, false )) {
+		if ( !(checkused[iiblk] & jjbit) && !knownErased(block) ) { // block not in use
+			if ( knownDirty(block) || !blockIsBlank(&config, block, buffer, false )) {
 				(*config.erase)(&config, block);
 				jj++;
 			}
@@ -356,19 +727,100 @@ uint32_t LittleFS::formatUnused(uint32_t blockCnt, uint32_t blockStart) {
 	return block; // return lastChecked block to store to start next pass as blockStart
 }
 
+// Background erase keeps the used block bitmap from one traverse for a
+// whole pass over the media.  Any block littlefs erases or writes after
+// the traverse is added by the callback hooks, so a block which is free
+// in the bitmap is still free.  Blocks freed during the pass are found
+// by the next traverse, which is only done after the media is written.
+FLASHMEM
+bool LittleFS::enableBackgroundErase(bool enable)
+{
+	if (!mounted) return false;
+	if (!enable) {
+		free(usedMap);
+		usedMap = nullptr;
+		return true;
+	}
+	if (rewritable) return false; // nothing to erase ahead of time
+	hookCallbacks();
+	if (!erasedMap) return false;
+	if (!usedMap) {
+		usedMap = (uint8_t *)malloc(1+(config.block_count /8));
+		if (!usedMap) return false;
+		usedValid = false;
+		mediaWritten = true;
+	}
+	return true;
+}
+
+bool LittleFS::backgroundErase(uint32_t budget_us)
+{
+	elapsedMicros usec = 0;
+	if (!usedValid) {
+		if (!mediaWritten) return false; // nothing can have been freed
+		memset(usedMap, 0, 1+(config.block_count /8));
+		cb_usedBlocks( nullptr, config.block_count ); // init and pass MAX block_count
+		if (lfs_fs_traverse(&lfs, cb_usedBlocks, usedMap) < 0) return false;
+		usedValid = true;
+		mediaWritten = false;
+		eraseCursor = 0;
+	}
+	while (eraseCursor < config.block_count) {
+		const lfs_block_t block = eraseCursor;
+		const uint8_t bit = 1<<(block%8);
+		if (!(usedMap[block/8] & bit) && !(erasedMap[block/8] & bit)) {
+			// don't start an erase which would run past the budget
+			if (usec + eraseMicros > budget_us) return true;
+			elapsedMicros t = 0;
+			(*config.erase)(&config, block);
+			if (t > eraseMicros) eraseMicros = t;
+			usedMap[block/8] &= ~bit; // still free, not about to be written
+		} else if (usec > budget_us) {
+			return true;
+		}
+		eraseCursor++;
+	}
+	usedValid = false;
+	return false;
+}
+
+// Do a little background work: scrubbing and static wear leveling, writing
+// out the write cache, then erasing unused blocks.  Returns true while any
+// has work left to do.
+bool LittleFS::maintenance(uint32_t budget_us)
+{
+	// never run inside another filesystem operation, eg from yield()
+	// while a driver waits for the media to finish
+	if (!mounted || hookDepth) return false;
+	elapsedMicros usec = 0;
+	bool busy = false;
+	if (wearMove) busy = staticWearLevel(budget_us);
+	if (writeCache && usec < budget_us) {
+		if (writeCacheDestage(budget_us - usec)) busy = true;
+	}
+	if (usedMap && usec < budget_us) {
+		if (backgroundErase(budget_us - usec)) busy = true;
+	}
+	return busy;
+}
+
 FLASHMEM
 bool LittleFS::lowLevelFormat(char progressChar, Print* pr)
 {
 	if (!configured) return false;
+	if (!flushWriteCache()) return false; // see quickFormat()
+	maintenanceReset();
 	if (mounted) {
 		lfs_unmount(&lfs);
 		mounted = false;
 	}
+	if (rewritable) return quickFormat(); // no erase needed
 	int ii=config.block_count/120;
 	void *buffer = malloc(config.read_size);
 	for (unsigned int block=0; block < config.block_count; block++) {
 		if (pr && progressChar && (0 == block%ii) ) pr->write(progressChar);
-		if (!blockIsBlank(&config, block, buffer)) {
+		if (knownErased(block)) continue;
+		if (knownDirty(block) || !blockIsBlank(&config, block, buffer)) {
 			(*config.erase)(&config, block);
 		}
 	}
@@ -424,38 +876,44 @@ int LittleFS_SPIFlash::read(lfs_block_t block, lfs_off_t offset, void *buf, lfs_
 int LittleFS_SPIFlash::prog(lfs_block_t block, lfs_off_t offset, const void *buf, lfs_size_t size)
 {
 	if (!port) return LFS_ERR_IO;
-	const uint32_t addr = block * config.block_size + offset;
+	uint32_t addr = block * config.block_size + offset;
+	const uint8_t *p = (const uint8_t *)buf;
 	const uint8_t addrbits = ((const struct chipinfo *)hwinfo)->addrbits;
-	const uint8_t cmd = (addrbits == 24) ? 0x02 : 0x12; // page program
-	uint8_t cmdaddr[5];
-	make_command_and_address(cmdaddr, cmd, addr, addrbits);
-	//printtbuf(cmdaddr, 1 + (addrbits >> 3));
-	port->beginTransaction(SPICONFIG);
-	digitalWrite(pin, LOW);
-	port->transfer(0x06); // 0x06 = write enable
-	digitalWrite(pin, HIGH);
-	delayNanoseconds(250);
-	digitalWrite(pin, LOW);
-	port->transfer(cmdaddr, 1 + (addrbits >> 3));
-	port->transfer(buf, nullptr, size);
-	digitalWrite(pin, HIGH);
-	port->endTransaction();
-	//printtbuf(buf, 20);
+	const uint16_t progsize = ((const struct chipinfo *)hwinfo)->progsize;
 	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-	return wait(progtime);
+	const uint8_t cmd = (addrbits == 24) ? 0x02 : 0x12; // page program
+	while (size > 0) {
+		// page program wraps at the page boundary, so a cache
+		// larger than one page must be written one page at a time
+		lfs_size_t len = progsize - (addr % progsize);
+		if (len > size) len = size;
+		uint8_t cmdaddr[5];
+		make_command_and_address(cmdaddr, cmd, addr, addrbits);
+		//printtbuf(cmdaddr, 1 + (addrbits >> 3));
+		port->beginTransaction(SPICONFIG);
+		digitalWrite(pin, LOW);
+		port->transfer(0x06); // 0x06 = write enable
+		digitalWrite(pin, HIGH);
+		delayNanoseconds(250);
+		digitalWrite(pin, LOW);
+		port->transfer(cmdaddr, 1 + (addrbits >> 3));
+		port->transfer(p, nullptr, len);
+		digitalWrite(pin, HIGH);
+		port->endTransaction();
+		//printtbuf(p, 20);
+		int err = wait(progtime);
+		if (err) return err;
+		addr += len;
+		p += len;
+		size -= len;
+	}
+	return 0;
 }
 
 int LittleFS_SPIFlash::erase(lfs_block_t block)
 {
 	if (!port) return LFS_ERR_IO;
-	void *buffer = malloc(config.read_size);
-	if ( buffer != nullptr) {
-		if ( blockIsBlank(&config, block, buffer)) {
-			free(buffer);
-			return 0; // Already formatted exit no wait
-		}
-		free(buffer);
-	}
+	if (isBlank(block)) return 0; // Already formatted exit no wait
 	const uint32_t addr = block * config.block_size;
 	uint8_t cmdaddr[5];
 	const uint8_t erasecmd = ((const struct chipinfo *)hwinfo)->erasecmd;
@@ -544,52 +1002,17 @@ int LittleFS_SPIFram::prog(lfs_block_t block, lfs_off_t offset, const void *buf,
 	return 0;
 }
 
+// FRAM is written in place, nothing needs erasing.  littlefs doesn't
+// depend on the erased state, it reads what follows each commit.
 int LittleFS_SPIFram::erase(lfs_block_t block)
 {
 	if (!port) return LFS_ERR_IO;
-	void *buffer = malloc(config.read_size);
-	if ( buffer != nullptr) {
-		if ( blockIsBlank(&config, block, buffer)) {
-			free(buffer);
-			return 0; // Already formatted exit no wait
-		}
-		free(buffer);
-	}
-	//Serial.printf("  flash er: block=%d\n", block);
-	uint8_t buf[256];
-	//for(uint32_t i = 0; i < config.block_size; i++) buf[i] = 0xFF;
-	memset(buf, 0xFF, config.block_size);
-	uint8_t cmdaddr[5];
-	const uint32_t addr = block * config.block_size;
-	const uint8_t addrbits = ((const struct chipinfo *)hwinfo)->addrbits;
-	make_command_and_address(cmdaddr, 0x02, addr, addrbits);
-	
-	// F-RAM WRITE ENABLE COMMAND
-	port->beginTransaction(SPICONFIG);
-	digitalWrite(pin,LOW);  //chip select
-	port->transfer(0x06);    //transmit write enable opcode
-	digitalWrite(pin,HIGH); //release chip, signal end transfer
-	delayNanoseconds(50);
-	// F-RAM WRITE OPERATION
-	digitalWrite(pin,LOW);                   //chip select
-	port->transfer(cmdaddr, 1 + (addrbits >> 3));  
-  
-	// Data byte transmission
-	port->transfer(buf, nullptr, config.block_size);
-	digitalWrite(pin,HIGH);                  //release chip, signal end of transfer
-	port->endTransaction();
-	
 	return 0;
 }
 
+// FRAM writes complete at bus speed, there is never anything to wait for
 int LittleFS_SPIFram::wait(uint32_t microseconds)
 {
-	elapsedMicros usec = 0;
-	while (1) {
-		if (usec > microseconds) break; // timeout
-		yield();
-	}
-	//Serial.printf("  waited %u us\n", (unsigned int)usec);
 	return 0; // success
 }
 
@@ -733,6 +1156,7 @@ bool LittleFS_QSPIFlash::begin()
 	// https://github.com/PaulStoffregen/LittleFS/issues/63
 	if (Serial) ;
 
+	if (!flushWriteCache()) return false; // see LittleFS_SPIFlash::begin
 	configured = false;
 
 	uint8_t buf[4] = {0, 0, 0, 0};
@@ -768,6 +1192,8 @@ bool LittleFS_QSPIFlash::begin()
 	config.lookahead_size = info->progsize;
 	//config.lookahead_size = config.block_count/8;
 	config.name_max = LFS_NAME_MAX;
+	if (!tuneConfig(config.block_size)) return false; // RAM budget too small
+	hookCallbacks(); // track which blocks are erased
 	configured = true;
 
 	// configure FlexSPI2 for chip's size
@@ -848,18 +1274,30 @@ int LittleFS_QSPIFlash::read(lfs_block_t block, lfs_off_t offset, void *buf, lfs
 
 int LittleFS_QSPIFlash::prog(lfs_block_t block, lfs_off_t offset, const void *buf, lfs_size_t size)
 {
-	flexspi2_ip_command(10, 0);
-	const uint32_t addr = block * config.block_size + offset;
-	//printtbuf(buf, 20);
-	flexspi2_ip_write(11, addr, buf, size);
-	// TODO: detect errors, return LFS_ERR_IO
+	uint32_t addr = block * config.block_size + offset;
+	const uint8_t *p = (const uint8_t *)buf;
+	const uint16_t progsize = ((const struct chipinfo *)hwinfo)->progsize;
 	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-	return wait(progtime);
+	while (size > 0) {
+		// page program can't cross a page boundary
+		lfs_size_t len = progsize - (addr % progsize);
+		if (len > size) len = size;
+		flexspi2_ip_command(10, 0);
+		//printtbuf(p, 20);
+		flexspi2_ip_write(11, addr, p, len);
+		// TODO: detect errors, return LFS_ERR_IO
+		int err = wait(progtime);
+		if (err) return err;
+		addr += len;
+		p += len;
+		size -= len;
+	}
+	return 0;
 }
 
 int LittleFS_QSPIFlash::erase(lfs_block_t block)
 {
-	void *buffer = malloc(config.read_size);
+	void *buffer = knownDirty(block) ? nullptr : malloc(config.read_size);
 	if ( buffer != nullptr) {
 		if ( blockIsBlank(&config, block, buffer)) {
 			free(buffer);
@@ -917,8 +1355,48 @@ const char * LittleFS_QSPIFlash::getMediaName(){
 #define FLASH_SIZE  0xFC0000
 #define SECTOR_SIZE 65536
 #endif
+#define FLASH_PAGE_SIZE 256
 extern unsigned long _flashimagelen;
 uint32_t LittleFS_Program::baseaddr = 0;
+uint32_t LittleFS_Program::blocksize = SECTOR_SIZE;
+
+// from eeprom.c
+extern "C" void eepromemu_flash_write(void *addr, const void *data, uint32_t len);
+extern "C" void eepromemu_flash_erase_sector(void *addr);
+extern "C" void eepromemu_flash_erase_32K_block(void *addr);
+extern "C" void eepromemu_flash_erase_64K_block(void *addr);
+
+// Write combining.  littlefs programs 128 bytes at a time, but each flash
+// write is a whole page program command, with interrupts disabled and
+// everything running from flash stalled until it completes.  A program
+// which stops part way into a page is held here until the rest of the
+// page follows, so a page is usually written with one command.  Anything
+// else, or an erase or sync, writes it out first.  littlefs reads back
+// the held copy, so the flash is checked when it's written, and a
+// mismatch is returned by the prog, erase or sync which wrote it.  The
+// page then stays held, so littlefs reads the intended data while it
+// moves it to another block, until its block is erased.
+static struct {
+	uint32_t addr;		// page address, 0 when nothing is held
+	uint16_t start;		// held bytes within the page
+	uint16_t end;
+	bool failed;		// written, but the flash didn't match
+	uint8_t data[FLASH_PAGE_SIZE];
+} progpage;
+
+static int progpage_flush()
+{
+	if (!progpage.addr || progpage.failed) return 0;
+	uint8_t *p = (uint8_t *)(progpage.addr + progpage.start);
+	const uint32_t len = progpage.end - progpage.start;
+	eepromemu_flash_write(p, progpage.data + progpage.start, len);
+	if (memcmp(p, progpage.data + progpage.start, len) != 0) {
+		progpage.failed = true;
+		return LFS_ERR_CORRUPT;
+	}
+	progpage.addr = 0;
+	return 0;
+}
 
 FLASHMEM
 bool LittleFS_Program::begin(uint32_t size)
@@ -926,10 +1404,20 @@ bool LittleFS_Program::begin(uint32_t size)
 	//Serial.println("Program flash begin");
 	//Serial.printf("size in bytes - %u \n", size); 
 	
+	progpage_flush(); // anything still held from a previous begin
+	progpage.addr = 0;
+	progpage.failed = false;
 	configured = false;
 	baseaddr = 0;
+	// erases are 4K sectors, or 32K or 64K blocks
+	blocksize = progBlockSize ? progBlockSize : SECTOR_SIZE;
+	if (blocksize != 4096 && blocksize != 32768 && blocksize != 65536) return false;
 	//size = size & 0xFFFF0000;
-	size = (size + 0xFFFF) & 0xFFFF0000;
+	if (progBlockSize) {
+		size = (size + blocksize - 1) & ~(blocksize - 1);
+	} else {
+		size = (size + 0xFFFF) & 0xFFFF0000; // keep existing layouts where they were
+	}
 	if (size == 0) return false;
 	const uint32_t program_size = (uint32_t)&_flashimagelen; 
 	if (program_size >= FLASH_SIZE) return false;
@@ -937,7 +1425,13 @@ bool LittleFS_Program::begin(uint32_t size)
 	//Serial.printf("FLASH_SIZE - %u, program_size - %u\n", FLASH_SIZE, program_size);
 	//Serial.printf("available_space = %u\n", available_space);
 	if (size > available_space) return false;
-	baseaddr = 0x60000000 + FLASH_SIZE - size;
+	if (progOffset) {
+		if (progOffset % blocksize) return false;
+		if (progOffset < program_size || progOffset > FLASH_SIZE - size) return false;
+		baseaddr = 0x60000000 + progOffset;
+	} else {
+		baseaddr = 0x60000000 + FLASH_SIZE - size;
+	}
 	//Serial.printf("size - %u,  baseaddr = %x\n", size, baseaddr);
 
 	memset(&lfs, 0, sizeof(lfs));
@@ -949,12 +1443,17 @@ bool LittleFS_Program::begin(uint32_t size)
 	config.sync = &static_sync;
 	config.read_size = 128;
 	config.prog_size = 128;
-	config.block_size = SECTOR_SIZE;
-	config.block_count = size / SECTOR_SIZE;
+	config.block_size = blocksize;
+	config.block_count = size / blocksize;
 	config.block_cycles = 800;
 	config.cache_size = 128;
 	config.lookahead_size = 128;
 	config.name_max = LFS_NAME_MAX;
+	if (!tuneConfig(config.block_size)) return false; // RAM budget too small
+	hookCallbacks(); // track which blocks are erased
+	reportsBadBlocks = true; // a held page which fails to verify, see progpage_flush()
+	// typical erase times of the Winbond chips used on Teensy 4
+	setEraseTime(blocksize == 4096 ? 45000 : (blocksize == 32768 ? 120000 : 150000));
 	configured = true;
 
 	//Serial.println("attempting to mount existing media");
@@ -978,8 +1477,17 @@ int LittleFS_Program::static_read(const struct lfs_config *c, lfs_block_t block,
 	lfs_off_t offset, void *buffer, lfs_size_t size)
 {
 	//Serial.printf("   prog rd: block=%d, offset=%d, size=%d\n", block, offset, size);
-	const uint8_t *p = (uint8_t *)(baseaddr + block * SECTOR_SIZE + offset);
-	memcpy(buffer, p, size);
+	const uint32_t addr = baseaddr + block * blocksize + offset;
+	memcpy(buffer, (const uint8_t *)addr, size);
+	if (progpage.addr) {
+		// littlefs reads back what it programmed, including the held page
+		const uint32_t start = max(addr, progpage.addr + progpage.start);
+		const uint32_t end = min(addr + size, progpage.addr + progpage.end);
+		if (start < end) {
+			memcpy((uint8_t *)buffer + (start - addr),
+			  progpage.data + (start - progpage.addr), end - start);
+		}
+	}
 	return 0;
 }
 
@@ -988,37 +1496,73 @@ const char * LittleFS_Program::getMediaName() {
 	return prog_pn_name; 
 }
 
-// from eeprom.c
-extern "C" void eepromemu_flash_write(void *addr, const void *data, uint32_t len);
-extern "C" void eepromemu_flash_erase_sector(void *addr);
-extern "C" void eepromemu_flash_erase_32K_block(void *addr);
-extern "C" void eepromemu_flash_erase_64K_block(void *addr);
-
 int LittleFS_Program::static_prog(const struct lfs_config *c, lfs_block_t block,
 	lfs_off_t offset, const void *buffer, lfs_size_t size)
 {
 	//Serial.printf("   prog wr: block=%d, offset=%d, size=%d\n", block, offset, size);
-	uint8_t *p = (uint8_t *)(baseaddr + block * SECTOR_SIZE + offset);
-	eepromemu_flash_write(p, buffer, size);
+	uint32_t addr = baseaddr + block * blocksize + offset;
+	const uint8_t *src = (const uint8_t *)buffer;
+	while (size > 0) {
+		// each flash write is a single page program command
+		const uint32_t page = addr & ~(FLASH_PAGE_SIZE - 1);
+		const uint32_t start = addr - page;
+		lfs_size_t len = FLASH_PAGE_SIZE - start;
+		if (len > size) len = size;
+		if (progpage.addr && (progpage.addr != page || progpage.end != start)) {
+			int err = progpage_flush();
+			if (err) return err;
+		}
+		if (progpage.failed || (!progpage.addr && start + len == FLASH_PAGE_SIZE)) {
+			eepromemu_flash_write((void *)addr, src, len);
+		} else {
+			if (!progpage.addr) {
+				progpage.addr = page;
+				progpage.start = start;
+			}
+			memcpy(progpage.data + start, src, len);
+			progpage.end = start + len;
+			if (progpage.end == FLASH_PAGE_SIZE) {
+				int err = progpage_flush();
+				if (err) return err;
+			}
+		}
+		addr += len;
+		src += len;
+		size -= len;
+	}
 	return 0;
 }
 
 int LittleFS_Program::static_erase(const struct lfs_config *c, lfs_block_t block)
 {
 	//Serial.printf("   prog er: block=%d\n", block);
-	uint8_t *p = (uint8_t *)(baseaddr + block * SECTOR_SIZE);
-#if SECTOR_SIZE == 4096
-	eepromemu_flash_erase_sector(p);
-#elif SECTOR_SIZE == 32768
-	eepromemu_flash_erase_32K_block(p);
-#elif SECTOR_SIZE == 65536
-	eepromemu_flash_erase_64K_block(p);
-#else
-#error "Program SECTOR_SIZE must be 4096, 32768, or 65536"
-#endif
+	int err = progpage_flush();
+	if (err) return err;
+	uint8_t *p = (uint8_t *)(baseaddr + block * blocksize);
+	if (progpage.failed && progpage.addr - (uint32_t)p < blocksize) {
+		progpage.addr = 0; // erased, its data was moved elsewhere
+		progpage.failed = false;
+	}
+	// reading is fast, don't stall everything to erase a blank sector
+	const uint32_t *w = (const uint32_t *)p;
+	uint32_t i = 0;
+	while (i < blocksize / 4 && w[i] == 0xFFFFFFFF) i++;
+	if (i == blocksize / 4) return 0;
+	if (blocksize == 4096) {
+		eepromemu_flash_erase_sector(p);
+	} else if (blocksize == 32768) {
+		eepromemu_flash_erase_32K_block(p);
+	} else {
+		eepromemu_flash_erase_64K_block(p);
+	}
 	return 0;
 }
 
+int LittleFS_Program::static_sync(const struct lfs_config *c)
+{
+	return progpage_flush();
+}
+
 
 #endif // __IMXRT1062__
 //-----------------------------------------------------------------------------
@@ -27,6 +27,13 @@
 #include "littlefs/lfs.h"
 //#include <algorithm>
 
+// open() mode for fixed size record files on media which can overwrite
+// data without erasing (RAM, FRAM).  Like FILE_WRITE_BEGIN, but writes
+// within the file are made in place, see LittleFS::rewrite
+#define FILE_WRITE_INPLACE 0x82
+
+class LittleFS;
+
 class LittleFSFile : public FileImpl
 {
 private:
@@ -90,6 +97,10 @@ public:
 		//Serial.println("write");
 		if (!file) return 0;
 		//Serial.println(" is regular file");
+		if (inPlace) {
+			lfs_ssize_t r = rewrite(buf, size);
+			if (r != LFS_ERR_INVAL) return (r < 0) ? 0 : r;
+		}
 		return lfs_file_write(lfs, file, buf, size);
 	}
 	virtual int peek() {
@@ -212,6 +223,8 @@ private:
 	lfs_dir_t *dir;
 	char *filename;
 	char fullpath[128];
+	LittleFS *inPlace = nullptr;	// opened with FILE_WRITE_INPLACE
+	lfs_ssize_t rewrite(const void *buf, size_t size);
 	
 	uint32_t getCreationTime() {
 		uint32_t filetime = 0;
@@ -233,12 +246,45 @@ private:
 
 
 
+struct LittleFSWearMove;
+struct LittleFSWriteCache;
+
+// lfs_config plus a pointer back to the LittleFS instance which owns it, so
+// the media driver's callbacks can be wrapped for block bookkeeping
+struct LittleFSConfig : public lfs_config {
+	LittleFS *fs;
+};
+
+// Erase count summary returned by LittleFS::getWearStats()
+struct LittleFSWearStats {
+	uint32_t blocks;	// number of blocks in the filesystem
+	uint32_t minErase;	// fewest erases of any block
+	uint32_t maxErase;	// most erases of any block
+	float meanErase;	// average erases per block
+	uint64_t totalErase;	// sum of all erases
+	uint64_t totalCorrected;	// reads which needed ECC correction, see enableScrub()
+	uint32_t scrubPending;	// blocks at the scrub threshold
+	uint32_t scrubbed;	// files moved off those blocks
+};
+
 class LittleFS : public FS
 {
 public:
 	constexpr LittleFS() {
 	}
 	virtual ~LittleFS() { }
+	// Workload hints for the begin() variants which take a RAM budget.
+	// The cache, lookahead and block_cycles settings are then computed
+	// from the media geometry, rather than using fixed defaults.
+	enum workload_t {
+		WORKLOAD_MIXED = 0,	// general purpose use
+		WORKLOAD_LOGGING,	// mostly appending to files, large caches
+		WORKLOAD_RANDOM_READ	// mostly small reads, small caches
+	};
+	void setTuning(uint32_t ramBudget, workload_t workload=WORKLOAD_MIXED) {
+		tuneBudget = ramBudget;
+		tuneWorkload = workload;
+	}
 	virtual bool format(int type=0, char progressChar=0, Print& pr=Serial) {
 		if(type == 0) { return quickFormat(); }
 		if(type == 1) { return lowLevelFormat(progressChar, &pr); }
@@ -252,6 +298,52 @@ public:
 	bool quickFormat();
 	bool lowLevelFormat(char progressChar=0, Print* pr=&Serial);
 	uint32_t formatUnused(uint32_t blockCnt, uint32_t blockStart);
+	// Count erases of every block, kept in RAM and saved to a reserved
+	// file by saveWearStats().  Call after begin().  With preferLeastWorn
+	// the block allocator picks the least worn of nearby free blocks.
+	bool enableWearStats(bool preferLeastWorn=false);
+	bool saveWearStats();
+	bool getWearStats(LittleFSWearStats &stats, uint32_t *histogram=nullptr, unsigned int bins=0);
+	uint32_t eraseCount(lfs_block_t block) {
+		if (!eraseCounts || block >= config.block_count) return 0;
+		return eraseCounts[block];
+	}
+	// Static wear leveling.  When the difference between the most and
+	// least erased blocks exceeds threshold, maintenance() moves files
+	// sitting on little worn blocks onto more worn ones, a small piece
+	// at a time.  Call maintenance() often, from loop() or yield().  It
+	// returns true while a move is in progress.  Zero threshold disables.
+	bool enableStaticWearLeveling(uint32_t threshold=100);
+	// Background erase.  maintenance() erases unused blocks ahead of
+	// time, so writing new data doesn't wait for erasing.  Each block
+	// erase completes once started, so budget_us should exceed the
+	// media's block erase time.
+	bool enableBackgroundErase(bool enable=true);
+	// Scrubbing.  Count the reads of each block which needed ECC
+	// correction.  When a block reaches threshold, maintenance() moves
+	// the file using it to fresh blocks before errors become more than
+	// ECC can fix.  Media without ECC never count.  Zero disables.
+	bool enableScrub(uint32_t threshold=16);
+	uint32_t correctedCount(lfs_block_t block) {
+		if (!eccCounts || block >= config.block_count) return 0;
+		return eccCounts[block];
+	}
+	// Write cache.  Programs and erases are queued in RAM, size bytes at
+	// buffer (allocated when nullptr, in EXTMEM if present) and written to
+	// the media in order by maintenance() or flushWriteCache(), so bursts
+	// of writes don't wait for slow media.  Power loss discards what is
+	// still queued, leaving the filesystem as it was before those writes.
+	// File flush() and close() (lfs_file_sync) don't write the cache out,
+	// only flushWriteCache() does.  A media error writing it out is
+	// returned by the next filesystem operation, the failed record stays
+	// queued.  Not for NAND or program flash, which must see program
+	// failures at once.  begin() and formatting write the cache out
+	// first, and fail if that fails.
+	// Call after begin().  Zero size flushes and disables.
+	bool enableWriteCache(uint32_t size, void *buffer=nullptr);
+	bool flushWriteCache();
+	uint32_t writeCachePending();	// bytes not yet written to the media
+	bool maintenance(uint32_t budget_us);
 	File open(const char *filepath, uint8_t mode = FILE_READ) {
 		int rcode;
 		//Serial.println("LittleFS open");
@@ -294,7 +386,9 @@ public:
 				if (mode == FILE_WRITE) {
 					lfs_file_seek(&lfs, file, 0, LFS_SEEK_END);
 				} // else FILE_WRITE_BEGIN
-				return File(new LittleFSFile(&lfs, file, filepath));
+				LittleFSFile *f = new LittleFSFile(&lfs, file, filepath);
+				if (mode == FILE_WRITE_INPLACE && rewritable) f->inPlace = this;
+				return File(f);
 			}
 		}
 		return File();
@@ -348,10 +442,94 @@ public:
 	
 
 protected:
+	bool tuneConfig(lfs_size_t max_cache, bool wear_leveling=true);
+	void hookCallbacks();
+	// Block state seen by the callback hooks.  Both are false for blocks
+	// not erased or written since begin().
+	bool knownErased(lfs_block_t block) {
+		return erasedMap && (erasedMap[block/8] & (1<<(block%8)));
+	}
+	bool knownDirty(lfs_block_t block) {
+		return dirtyMap && (dirtyMap[block/8] & (1<<(block%8)));
+	}
+	// media drivers report reads ECC had to correct
+	void eccCorrected(lfs_block_t block, uint32_t pages=1);
+	// the datasheet's block erase time, so maintenance() doesn't start one
+	// which runs past its budget before it has timed an erase itself
+	void setEraseTime(uint32_t usec) {
+		if (usec > eraseMicros) eraseMicros = usec;
+	}
+	void maintenanceReset();
+	// Media which can program over programmed data without an erase set
+	// rewritable, allowing FILE_WRITE_INPLACE and skipping the erases of
+	// lowLevelFormat() and background erase, and call recoverInPlace()
+	// after mounting to finish an update cut short by power loss
+	bool rewritable = false;
+	void recoverInPlace();
+	// Media whose prog and erase return LFS_ERR_CORRUPT for a failed
+	// block, so littlefs moves the data elsewhere, set reportsBadBlocks
+	bool reportsBadBlocks = false;
+	// Read a block to see if it's already erased, so the erase can be
+	// skipped.  Blocks written since begin() aren't read.
+	bool isBlank(lfs_block_t block);
+	// Mount the media, formatting it if it holds no filesystem
+	bool mountOrFormat();
+	// Drivers which store each block's erase count with its data let
+	// enableWearStats() recover erases not yet saved to the stats file
+	virtual uint32_t storedEraseCount(lfs_block_t block) { return 0; }
 	bool configured = false;
 	bool mounted = false;
 	lfs_t lfs = {};
-	lfs_config config = {};
+	LittleFSConfig config = {};
+	uint32_t tuneBudget = 0;	// zero uses the fixed default settings
+	uint8_t tuneWorkload = WORKLOAD_MIXED;
+private:
+	static int static_hook_read(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, void *buffer, lfs_size_t size);
+	static int static_hook_prog(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size);
+	static int static_hook_erase(const struct lfs_config *c, lfs_block_t block);
+	static uint32_t static_wear(const struct lfs_config *c, lfs_block_t block);
+	bool staticWearLevel(uint32_t budget_us);
+	bool wearMoveStart(struct lfs_info *info);
+	void wearMoveFinish(bool ok);
+	bool wearMoveAlloc();
+	void wearMoveFree();
+	bool backgroundErase(uint32_t budget_us);
+	void writeCacheFree();
+	bool writeCacheDestage(uint32_t budget_us);
+	int destage(uint32_t max);
+	int cacheRead(lfs_block_t block, lfs_off_t offset, void *buffer, lfs_size_t size);
+	int cacheProg(lfs_block_t block, lfs_off_t offset, const void *buffer, lfs_size_t size);
+	int cacheErase(lfs_block_t block);
+	friend class LittleFSFile;
+	lfs_ssize_t rewrite(lfs_file_t *file, const char *path, const void *buf, lfs_size_t size);
+	bool openJournal();
+	lfs_file_t *journal = nullptr;	// open while in place writes are used
+	int (*driverRead)(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, void *buffer, lfs_size_t size) = nullptr;
+	int (*driverProg)(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size) = nullptr;
+	int (*driverErase)(const struct lfs_config *c, lfs_block_t block) = nullptr;
+	uint32_t *eraseCounts = nullptr;
+	uint32_t eraseUnsaved = 0;	// erases counted since last saveWearStats()
+	uint32_t eraseTotal = 0;	// erases counted since enableWearStats()
+	LittleFSWearMove *wearMove = nullptr;
+	uint16_t *eccCounts = nullptr;	// corrected reads since each block was erased
+	uint16_t scrubThreshold = 0;
+	uint32_t scrubQueued = 0;	// blocks reached scrubThreshold since the last scan
+	uint32_t scrubMoves = 0;	// files moved by scrubbing
+	uint64_t eccTotal = 0;		// corrected reads since enableScrub()
+	volatile uint8_t hookDepth = 0;	// nonzero while inside a media callback
+	bool wearInvert = false;	// allocator prefers most worn blocks
+	uint8_t *erasedMap = nullptr;	// 1 bits are blocks known to be erased
+	uint8_t *dirtyMap = nullptr;	// 1 bits are blocks written since erased
+	uint8_t *usedMap = nullptr;	// 1 bits are blocks in use
+	lfs_block_t eraseCursor = 0;	// next block for background erase
+	uint32_t eraseMicros = 0;	// longest time a block erase took
+	bool usedValid = false;		// usedMap holds a traverse
+	bool mediaWritten = true;	// written since usedMap was taken
+	LittleFSWriteCache *writeCache = nullptr;
 };
 
 
@@ -369,20 +547,45 @@ public:
 		return begin(malloc(size), size);
 #endif
 	}
+	bool begin(uint32_t size, uint32_t ramBudget, workload_t workload) {
+		setTuning(ramBudget, workload);
+		return begin(size);
+	}
+	bool begin(void *ptr, uint32_t size, uint32_t ramBudget, workload_t workload) {
+		setTuning(ramBudget, workload);
+		return begin(ptr, size);
+	}
 	bool begin(void *ptr, uint32_t size) {
 		//Serial.println("configure "); delay(5);
 		configured = false;
 		if (!ptr) return false;
-		memset(ptr, 0xFF, size); // always start with blank slate
+		if (persistent) {
+			if (size <= 32) return false;
+			ptr = (uint8_t *)ptr + 32; // header, see mountPersistent()
+			size -= 32;
+		} else {
+			memset(ptr, 0xFF, size); // always start with blank slate
+		}
 		size = size & 0xFFFFFF00;
 		memset(&lfs, 0, sizeof(lfs));
 		memset(&config, 0, sizeof(config));
 		config.context = ptr;
 		config.read = &static_read;
-		config.prog = &static_prog;
+		config.prog = persistent ? &static_prog_flush : &static_prog;
 		config.erase = &static_erase;
 		config.sync = &static_sync;
-		if ( size > 1024*1024 ) {
+		config.memory = ptr; // littlefs reads it directly
+		if ( tuneBudget ) {
+			// large blocks and small prog units, as callbacks cost more
+			// than memcpy and padding.  Caches up to a whole block.
+			config.read_size = 16;
+			config.prog_size = 16;
+			config.block_size = ( size > 1024*1024 ) ? 4096 : 1024;
+			config.block_count = size / config.block_size;
+			// RAM doesn't wear out
+			if (!tuneConfig(config.block_size, false)) return false;
+		}
+		else if ( size > 1024*1024 ) {
 			config.read_size = 256; // Must set cache_size. If read_buffer or prog_buffer are provided manually, these must be cache_size.
 			config.prog_size = 256;
 			config.block_size = 2048;
@@ -403,14 +606,22 @@ public:
 		config.name_max = LFS_NAME_MAX;
 		config.file_max = 0;
 		config.attr_max = 0;
+		hookCallbacks(); // forgets the old memory, which may be gone
+		rewritable = true;
 		configured = true;
+		if (persistent && mountPersistent()) return true;
 		if (lfs_format(&lfs, &config) < 0) return false;
 		//Serial.println("formatted");
 		if (lfs_mount(&lfs, &config) < 0) return false;
 		//Serial.println("mounted atfer format");
+		if (persistent) saveHeader();
 		mounted = true;
 		return true;
 	}
+	// Keep the filesystem across a warm reboot: begin() mounts what's
+	// already in memory when its header is valid, instead of formatting.
+	// Call before begin(ptr, size), with the same buffer and size.
+	void setPersistent(bool enable=true) { persistent = enable; }
 	FLASHMEM
 	uint32_t formatUnused(uint32_t blockCnt, uint32_t blockStart) {
 		return 0;
@@ -420,6 +631,9 @@ public:
 	const char * name() { return getMediaName(); }
 
 private:
+	bool persistent = false;
+	bool mountPersistent();
+	void saveHeader();
 	static int static_read(const struct lfs_config *c, lfs_block_t block,
 	  lfs_off_t offset, void *buffer, lfs_size_t size) {
 		//Serial.printf("    ram rd: block=%d, offset=%d, size=%d\n", block, offset, size);
@@ -434,11 +648,19 @@ private:
 		memcpy((uint8_t *)(c->context) + index, buffer, size);
 		return 0;
 	}
-	static int static_erase(const struct lfs_config *c, lfs_block_t block) {
-		uint32_t index = block * c->block_size;
-		memset((uint8_t *)(c->context) + index, 0xFF, c->block_size);
+	static int static_prog_flush(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size) {
+		uint32_t index = block * c->block_size + offset;
+		memcpy((uint8_t *)(c->context) + index, buffer, size);
+#if defined(__IMXRT1062__)
+		// a reset discards the data cache, write it to memory now
+		arm_dcache_flush((uint8_t *)(c->context) + index, size);
+#endif
 		return 0;
 	}
+	static int static_erase(const struct lfs_config *c, lfs_block_t block) {
+		return 0; // littlefs doesn't depend on the erased state
+	}
 	static int static_sync(const struct lfs_config *c) {
 		return 0;
 	}
@@ -450,6 +672,10 @@ class LittleFS_SPIFlash : public LittleFS
 public:
 	constexpr LittleFS_SPIFlash() { }
 	bool begin(uint8_t cspin, SPIClass &spiport=SPI);
+	bool begin(uint8_t cspin, SPIClass &spiport, uint32_t ramBudget, workload_t workload) {
+		setTuning(ramBudget, workload);
+		return begin(cspin, spiport);
+	}
 	const char * getMediaName();
 	const char * name() { return getMediaName(); }
 private:
@@ -486,6 +712,10 @@ class LittleFS_SPIFram : public LittleFS
 public:
 	constexpr LittleFS_SPIFram() { }
 	bool begin(uint8_t cspin, SPIClass &spiport=SPI);
+	bool begin(uint8_t cspin, SPIClass &spiport, uint32_t ramBudget, workload_t workload) {
+		setTuning(ramBudget, workload);
+		return begin(cspin, spiport);
+	}
 	const char * getMediaName();
 	const char * name() { return getMediaName(); }
 private:
@@ -493,6 +723,7 @@ private:
 	int prog(lfs_block_t block, lfs_off_t offset, const void *buf, lfs_size_t size);
 	int erase(lfs_block_t block);
 	int wait(uint32_t microseconds);
+	bool setGeometry(bool legacy);
 	static int static_read(const struct lfs_config *c, lfs_block_t block,
 	  lfs_off_t offset, void *buffer, lfs_size_t size) {
 		//Serial.printf("  flash rd: block=%d, offset=%d, size=%d\n", block, offset, size);
@@ -516,12 +747,349 @@ private:
 };
 
 
+// Compile-time chip descriptions for LittleFS_SPIFlashT and
+// LittleFS_SPIFramT, with the same fields as the known chips table in
+// LittleFS.cpp.  Describe other chips the same way, with a pn() name.
+template <uint32_t ID, uint8_t ADDRBITS, uint16_t PROGSIZE, uint32_t ERASESIZE,
+  uint8_t ERASECMD, uint32_t CHIPSIZE, uint32_t PROGTIME, uint32_t ERASETIME>
+struct LittleFS_ChipInfo {
+	static constexpr uint32_t id = ID;		// JEDEC ID, 3 bytes
+	static constexpr uint8_t addrbits = ADDRBITS;	// 24 or 32
+	static constexpr uint16_t progsize = PROGSIZE;	// page size, a power of 2
+	static constexpr uint32_t erasesize = ERASESIZE;
+	static constexpr uint8_t erasecmd = ERASECMD;
+	static constexpr uint32_t chipsize = CHIPSIZE;
+	static constexpr uint32_t progtime = PROGTIME;	// maximum microseconds
+	static constexpr uint32_t erasetime = ERASETIME;
+};
+struct LittleFS_W25Q16JV : LittleFS_ChipInfo<0xEF4015, 24, 256, 32768, 0x52, 2097152, 3000, 1600000> {
+	static const char * pn() { return "W25Q16JV-Q"; }
+};
+struct LittleFS_W25Q64JV : LittleFS_ChipInfo<0xEF4017, 24, 256, 65536, 0xD8, 8388608, 3000, 2000000> {
+	static const char * pn() { return "W25Q64JV-Q"; }
+};
+struct LittleFS_W25Q128JV : LittleFS_ChipInfo<0xEF4018, 24, 256, 65536, 0xD8, 16777216, 3000, 2000000> {
+	static const char * pn() { return "W25Q128JV-Q"; }
+};
+struct LittleFS_W25Q256JV : LittleFS_ChipInfo<0xEF4019, 32, 256, 65536, 0xDC, 33554432, 3000, 2000000> {
+	static const char * pn() { return "W25Q256JV-Q"; }
+};
+// FRAM: progsize is the read and prog size, erasesize the littlefs block size
+struct LittleFS_FM25V10 : LittleFS_ChipInfo<0xC22400, 24, 16, 512, 0, 131072, 250, 1200> {
+	static const char * pn() { return "FM25V10-G"; }
+};
+struct LittleFS_CY15B108QN : LittleFS_ChipInfo<0x032EC2, 24, 16, 512, 0, 1048576, 250, 1200> {
+	static const char * pn() { return "CY15B108QN"; }
+};
+
+// LittleFS_SPIFlash for one chip known when compiling.  Commands and
+// addresses are built from constants, without looking up the chip for
+// every read, prog and erase, and code for other chips isn't included.
+// begin() fails if a different chip is connected.  Use LittleFS_SPIFlash
+// to detect the chip at runtime.
+template <class Chip>
+class LittleFS_SPIFlashT : public LittleFS
+{
+public:
+	constexpr LittleFS_SPIFlashT() { }
+	bool begin(uint8_t cspin, SPIClass &spiport=SPI) {
+		if (!flushWriteCache()) return false; // see LittleFS_SPIFlash::begin
+		pin = cspin;
+		port = &spiport;
+		configured = false;
+		digitalWrite(pin, HIGH);
+		pinMode(pin, OUTPUT);
+		port->begin();
+		uint8_t buf[4] = {0x9F, 0, 0, 0};
+		port->beginTransaction(SPISettings(30000000, MSBFIRST, SPI_MODE0));
+		digitalWrite(pin, LOW);
+		port->transfer(buf, 4);
+		digitalWrite(pin, HIGH);
+		port->endTransaction();
+		if (((buf[1] << 16) | (buf[2] << 8) | buf[3]) != Chip::id) return false;
+		memset(&lfs, 0, sizeof(lfs));
+		memset(&config, 0, sizeof(config));
+		config.context = (void *)this;
+		config.read = &static_read;
+		config.prog = &static_prog;
+		config.erase = &static_erase;
+		config.sync = &static_sync;
+		config.read_size = Chip::progsize;
+		config.prog_size = Chip::progsize;
+		config.block_size = Chip::erasesize;
+		config.block_count = Chip::chipsize / Chip::erasesize;
+		config.block_cycles = 400;
+		config.cache_size = Chip::progsize;
+		config.lookahead_size = Chip::progsize;
+		config.name_max = LFS_NAME_MAX;
+		if (!tuneConfig(config.block_size)) return false; // RAM budget too small
+		hookCallbacks(); // track which blocks are erased
+		configured = true;
+		if (!mountOrFormat()) {
+			port = nullptr;
+			return false;
+		}
+		return true;
+	}
+	bool begin(uint8_t cspin, SPIClass &spiport, uint32_t ramBudget, workload_t workload) {
+		setTuning(ramBudget, workload);
+		return begin(cspin, spiport);
+	}
+	const char * getMediaName() { return Chip::pn(); }
+	const char * name() { return getMediaName(); }
+private:
+	static constexpr unsigned int cmdlen = 1 + (Chip::addrbits >> 3);
+	static void command(uint8_t *buf, uint8_t cmd, uint32_t addr) {
+		buf[0] = cmd;
+		if (Chip::addrbits == 24) {
+			buf[1] = addr >> 16;
+			buf[2] = addr >> 8;
+			buf[3] = addr;
+		} else {
+			buf[1] = addr >> 24;
+			buf[2] = addr >> 16;
+			buf[3] = addr >> 8;
+			buf[4] = addr;
+		}
+	}
+	int read(lfs_block_t block, lfs_off_t offset, void *buf, lfs_size_t size) {
+		if (!port) return LFS_ERR_IO;
+		uint8_t cmdaddr[5];
+		command(cmdaddr, (Chip::addrbits == 24) ? 0x03 : 0x13, block * Chip::erasesize + offset);
+		memset(buf, 0, size);
+		port->beginTransaction(SPISettings(30000000, MSBFIRST, SPI_MODE0));
+		digitalWrite(pin, LOW);
+		port->transfer(cmdaddr, cmdlen);
+		port->transfer(buf, size);
+		digitalWrite(pin, HIGH);
+		port->endTransaction();
+		return 0;
+	}
+	int prog(lfs_block_t block, lfs_off_t offset, const void *buf, lfs_size_t size) {
+		if (!port) return LFS_ERR_IO;
+		uint32_t addr = block * Chip::erasesize + offset;
+		const uint8_t *p = (const uint8_t *)buf;
+		while (size > 0) {
+			// page program wraps at the page boundary
+			lfs_size_t len = Chip::progsize - (addr & (Chip::progsize - 1));
+			if (len > size) len = size;
+			uint8_t cmdaddr[5];
+			command(cmdaddr, (Chip::addrbits == 24) ? 0x02 : 0x12, addr);
+			port->beginTransaction(SPISettings(30000000, MSBFIRST, SPI_MODE0));
+			digitalWrite(pin, LOW);
+			port->transfer(0x06); // 0x06 = write enable
+			digitalWrite(pin, HIGH);
+			delayNanoseconds(250);
+			digitalWrite(pin, LOW);
+			port->transfer(cmdaddr, cmdlen);
+			port->transfer(p, nullptr, len);
+			digitalWrite(pin, HIGH);
+			port->endTransaction();
+			int err = wait(Chip::progtime);
+			if (err) return err;
+			addr += len;
+			p += len;
+			size -= len;
+		}
+		return 0;
+	}
+	int erase(lfs_block_t block) {
+		if (!port) return LFS_ERR_IO;
+		if (isBlank(block)) return 0;
+		uint8_t cmdaddr[5];
+		command(cmdaddr, Chip::erasecmd, block * Chip::erasesize);
+		port->beginTransaction(SPISettings(30000000, MSBFIRST, SPI_MODE0));
+		digitalWrite(pin, LOW);
+		port->transfer(0x06); // 0x06 = write enable
+		digitalWrite(pin, HIGH);
+		delayNanoseconds(250);
+		digitalWrite(pin, LOW);
+		port->transfer(cmdaddr, cmdlen);
+		digitalWrite(pin, HIGH);
+		port->endTransaction();
+		return wait(Chip::erasetime);
+	}
+	int wait(uint32_t microseconds) {
+		elapsedMicros usec = 0;
+		while (1) {
+			port->beginTransaction(SPISettings(30000000, MSBFIRST, SPI_MODE0));
+			digitalWrite(pin, LOW);
+			uint16_t status = port->transfer16(0x0500); // 0x05 = get status
+			digitalWrite(pin, HIGH);
+			port->endTransaction();
+			if (!(status & 1)) break;
+			if (usec > microseconds) return LFS_ERR_IO; // timeout
+			yield();
+		}
+		return 0;
+	}
+	static int static_read(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, void *buffer, lfs_size_t size) {
+		return ((LittleFS_SPIFlashT *)(c->context))->read(block, offset, buffer, size);
+	}
+	static int static_prog(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size) {
+		return ((LittleFS_SPIFlashT *)(c->context))->prog(block, offset, buffer, size);
+	}
+	static int static_erase(const struct lfs_config *c, lfs_block_t block) {
+		return ((LittleFS_SPIFlashT *)(c->context))->erase(block);
+	}
+	static int static_sync(const struct lfs_config *c) {
+		return 0;
+	}
+	SPIClass *port = nullptr;
+	uint8_t pin = 0;
+};
+
+// LittleFS_SPIFram for one chip known when compiling, see LittleFS_SPIFlashT
+template <class Chip>
+class LittleFS_SPIFramT : public LittleFS
+{
+public:
+	constexpr LittleFS_SPIFramT() { }
+	bool begin(uint8_t cspin, SPIClass &spiport=SPI) {
+		pin = cspin;
+		port = &spiport;
+		configured = false;
+		digitalWrite(pin, HIGH);
+		pinMode(pin, OUTPUT);
+		port->begin();
+		delay(100);
+		uint8_t buf[9];
+		port->beginTransaction(SPISettings(30000000, MSBFIRST, SPI_MODE0));
+		digitalWrite(pin, LOW);
+		delayNanoseconds(50);
+		port->transfer(0x9f);  //0x9f - JEDEC register
+		for (uint8_t i = 0; i < 9; i++) {
+			buf[i] = port->transfer(0);
+		}
+		digitalWriteFast(pin, HIGH); // Chip deselect
+		port->endTransaction();
+		if (buf[0] == 0x7F) {
+			buf[0] = buf[6];
+			buf[1] = buf[7];
+			buf[2] = buf[8];
+		}
+		if (((buf[0] << 16) | (buf[1] << 8) | buf[2]) != Chip::id) return false;
+		memset(&lfs, 0, sizeof(lfs));
+		memset(&config, 0, sizeof(config));
+		config.context = (void *)this;
+		config.read = &static_read;
+		config.prog = &static_prog;
+		config.erase = &static_erase;
+		config.sync = &static_sync;
+		config.name_max = LFS_NAME_MAX;
+		if (!setGeometry(false)) return false; // RAM budget too small
+		rewritable = true;
+		configured = true;
+		if (lfs_mount(&lfs, &config) < 0) {
+			// media formatted with the 128 byte blocks used before
+			setGeometry(true);
+			if (lfs_mount(&lfs, &config) < 0) {
+				setGeometry(false);
+				if (!mountOrFormat()) {
+					port = nullptr;
+					return false;
+				}
+			}
+		}
+		hookCallbacks(); // track which blocks are erased
+		mounted = true;
+		recoverInPlace();
+		return true;
+	}
+	bool begin(uint8_t cspin, SPIClass &spiport, uint32_t ramBudget, workload_t workload) {
+		setTuning(ramBudget, workload);
+		return begin(cspin, spiport);
+	}
+	const char * getMediaName() { return Chip::pn(); }
+	const char * name() { return getMediaName(); }
+private:
+	static constexpr unsigned int cmdlen = 1 + (Chip::addrbits >> 3);
+	static void command(uint8_t *buf, uint8_t cmd, uint32_t addr) {
+		buf[0] = cmd;
+		if (Chip::addrbits == 24) {
+			buf[1] = addr >> 16;
+			buf[2] = addr >> 8;
+			buf[3] = addr;
+		} else {
+			buf[1] = addr >> 24;
+			buf[2] = addr >> 16;
+			buf[3] = addr >> 8;
+			buf[4] = addr;
+		}
+	}
+	// same geometry as LittleFS_SPIFram
+	bool setGeometry(bool legacy) {
+		const lfs_size_t progsize = legacy ? 64 : Chip::progsize;
+		config.read_size = progsize;
+		config.prog_size = progsize;
+		config.block_size = legacy ? 128 : Chip::erasesize;
+		config.block_count = Chip::chipsize / config.block_size;
+		config.block_cycles = -1; // FRAM doesn't wear out
+		config.cache_size = legacy ? progsize : progsize * 4;
+		config.lookahead_size = ((config.block_count + 63) / 64) * 8;
+		return legacy || tuneConfig(config.block_size, false);
+	}
+	int read(lfs_block_t block, lfs_off_t offset, void *buf, lfs_size_t size) {
+		if (!port) return LFS_ERR_IO;
+		uint8_t cmdaddr[5];
+		command(cmdaddr, 0x03, block * config.block_size + offset);
+		memset(buf, 0, size);
+		port->beginTransaction(SPISettings(30000000, MSBFIRST, SPI_MODE0));
+		digitalWrite(pin, LOW);
+		port->transfer(cmdaddr, cmdlen);
+		port->transfer(buf, size);
+		digitalWrite(pin, HIGH);
+		port->endTransaction();
+		return 0;
+	}
+	int prog(lfs_block_t block, lfs_off_t offset, const void *buf, lfs_size_t size) {
+		if (!port) return LFS_ERR_IO;
+		uint8_t cmdaddr[5];
+		command(cmdaddr, 0x02, block * config.block_size + offset);
+		port->beginTransaction(SPISettings(30000000, MSBFIRST, SPI_MODE0));
+		digitalWrite(pin, LOW);
+		delayNanoseconds(50);
+		port->transfer(0x06); // 0x06 = write enable
+		digitalWrite(pin, HIGH);
+		delayNanoseconds(50);
+		digitalWrite(pin, LOW);
+		port->transfer(cmdaddr, cmdlen);
+		port->transfer(buf, nullptr, size);
+		digitalWrite(pin, HIGH);
+		port->endTransaction();
+		return 0;
+	}
+	static int static_read(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, void *buffer, lfs_size_t size) {
+		return ((LittleFS_SPIFramT *)(c->context))->read(block, offset, buffer, size);
+	}
+	static int static_prog(const struct lfs_config *c, lfs_block_t block,
+	  lfs_off_t offset, const void *buffer, lfs_size_t size) {
+		return ((LittleFS_SPIFramT *)(c->context))->prog(block, offset, buffer, size);
+	}
+	static int static_erase(const struct lfs_config *c, lfs_block_t block) {
+		return 0; // FRAM is written in place, nothing needs erasing
+	}
+	static int static_sync(const struct lfs_config *c) {
+		return 0;
+	}
+	SPIClass *port = nullptr;
+	uint8_t pin = 0;
+};
+
+
 #if defined(__IMXRT1062__)
 class LittleFS_QSPIFlash : public LittleFS
 {
 public:
 	constexpr LittleFS_QSPIFlash() { }
 	bool begin();
+	bool begin(uint32_t ramBudget, workload_t workload) {
+		setTuning(ramBudget, workload);
+		return begin();
+	}
 	const char * getMediaName();
 	const char * name() { return getMediaName(); }
 private:
@@ -554,17 +1122,34 @@ class LittleFS_QSPIFlash : public LittleFS
 public:
 	constexpr LittleFS_QSPIFlash() { }
 	bool begin() { return false; }
+	bool begin(uint32_t ramBudget, workload_t workload) { return false; }
 };
 #endif
 
 
 
 #if defined(__IMXRT1062__)
+// Only one instance may be used, as the region and the page held for
+// write combining are shared.
 class LittleFS_Program : public LittleFS
 {
 public:
 	constexpr LittleFS_Program() { }
 	bool begin(uint32_t size);
+	bool begin(uint32_t size, uint32_t ramBudget, workload_t workload) {
+		setTuning(ramBudget, workload);
+		return begin(size);
+	}
+	// Block size, 4096, 32768 or 65536.  The default is 32K on Teensy 4.0
+	// and 64K on others.  4K blocks suit many small files, as each file
+	// too large to keep in its directory uses at least one block.  Call
+	// before begin(), media formatted with another block size is
+	// formatted again.
+	void setBlockSize(uint32_t size) { progBlockSize = size; }
+	// Place the filesystem offset bytes from the start of flash, a
+	// multiple of the block size and past the program, instead of at
+	// the top of flash.  Call before begin().
+	void setOffset(uint32_t offset) { progOffset = offset; }
 	const char * getMediaName();
 	const char * name() { return getMediaName(); }
 private:
@@ -573,8 +1158,11 @@ private:
 	static int static_prog(const struct lfs_config *c, lfs_block_t block,
 	  lfs_off_t offset, const void *buffer, lfs_size_t size);
 	static int static_erase(const struct lfs_config *c, lfs_block_t block);
-	static int static_sync(const struct lfs_config *c) { return 0; }
+	static int static_sync(const struct lfs_config *c);
 	static uint32_t baseaddr;
+	static uint32_t blocksize;
+	uint32_t progBlockSize = 0;
+	uint32_t progOffset = 0;
 };
 #else
 // TODO: implement for Teensy 3.x...
@@ -583,20 +1171,94 @@ class LittleFS_Program : public LittleFS
 public:
 	constexpr LittleFS_Program() { }
 	bool begin(uint32_t size) { return false; }
+	bool begin(uint32_t size, uint32_t ramBudget, workload_t workload) { return false; }
+	void setBlockSize(uint32_t size) { }
+	void setOffset(uint32_t offset) { }
 	const char * getMediaName() { return (const char *)F("PROGRAM"); }
 	const char * name() { return getMediaName(); }
 };
 #endif
 
+// Software bad block management for SPI NAND.  Blocks which fail to
+// program or erase, or which return uncorrectable data, are replaced by
+// spares from the reserved area at the end of the chip.  The table of
+// replacements is saved in the first two good reserved blocks.  Blocks
+// which were never replaced cost a single bit test to look up.
+class LittleFS_NANDBadBlocks
+{
+public:
+	struct ops_t {
+		void *context;
+		// physical block access, prog and erase return LFS_ERR_CORRUPT on failure
+		int (*read)(void *context, uint32_t block, uint32_t offset, void *buf, uint32_t size);
+		int (*prog)(void *context, uint32_t block, uint32_t offset, const void *buf, uint32_t size);
+		int (*erase)(void *context, uint32_t block);
+		bool (*markedBad)(void *context, uint32_t block);	// factory bad block mark
+	};
+	constexpr LittleFS_NANDBadBlocks() { }
+	bool begin(const ops_t *ops, uint32_t blocks, uint32_t spares, uint32_t blockSize, uint32_t pageSize);
+	uint32_t map(uint32_t block) const {
+		if (!remapped || !(remapped[block >> 3] & (1 << (block & 7)))) return block;
+		return lookup(block);
+	}
+	void retire(uint32_t block);	// replace at the next erase
+	bool retiring(uint32_t block) const {
+		return retired && (retired[block >> 3] & (1 << (block & 7)));
+	}
+	int replace(uint32_t block, uint32_t copyPages);
+	int progFailed(uint32_t physical, uint32_t page);
+	int eraseSpares();
+	uint32_t badBlocks() const;
+	uint32_t sparesLeft() const;
+	static const unsigned int MAX_SPARES = 24;
+private:
+	uint32_t lookup(uint32_t block) const;
+	bool isSpare(uint32_t physical) const;
+	int load();
+	int save();
+	struct entry_t {
+		uint16_t logical;	// NONE = bad spare
+		uint16_t physical;
+	};
+	static const uint16_t NONE = 0xFFFF;
+	const ops_t *ops = nullptr;
+	uint8_t *remapped = nullptr;	// bit set when the block has a table entry
+	uint8_t *retired = nullptr;	// uncorrectable data seen, replace at next erase
+	uint32_t blocks = 0;
+	uint32_t spares = 0;
+	uint32_t block_size = 0;
+	uint32_t page_size = 0;
+	uint32_t seq = 0;
+	uint16_t tableBlock[2] = {0, 0};
+	uint16_t tablePage = 0;	// next free page in tableBlock[0]
+	uint16_t count = 0;
+	entry_t table[MAX_SPARES] = {};
+};
+
 class LittleFS_SPINAND : public LittleFS
 {
 public:
 	constexpr LittleFS_SPINAND() { }
 	bool begin(uint8_t cspin, SPIClass &spiport=SPI);
+	bool begin(uint8_t cspin, SPIClass &spiport, uint32_t ramBudget, workload_t workload) {
+		setTuning(ramBudget, workload);
+		return begin(cspin, spiport);
+	}
+	// W25M02: spread each block over both dies, so one can program or
+	// erase while the other is used.  Call before begin().  Changes
+	// where data is stored, so media must be formatted with the same
+	// setting.
+	void setDieInterleave(bool enable=true) { dieInterleave = enable; }
+	// Program 512 byte sectors of a page separately, up to 4 per page,
+	// so small files and metadata commits use less of the chip.  Call
+	// before begin().
+	void setSubPageProgram(bool enable=true) { subPageProgram = enable; }
 	uint8_t readECC(uint32_t address, uint8_t *data, int length);
 	void readBBLUT(uint16_t *LBA, uint16_t *PBA, uint8_t *linkStatus);
 	bool lowLevelFormat(char progressChar, Print* pr=&Serial);
-	uint8_t addBBLUT(uint32_t block_address);  //temporary for testing
+	uint8_t addBBLUT(uint32_t block_address);  // replace a block with a spare
+	uint32_t badBlocks() { return bbm.badBlocks(); }
+	uint32_t spareBlocks() { return bbm.sparesLeft(); }
 	const char * getMediaName();
 	const char * name() { return getMediaName(); }
 private:
@@ -619,7 +1281,25 @@ private:
 		return ((LittleFS_SPINAND *)(c->context))->erase(block);
 	}
 	static int static_sync(const struct lfs_config *c) {
-		return 0;
+		return ((LittleFS_SPINAND *)(c->context))->settleProg();
+	}
+	int readPhysical(uint32_t block, uint32_t offset, void *buf, uint32_t size);
+	int progPhysical(uint32_t block, uint32_t offset, const void *buf, uint32_t size);
+	int erasePhysical(uint32_t block);
+	bool markedBad(uint32_t block);
+	int readSpare(uint32_t block, uint32_t column, void *buf, uint32_t size);
+	uint32_t storedEraseCount(lfs_block_t block);
+	static int bbm_read(void *context, uint32_t block, uint32_t offset, void *buf, uint32_t size) {
+		return ((LittleFS_SPINAND *)context)->readPhysical(block, offset, buf, size);
+	}
+	static int bbm_prog(void *context, uint32_t block, uint32_t offset, const void *buf, uint32_t size) {
+		return ((LittleFS_SPINAND *)context)->progPhysical(block, offset, buf, size);
+	}
+	static int bbm_erase(void *context, uint32_t block) {
+		return ((LittleFS_SPINAND *)context)->erasePhysical(block);
+	}
+	static bool bbm_markedBad(void *context, uint32_t block) {
+		return ((LittleFS_SPINAND *)context)->markedBad(block);
 	}
   bool isReady();
   bool writeEnable();
@@ -627,12 +1307,21 @@ private:
   void writeStatusRegister(uint8_t reg, uint8_t data);
   uint8_t readStatusRegister(uint16_t reg, bool dump);
   void loadPage(uint32_t address);
+  void selectDie(uint8_t die_select);
+  int readContinuous(uint32_t address, uint8_t *buf, uint32_t size);
+  int progPage(uint32_t address, const void *buf, lfs_size_t size, uint32_t eraseCount=0);
+  int finishProg(int die=-1);
+  int settleProg(int die=-1);
+  uint32_t rowAddress(uint32_t address);
+  uint32_t blockAddress(uint32_t block);
+  uint32_t locate(lfs_block_t block, lfs_off_t offset, uint32_t &chipBlock, uint32_t &chipOffset);
 
   void deviceReset();
   
 	SPIClass *port = nullptr;
 	uint8_t pin = 0;
 	const void *hwinfo = nullptr;
+	const struct nand_geometry *geo = nullptr;
 	
 private:
   uint8_t die = 0;      //die = 0: use first 1GB die PA[16], die = 1: use second 1GB die PA[16].
@@ -643,6 +1332,20 @@ private:
   uint16_t eccSize = 64;
   uint16_t PAGE_ECCSIZE = 2112;
 
+  uint32_t pageInBuffer = UINT32_MAX;	// page held in the chip's data buffer
+  uint8_t dieSelected = 0xFF;	// W25M02 die, 0xFF = unknown
+  struct pending_t {
+	uint8_t op;		// PENDING_PROG or PENDING_ERASE, 0 for none
+	bool failed;		// waiting to be moved to a spare
+	uint16_t page;		// pages to copy if it failed
+	uint32_t block;		// bad block management's block, UINT32_MAX for none
+  };
+  pending_t pending[2] = {};	// per die, W25M02 dies work independently
+  bool dieInterleave = false;
+  bool subPageProgram = false;
+  uint32_t correctedPages = 0;	// page loads ECC had to correct
+  LittleFS_NANDBadBlocks bbm;
+  LittleFS_NANDBadBlocks::ops_t bbmOps = {};
 };
 
 
@@ -652,11 +1355,21 @@ class LittleFS_QPINAND : public LittleFS
 public:
 	constexpr LittleFS_QPINAND() { }
 	bool begin();
+	bool begin(uint32_t ramBudget, workload_t workload) {
+		setTuning(ramBudget, workload);
+		return begin();
+	}
+	// W25M02: spread each block over both dies, see LittleFS_SPINAND
+	void setDieInterleave(bool enable=true) { dieInterleave = enable; }
+	// 512 byte partial page programs, see LittleFS_SPINAND
+	void setSubPageProgram(bool enable=true) { subPageProgram = enable; }
 	bool deviceErase();
 	uint8_t readECC(uint32_t targetPage, uint8_t *buf, int size);
 	void readBBLUT(uint16_t *LBA, uint16_t *PBA, uint8_t *linkStatus);
 	bool lowLevelFormat(char progressChar);
-	uint8_t addBBLUT(uint32_t block_address);  //temporary for testing
+	uint8_t addBBLUT(uint32_t block_address);  // replace a block with a spare
+	uint32_t badBlocks() { return bbm.badBlocks(); }
+	uint32_t spareBlocks() { return bbm.sparesLeft(); }
 	const char * getMediaName();
 	const char * name() { return getMediaName(); }
 private:
@@ -679,7 +1392,25 @@ private:
 		return ((LittleFS_QPINAND *)(c->context))->erase(block);
 	}
 	static int static_sync(const struct lfs_config *c) {
-		return 0;
+		return ((LittleFS_QPINAND *)(c->context))->settleProg();
+	}
+	int readPhysical(uint32_t block, uint32_t offset, void *buf, uint32_t size);
+	int progPhysical(uint32_t block, uint32_t offset, const void *buf, uint32_t size);
+	int erasePhysical(uint32_t block);
+	bool markedBad(uint32_t block);
+	int readSpare(uint32_t block, uint32_t column, void *buf, uint32_t size);
+	uint32_t storedEraseCount(lfs_block_t block);
+	static int bbm_read(void *context, uint32_t block, uint32_t offset, void *buf, uint32_t size) {
+		return ((LittleFS_QPINAND *)context)->readPhysical(block, offset, buf, size);
+	}
+	static int bbm_prog(void *context, uint32_t block, uint32_t offset, const void *buf, uint32_t size) {
+		return ((LittleFS_QPINAND *)context)->progPhysical(block, offset, buf, size);
+	}
+	static int bbm_erase(void *context, uint32_t block) {
+		return ((LittleFS_QPINAND *)context)->erasePhysical(block);
+	}
+	static bool bbm_markedBad(void *context, uint32_t block) {
+		return ((LittleFS_QPINAND *)context)->markedBad(block);
 	}
 	bool isReady();
 	bool writeEnable();
@@ -687,8 +1418,17 @@ private:
 	void eraseSector(uint32_t address);
 	void writeStatusRegister(uint8_t reg, uint8_t data);
 	uint8_t readStatusRegister(uint16_t reg, bool dump);
+	int readContinuous(uint32_t address, uint8_t *buf, uint32_t size);
+	int progPage(uint32_t address, const void *buf, lfs_size_t size, uint32_t eraseCount=0);
+	int finishProg(int die=-1);
+	int settleProg(int die=-1);
+	void selectDie(uint8_t die_select);
+	uint32_t rowAddress(uint32_t address);
+	uint32_t blockAddress(uint32_t block);
+	uint32_t locate(lfs_block_t block, lfs_off_t offset, uint32_t &chipBlock, uint32_t &chipOffset);
   
 	const void *hwinfo = nullptr;
+	const struct nand_geometry *geo = nullptr;
 	
 private:
 	uint8_t die = 0;      //die = 0: use first 1GB die, die = 1: use second 1GB die.
@@ -699,6 +1439,20 @@ private:
 	uint16_t eccSize = 64;
 	uint16_t PAGE_ECCSIZE = 2112;
 
+	uint32_t pageInBuffer = UINT32_MAX;	// page held in the chip's data buffer
+	uint8_t dieSelected = 0xFF;	// W25M02 die, 0xFF = unknown
+	struct pending_t {
+		uint8_t op;		// PENDING_PROG or PENDING_ERASE, 0 for none
+		bool failed;		// waiting to be moved to a spare
+		uint16_t page;		// pages to copy if it failed
+		uint32_t block;		// bad block management's block, UINT32_MAX for none
+	};
+	pending_t pending[2] = {};	// per die, W25M02 dies work independently
+	bool dieInterleave = false;
+	bool subPageProgram = false;
+	uint32_t correctedPages = 0;	// page loads ECC had to correct
+	LittleFS_NANDBadBlocks bbm;
+	LittleFS_NANDBadBlocks::ops_t bbmOps = {};
 };
 #endif
 
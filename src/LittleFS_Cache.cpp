@@ -0,0 +1,337 @@
+/* LittleFS for Teensy
+ * Copyright (c) 2020, Paul Stoffregen, paul@pjrc.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <LittleFS.h>
+
+// The write cache is a ring buffer of the program and erase calls littlefs
+// made, in the order it made them, each a record header followed by the
+// data to program.  Writing them to the media in that same order means
+// power loss only ever loses the newest few, so the media always holds
+// the filesystem as it was at some earlier moment, which littlefs mounts
+// like any other power loss.  Sequential programs of the same block are
+// combined into one record, so the media is written a block at a time.
+
+#define WC_ERASE  0xFFFFFFFF	// size of an erase record
+#define WC_WRAP   0xFFFFFFFF	// block of the padding before wrapping to the start
+#define WC_NONE   0xFFFFFFFF	// no record
+
+struct wc_record {
+	uint32_t block;
+	uint32_t off;
+	uint32_t size;		// data bytes which follow, or WC_ERASE
+};
+
+struct LittleFSWriteCache {
+	uint8_t *buffer;
+	uint32_t size;		// buffer size, a multiple of 4
+	uint32_t head;		// oldest record
+	uint32_t tail;		// where the next record goes
+	uint32_t used;		// bytes of records and padding
+	uint32_t last;		// newest record, for combining sequential programs
+	int error;		// media error writing the oldest record, it's kept
+	bool allocated;		// buffer was allocated by enableWriteCache()
+	bool destaging;		// the driver reads the media itself, eg blank checks
+	uint16_t *pending;	// records waiting for each block
+};
+
+static inline uint32_t wc_length(const struct wc_record *r)
+{
+	return sizeof(struct wc_record) + ((r->size == WC_ERASE) ? 0 : ((r->size + 3) & ~3));
+}
+
+// Find room for a record of len bytes, wrapping to the start of the buffer
+// when the end is too small.  Returns false when the cache is too full.
+static bool wc_reserve(LittleFSWriteCache *c, uint32_t len)
+{
+	if (c->used == 0) {
+		c->head = c->tail = 0;
+		c->last = WC_NONE;
+	}
+	if (c->tail >= c->head && !(c->tail == c->head && c->used)) {
+		if (c->size - c->tail >= len) return true;
+		if (c->head < len) return false;
+		// pad the end, a record never wraps
+		if (c->size - c->tail >= sizeof(uint32_t)) {
+			((struct wc_record *)(c->buffer + c->tail))->block = WC_WRAP;
+		}
+		c->used += c->size - c->tail;
+		c->tail = 0;
+		return true;
+	}
+	return c->head - c->tail >= len;
+}
+
+// The record at head, skipping the padding at the end of the buffer
+static struct wc_record * wc_oldest(LittleFSWriteCache *c)
+{
+	if (c->size - c->head < sizeof(struct wc_record)
+	  || ((struct wc_record *)(c->buffer + c->head))->block == WC_WRAP) {
+		c->used -= c->size - c->head;
+		c->head = 0;
+	}
+	return (struct wc_record *)(c->buffer + c->head);
+}
+
+FLASHMEM
+bool LittleFS::enableWriteCache(uint32_t size, void *buffer)
+{
+	if (!mounted) return false;
+	if (size == 0) {
+		bool ok = flushWriteCache();
+		writeCacheFree();
+		return ok;
+	}
+	if (rewritable || config.memory) return false; // already as fast as RAM
+	// littlefs must see a failed program at once, to move the data to
+	// another block, but it would only fail when written out later
+	if (reportsBadBlocks) return false;
+	if (writeCache && !flushWriteCache()) return false;
+	writeCacheFree();
+	size &= ~3;
+	if (size < 4 * (config.cache_size + sizeof(struct wc_record))) return false;
+	hookCallbacks();
+	LittleFSWriteCache *c = (LittleFSWriteCache *)malloc(sizeof(LittleFSWriteCache)
+	  + config.block_count * sizeof(uint16_t));
+	if (!c) return false;
+	memset(c, 0, sizeof(LittleFSWriteCache));
+	c->pending = (uint16_t *)(c + 1);
+	memset(c->pending, 0, config.block_count * sizeof(uint16_t));
+	if (!buffer) {
+#if defined(__IMXRT1062__)
+		buffer = extmem_malloc(size);
+#else
+		buffer = malloc(size);
+#endif
+		if (!buffer) {
+			free(c);
+			return false;
+		}
+		c->allocated = true;
+	}
+	c->buffer = (uint8_t *)buffer;
+	c->size = size;
+	c->last = WC_NONE;
+	writeCache = c;
+	return true;
+}
+
+void LittleFS::writeCacheFree()
+{
+	if (!writeCache) return;
+	if (writeCache->allocated) {
+#if defined(__IMXRT1062__)
+		extmem_free(writeCache->buffer);
+#else
+		free(writeCache->buffer);
+#endif
+	}
+	free(writeCache);
+	writeCache = nullptr;
+}
+
+uint32_t LittleFS::writeCachePending()
+{
+	return writeCache ? writeCache->used : 0;
+}
+
+// Write everything in the cache to the media.  Returns false if the media
+// reported an error, leaving the record which failed and those after it
+// in the cache.
+bool LittleFS::flushWriteCache()
+{
+	if (!writeCache) return true;
+	hookDepth++;
+	writeCache->error = 0; // try the failed record again
+	while (writeCache->used && !writeCache->error) {
+		writeCache->error = destage(0xFFFFFFFF);
+	}
+	hookDepth--;
+	return writeCache->error == 0;
+}
+
+// Write the oldest record, or only its first max bytes, to the media.
+// Returns the media driver's error, if any, and then keeps the record.
+int LittleFS::destage(uint32_t max)
+{
+	LittleFSWriteCache *c = writeCache;
+	struct wc_record *r = wc_oldest(c);
+	const lfs_block_t block = r->block;
+	int err;
+	c->destaging = true;
+	if (r->size == WC_ERASE) {
+		elapsedMicros t = 0;
+		err = driverErase(&config, block);
+		if (t > eraseMicros) eraseMicros = t;
+	} else {
+		uint32_t len = r->size;
+		if (len > max && max >= sizeof(struct wc_record) && (max & 3) == 0) len = max;
+		err = driverProg(&config, block, r->off, r + 1, len);
+		c->destaging = false;
+		if (err) return err;
+		if (len < r->size) {
+			// move the header up to the data still to be written
+			struct wc_record rest = {block, r->off + len, r->size - len};
+			if (c->last == c->head) c->last += len;
+			c->head += len;
+			c->used -= len;
+			*(struct wc_record *)(c->buffer + c->head) = rest;
+			return 0;
+		}
+	}
+	c->destaging = false;
+	if (err) return err;
+	if (c->last == c->head) c->last = WC_NONE;
+	const uint32_t len = wc_length(r);
+	c->head += len;
+	c->used -= len;
+	c->pending[block]--;
+	return 0;
+}
+
+// Background work for maintenance(), returns true while records remain
+bool LittleFS::writeCacheDestage(uint32_t budget_us)
+{
+	elapsedMicros usec = 0;
+	hookDepth++;
+	while (writeCache->used && !writeCache->error && usec < budget_us) {
+		// don't start an erase which would run past the budget
+		if (wc_oldest(writeCache)->size == WC_ERASE
+		  && usec + eraseMicros > budget_us) break;
+		writeCache->error = destage(config.cache_size);
+	}
+	hookDepth--;
+	return writeCache->used > 0 && !writeCache->error;
+}
+
+int LittleFS::cacheRead(lfs_block_t block, lfs_off_t offset, void *buffer, lfs_size_t size)
+{
+	LittleFSWriteCache *c = writeCache;
+	if (c->error && !c->destaging) return c->error; // reported by the next call
+	if (!c->pending[block] || c->destaging) {
+		return driverRead(&config, block, offset, buffer, size);
+	}
+	// only the records since the block was last erased matter
+	uint32_t pos = c->head, remain = c->used, from = WC_NONE;
+	while (remain) {
+		if (c->size - pos < sizeof(struct wc_record)
+		  || ((struct wc_record *)(c->buffer + pos))->block == WC_WRAP) {
+			remain -= c->size - pos;
+			pos = 0;
+			continue;
+		}
+		const struct wc_record *r = (struct wc_record *)(c->buffer + pos);
+		if (r->block == block && r->size == WC_ERASE) from = pos;
+		pos += wc_length(r);
+		remain -= wc_length(r);
+	}
+	if (from == WC_NONE) {
+		int err = driverRead(&config, block, offset, buffer, size);
+		if (err) return err;
+		from = c->head;
+	} else {
+		memset(buffer, 0xFF, size);
+	}
+	// apply the programs on top, oldest first
+	pos = c->head;
+	remain = c->used;
+	bool apply = false;
+	while (remain) {
+		if (pos == from) apply = true;
+		if (c->size - pos < sizeof(struct wc_record)
+		  || ((struct wc_record *)(c->buffer + pos))->block == WC_WRAP) {
+			remain -= c->size - pos;
+			pos = 0;
+			continue;
+		}
+		const struct wc_record *r = (struct wc_record *)(c->buffer + pos);
+		if (apply && r->block == block && r->size != WC_ERASE) {
+			const lfs_off_t start = max(offset, r->off);
+			const lfs_off_t end = min(offset + size, r->off + r->size);
+			if (start < end) {
+				memcpy((uint8_t *)buffer + (start - offset),
+				  (const uint8_t *)(r + 1) + (start - r->off), end - start);
+			}
+		}
+		pos += wc_length(r);
+		remain -= wc_length(r);
+	}
+	return 0;
+}
+
+int LittleFS::cacheProg(lfs_block_t block, lfs_off_t offset, const void *buffer, lfs_size_t size)
+{
+	LittleFSWriteCache *c = writeCache;
+	if (c->error) return c->error;
+	const uint32_t len = (size + 3) & ~3;
+	if (c->used && c->last != WC_NONE) {
+		// continue the newest record, if this follows on from it
+		struct wc_record *r = (struct wc_record *)(c->buffer + c->last);
+		if (r->block == block && r->size != WC_ERASE && (r->size & 3) == 0
+		  && r->off + r->size == offset && c->tail == c->last + wc_length(r)
+		  && (c->tail > c->head ? c->size - c->tail : c->head - c->tail) >= len) {
+			memcpy(c->buffer + c->tail, buffer, size);
+			r->size += size;
+			c->tail += len;
+			c->used += len;
+			return 0;
+		}
+	}
+	while (!wc_reserve(c, sizeof(struct wc_record) + len)) {
+		if (c->used == 0) {
+			// larger than the whole cache
+			return driverProg(&config, block, offset, buffer, size);
+		}
+		// full, wait for the oldest to be written
+		c->error = destage(0xFFFFFFFF);
+		if (c->error) return c->error;
+	}
+	struct wc_record *r = (struct wc_record *)(c->buffer + c->tail);
+	r->block = block;
+	r->off = offset;
+	r->size = size;
+	memcpy(r + 1, buffer, size);
+	c->last = c->tail;
+	c->tail += sizeof(struct wc_record) + len;
+	c->used += sizeof(struct wc_record) + len;
+	c->pending[block]++;
+	return 0;
+}
+
+int LittleFS::cacheErase(lfs_block_t block)
+{
+	LittleFSWriteCache *c = writeCache;
+	if (c->error) return c->error;
+	while (!wc_reserve(c, sizeof(struct wc_record))) {
+		c->error = destage(0xFFFFFFFF);
+		if (c->error) return c->error;
+	}
+	struct wc_record *r = (struct wc_record *)(c->buffer + c->tail);
+	r->block = block;
+	r->off = 0;
+	r->size = WC_ERASE;
+	c->last = c->tail;
+	c->tail += sizeof(struct wc_record);
+	c->used += sizeof(struct wc_record);
+	c->pending[block]++;
+	return 0;
+}
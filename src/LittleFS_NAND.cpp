@@ -22,21 +22,24 @@
 
 #include <Arduino.h>
 #include <LittleFS.h>
+#include "littlefs/lfs_util.h"
 
 // Bits in LBA for BB LUT
 #define BBLUT_STATUS_ENABLED (1 << 15)
 #define BBLUT_STATUS_INVALID (1 << 14)
 #define BBLUT_STATUS_MASK    (BBLUT_STATUS_ENABLED | BBLUT_STATUS_INVALID)
+#define BBLUT_ENTRIES        20
 
-//////////////////////////////////////////////////////
-// Some useful defs and macros
-#define LINEAR_TO_COLUMNECC(laddr) ((laddr) % PAGE_ECCSIZE)
-#define LINEAR_TO_COLUMN(laddr) ((laddr) % pageSize)
-#define LINEAR_TO_PAGE(laddr) ((laddr) / pageSize)
-#define LINEAR_TO_PAGEECC(laddr) ((laddr) / PAGE_ECCSIZE)
-#define LINEAR_TO_BLOCK(laddr) (LINEAR_TO_PAGE(laddr) / PAGES_PER_BLOCK)
-#define BLOCK_TO_PAGE(block) ((block) * PAGES_PER_BLOCK)
-#define BLOCK_TO_LINEAR(block) (BLOCK_TO_PAGE(block) * pageSize)
+// linkStatus values returned by readBBLUT()
+#define BBLUT_LINK_OPEN      0	// unused entry
+#define BBLUT_LINK_VALID     2	// enabled, valid link
+#define BBLUT_LINK_INVALID   3	// enabled, link no longer valid
+
+// ECC-1,0 bits of status register 3 (0xC0), for the most recent page load
+#define ECC_OK               0	// no errors
+#define ECC_CORRECTED        1	// errors corrected, data is good
+#define ECC_UNCORRECTABLE    2	// data in a single page is bad
+#define ECC_UNCORRECTABLE_MULTI 3	// data in multiple pages is bad (continuous read)
 
 //////////////////////////////////////////////////////
 //Chip ID
@@ -44,21 +47,44 @@
 #define W25N02	0xEFAA22
 #define W25M02	0xEFBB21
 
+//////////////////////////////////////////////////////
+// Geometry.  Every size is a power of 2, so a chip address splits into
+// die, block, page and column with shifts.  Row (page) addresses sent
+// with Page Data Read, Program Execute and Block Erase count from 0 on
+// each die.
+struct nand_geometry {
+	uint8_t columnBits;	// bytes per page, the spare area follows
+	uint8_t pageBits;	// pages per block
+	uint8_t blockBits;	// blocks per die
+	uint8_t dieBits;	// W25M02 is 2 W25N01 dies
+	uint8_t nopBits;	// partial programs allowed per page, one per ECC sector
+	uint8_t tagColumn;	// erase count tag in the spare area, 0 if its layout isn't known
+
+	constexpr uint32_t pageSize() const { return 1ul << columnBits; }
+	constexpr uint32_t pagesPerBlock() const { return 1ul << pageBits; }
+	constexpr uint32_t blockSize() const { return 1ul << (columnBits + pageBits); }
+	constexpr uint32_t dieSize() const { return 1ul << (columnBits + pageBits + blockBits); }
+	constexpr uint32_t blocks() const { return 1ul << (blockBits + dieBits); }
+	constexpr uint32_t subPageSize() const { return 1ul << (columnBits - nopBits); }
+
+	constexpr uint32_t column(uint32_t addr) const { return addr & (pageSize() - 1); }
+	constexpr uint32_t page(uint32_t addr) const { return addr >> columnBits; }
+	constexpr uint32_t block(uint32_t addr) const { return addr >> (columnBits + pageBits); }
+	constexpr uint32_t die(uint32_t addr) const { return addr >> (columnBits + pageBits + blockBits); }
+	constexpr uint32_t row(uint32_t addr) const { return page(addr & (dieSize() - 1)); }
+	constexpr uint32_t blockAddress(uint32_t block) const { return block << (columnBits + pageBits); }
+	constexpr uint32_t pageAddress(uint32_t page) const { return page << columnBits; }
+};
 
-//Geometry
-#define sectors_w25n0x              1024
-#define pagesPerSector_w25n0x         64
-#define pageSize              		2048
-#define sectorSize					pagesPerSector_w25n0x * pageSize
-#define totalSize_w25n0x		 	sectorSize * sectors_w25n0x
-#define pagesPerDie					65534
+static_assert(nand_geometry{11, 6, 10, 1, 2}.die(0x8000000) == 1, "W25M02 die 1 starts at 128 MB");
+static_assert(nand_geometry{11, 6, 10, 1, 2}.row(0x8000000 + 0x20800) == 65, "W25M02 rows count from 0 on each die");
+static_assert(nand_geometry{11, 6, 11, 0, 2}.row(0xFFFF800) == 131071, "W25N02 has 17 bit rows");
+static_assert(nand_geometry{11, 6, 10, 0, 2}.subPageSize() == 512, "W25N01 has 512 byte ECC sectors");
 
-// Device size parameters
-#define PAGE_SIZE			2048
-#define PAGES_PER_BLOCK		64
-#define BLOCKS_PER_DIE		1024
+// Program Execute or Block Erase started but not yet waited for
+#define PENDING_PROG		1
+#define PENDING_ERASE		2
 
-#define reservedBBMBlocks	24
 
 
 
@@ -74,21 +100,18 @@ PROGMEM static const struct chipinfo {
 	uint32_t progtime;	// maximum microseconds to wait for page programming
 	uint32_t erasetime;	// maximum microseconds to wait for sector erase
 	const char pn[22];		//flash name
+	nand_geometry geometry;	// whole chip, including the reserved blocks
 } known_chips[] = {
 	//NAND
 	//{{0xEF, 0xAA, 0x21}, 2048, 131072, 134217728,   2000, 15000},  //Winbond W25N01G
-	//Upper 24 blocks * 128KB/block will be used for bad block replacement area
-	//so reducing total chip size: 134217728 - 24*131072
-    {{0xEF, 0xAA, 0x21}, 2048, 131072, 0, 131596288, 2000, 15000, "W25N01GVZEIG"},  //Winbond W25N01G
+	//Upper blocks * 128KB/block will be used for bad block replacement area
+	//so reducing total chip size: 134217728 - 20*131072, 2 dies: 268435456 - 24*131072
+    {{0xEF, 0xAA, 0x21}, 2048, 131072, 0, 131596288, 2000, 15000, "W25N01GVZEIG", {11, 6, 10, 0, 2, 4}},  //Winbond W25N01G
 	//{{0xEF, 0xAA, 0x22}, 2048, 131072, 134217728*2, 2000, 15000},  //Winbond W25N02G
-	{{0xEF, 0xAA, 0x22}, 2048, 131072, 0, 265289728, 2000, 15000, "W25N02KVZEIR"},  //Winbond W25N02G
-    {{0xEF, 0xBB, 0x21}, 2048, 131072, 0, 265289728, 2000, 15000, "W25M02"},  //Winbond W25M02
+	{{0xEF, 0xAA, 0x22}, 2048, 131072, 0, 265289728, 2000, 15000, "W25N02KVZEIR", {11, 6, 11, 0, 2, 0}},  //Winbond W25N02G
+    {{0xEF, 0xBB, 0x21}, 2048, 131072, 0, 265289728, 2000, 15000, "W25M02", {11, 6, 10, 1, 2, 4}},  //Winbond W25M02
 };
 
-volatile uint32_t currentPage     = UINT32_MAX;
-volatile uint32_t currentPageRead = UINT32_MAX;
-
-
 static const struct chipinfo * chip_lookup(const uint8_t *id)
 {
 	const unsigned int numchips = sizeof(known_chips) / sizeof(struct chipinfo);
@@ -101,6 +124,316 @@ static const struct chipinfo * chip_lookup(const uint8_t *id)
 	return nullptr;
 }
 
+// Status register and BB LUT decoding, shared by the SPI and QSPI drivers
+
+static inline uint8_t eccStatus(uint8_t statReg)
+{
+	return (statReg >> 4) & 3;
+}
+
+// The erase count of each block is kept in the spare area of its first
+// page, at the geometry's tagColumn.  On W25N01 these are the 4 ECC
+// protected "user data I" bytes of the first sector.  It is loaded with
+// the page data, as programming the spare area again would spoil the
+// sector's ECC.  24 bit count and a check byte, so a blank spare area
+// reads as no tag.
+#define TAG_SIZE   4
+
+static inline void packTag(uint32_t count, uint8_t *tag)
+{
+	if (count > 0xFFFFFF) count = 0xFFFFFF;
+	tag[0] = count;
+	tag[1] = count >> 8;
+	tag[2] = count >> 16;
+	tag[3] = tag[0] ^ tag[1] ^ tag[2] ^ 0x5A;
+}
+
+static inline bool unpackTag(const uint8_t *tag, uint32_t &count)
+{
+	if (tag[3] != (tag[0] ^ tag[1] ^ tag[2] ^ 0x5A)) return false;
+	count = tag[0] | (tag[1] << 8) | (tag[2] << 16);
+	return true;
+}
+
+// Split the 80 bytes returned by Read BBM LUT (0xA5) into entries.  LBA
+// gets the block address without the status bits, linkStatus gets the
+// status bits.  Returns the number of open entries.
+static unsigned int parseBBLUT(const uint8_t *data, uint16_t *LBA, uint16_t *PBA, uint8_t *linkStatus)
+{
+	unsigned int openEntries = 0;
+	//See page 33 of the reference manual for W25N01G
+	for (int i = 0, offset = 0 ; i < BBLUT_ENTRIES ; i++, offset += 4) {
+		const uint16_t lba = data[offset+ 0] << 8 | data[offset+ 1];
+		LBA[i] = lba & ~BBLUT_STATUS_MASK;
+		PBA[i] = data[offset+ 2] << 8 | data[offset+ 3];
+		linkStatus[i] = (lba & BBLUT_STATUS_MASK) >> 14;
+		if (!(lba & BBLUT_STATUS_ENABLED)) {
+			linkStatus[i] = BBLUT_LINK_OPEN;
+			openEntries++;
+		}
+	}
+	return openEntries;
+}
+
+
+// Bad block table, saved as one record per page in the table blocks.
+// Each change appends a record with a higher sequence number.
+#define BBM_MAGIC            0x314D4242	// "BBM1"
+#define BBM_RECORD_SIZE      128
+
+FLASHMEM
+bool LittleFS_NANDBadBlocks::begin(const ops_t *ops, uint32_t blocks, uint32_t spares, uint32_t block_size, uint32_t page_size)
+{
+	this->ops = ops;
+	this->blocks = blocks;
+	this->spares = spares;
+	this->block_size = block_size;
+	this->page_size = page_size;
+	count = 0;
+	seq = 0;
+	tablePage = 0;
+	const uint32_t len = 1 + ((blocks + spares) / 8);
+	free(remapped);
+	remapped = (uint8_t *)malloc(len * 2);
+	retired = remapped ? remapped + len : nullptr;
+	if (!remapped) return false;
+	memset(remapped, 0, len * 2);
+
+	// the table lives in the first two good reserved blocks
+	unsigned int n = 0;
+	for (uint32_t b = blocks; b < blocks + spares && n < 2; b++) {
+		if (!ops->markedBad(ops->context, b)) tableBlock[n++] = b;
+	}
+	if (n < 2) return false;
+	int r = load();
+	if (r <= 0) return r == 0;
+
+	// No table yet.  Retire the spares, then replace the blocks, which
+	// the factory marked bad.
+	for (uint32_t b = blocks; b < blocks + spares; b++) {
+		if (b == tableBlock[0] || b == tableBlock[1]) continue;
+		if (count < MAX_SPARES && ops->markedBad(ops->context, b)) {
+			table[count].logical = NONE;
+			table[count].physical = b;
+			count++;
+		}
+	}
+	for (uint32_t b = 0; b < blocks; b++) {
+		if (ops->markedBad(ops->context, b)) replace(b, 0);
+	}
+	return save() == 0;
+}
+
+// Read the newest valid record from the two table blocks.  Returns 0
+// when found, 1 when there is no table, or an error.
+FLASHMEM
+int LittleFS_NANDBadBlocks::load()
+{
+	const uint32_t pages = block_size / page_size;
+	uint8_t buf[BBM_RECORD_SIZE];
+	uint32_t bestSeq = 0;
+	int best = -1;
+	uint16_t nextPage[2];
+
+	for (int i = 0; i < 2; i++) {
+		nextPage[i] = pages;
+		for (uint32_t page = 0; page < pages; page++) {
+			int r = ops->read(ops->context, tableBlock[i], page * page_size, buf, sizeof(buf));
+			if (r < 0 && r != LFS_ERR_CORRUPT) return r;
+			uint32_t magic, recSeq, crc;
+			uint16_t n;
+			memcpy(&magic, buf, 4);
+			if (magic == 0xFFFFFFFF) {
+				nextPage[i] = page; // blank, the rest of the block is unused
+				break;
+			}
+			memcpy(&recSeq, buf + 4, 4);
+			memcpy(&n, buf + 8, 2);
+			if (magic != BBM_MAGIC || n > MAX_SPARES) continue;
+			const uint32_t len = 12 + n * sizeof(entry_t);
+			memcpy(&crc, buf + len, 4);
+			if (crc != lfs_crc(0xFFFFFFFF, buf, len)) continue;
+			if (best >= 0 && recSeq <= bestSeq) continue;
+			best = i;
+			bestSeq = recSeq;
+			count = n;
+			memcpy(table, buf + 12, n * sizeof(entry_t));
+		}
+	}
+	if (best < 0) return 1;
+
+	seq = bestSeq;
+	if (best == 1) {
+		const uint16_t b = tableBlock[0];
+		tableBlock[0] = tableBlock[1];
+		tableBlock[1] = b;
+	}
+	tablePage = nextPage[best];
+	for (unsigned int i = 0; i < count; i++) {
+		const uint32_t b = table[i].logical;
+		if (b != NONE && b < blocks) remapped[b >> 3] |= 1 << (b & 7);
+	}
+	return 0;
+}
+
+// Append the current table to the table block, moving to the other
+// block when this one is full
+FLASHMEM
+int LittleFS_NANDBadBlocks::save()
+{
+	if (tablePage >= block_size / page_size) {
+		const uint16_t b = tableBlock[0];
+		tableBlock[0] = tableBlock[1];
+		tableBlock[1] = b;
+		tablePage = 0;
+	}
+	if (tablePage == 0) {
+		int r = ops->erase(ops->context, tableBlock[0]);
+		if (r < 0) return r;
+	}
+	uint8_t buf[BBM_RECORD_SIZE];
+	memset(buf, 0xFF, sizeof(buf));
+	const uint32_t magic = BBM_MAGIC;
+	seq++;
+	memcpy(buf, &magic, 4);
+	memcpy(buf + 4, &seq, 4);
+	memcpy(buf + 8, &count, 2);
+	memcpy(buf + 12, table, count * sizeof(entry_t));
+	const uint32_t len = 12 + count * sizeof(entry_t);
+	const uint32_t crc = lfs_crc(0xFFFFFFFF, buf, len);
+	memcpy(buf + len, &crc, 4);
+	return ops->prog(ops->context, tableBlock[0], tablePage++ * page_size, buf, sizeof(buf));
+}
+
+uint32_t LittleFS_NANDBadBlocks::lookup(uint32_t block) const
+{
+	for (unsigned int i = 0; i < count; i++) {
+		if (table[i].logical == block) return table[i].physical;
+	}
+	return block;
+}
+
+// True for a reserved block which is free to become a replacement
+bool LittleFS_NANDBadBlocks::isSpare(uint32_t physical) const
+{
+	if (physical < blocks || physical >= blocks + spares) return false;
+	if (physical == tableBlock[0] || physical == tableBlock[1]) return false;
+	for (unsigned int i = 0; i < count; i++) {
+		if (table[i].physical == physical) return false;
+	}
+	return true;
+}
+
+void LittleFS_NANDBadBlocks::retire(uint32_t block)
+{
+	if (retired && block < blocks) retired[block >> 3] |= 1 << (block & 7);
+}
+
+// Move a logical block to a spare, copying its first copyPages pages.
+// The physical block it used is never used again.
+FLASHMEM
+int LittleFS_NANDBadBlocks::replace(uint32_t block, uint32_t copyPages)
+{
+	if (!remapped || block >= blocks) return LFS_ERR_CORRUPT;
+	const uint32_t from = map(block);
+	uint8_t *buf = nullptr;
+	if (copyPages > 0) {
+		buf = (uint8_t *)malloc(page_size);
+		if (!buf) return LFS_ERR_NOMEM;
+	}
+	const unsigned int oldCount = count;
+	int r = LFS_ERR_CORRUPT; // no spares left
+	for (uint32_t spare = blocks; spare < blocks + spares && count < MAX_SPARES; spare++) {
+		if (!isSpare(spare)) continue;
+		int err = ops->erase(ops->context, spare);
+		for (uint32_t page = 0; err == 0 && page < copyPages; page++) {
+			// littlefs checks its own data, so copy pages ECC could not fix
+			ops->read(ops->context, from, page * page_size, buf, page_size);
+			bool blank = true;
+			for (uint32_t i = 0; i < page_size; i++) {
+				if (buf[i] != 0xFF) {
+					blank = false;
+					break;
+				}
+			}
+			if (!blank) err = ops->prog(ops->context, spare, page * page_size, buf, page_size);
+		}
+		if (err == LFS_ERR_CORRUPT) {
+			// this spare is bad too
+			table[count].logical = NONE;
+			table[count].physical = spare;
+			count++;
+			continue;
+		}
+		if (err < 0) {
+			r = err;
+			break;
+		}
+		for (unsigned int i = 0; i < count; i++) {
+			if (table[i].logical == block) table[i].logical = NONE; // old spare went bad
+		}
+		table[count].logical = block;
+		table[count].physical = spare;
+		count++;
+		remapped[block >> 3] |= 1 << (block & 7);
+		retired[block >> 3] &= ~(1 << (block & 7));
+		r = 0;
+		break;
+	}
+	free(buf);
+	// without the table the block would be used again after a restart
+	if (count != oldCount && save() < 0) return LFS_ERR_IO;
+	return r;
+}
+
+// A Program Execute failed: move the block's earlier pages to a spare.
+// littlefs finds the missing page when it checks the write.
+FLASHMEM
+int LittleFS_NANDBadBlocks::progFailed(uint32_t physical, uint32_t page)
+{
+	uint32_t block = physical;
+	if (physical >= blocks) {
+		block = NONE;
+		for (unsigned int i = 0; i < count; i++) {
+			if (table[i].physical == physical) block = table[i].logical;
+		}
+		if (block == NONE) return LFS_ERR_CORRUPT; // not in use, table block
+	}
+	return replace(block, page);
+}
+
+// Erase the unused spares, for lowLevelFormat
+FLASHMEM
+int LittleFS_NANDBadBlocks::eraseSpares()
+{
+	const unsigned int oldCount = count;
+	for (uint32_t spare = blocks; spare < blocks + spares && count < MAX_SPARES; spare++) {
+		if (!isSpare(spare)) continue;
+		if (ops->erase(ops->context, spare) == LFS_ERR_CORRUPT) {
+			table[count].logical = NONE;
+			table[count].physical = spare;
+			count++;
+		}
+	}
+	if (count != oldCount && save() < 0) return LFS_ERR_IO;
+	return 0;
+}
+
+// Each table entry records one bad physical block
+uint32_t LittleFS_NANDBadBlocks::badBlocks() const
+{
+	return count;
+}
+
+uint32_t LittleFS_NANDBadBlocks::sparesLeft() const
+{
+	uint32_t n = 0;
+	for (uint32_t spare = blocks; spare < blocks + spares; spare++) {
+		if (isSpare(spare)) n++;
+	}
+	return n;
+}
+
 
 FLASHMEM
 bool LittleFS_SPINAND::begin(uint8_t cspin, SPIClass &spiport)
@@ -125,6 +458,7 @@ bool LittleFS_SPINAND::begin(uint8_t cspin, SPIClass &spiport)
 	const struct chipinfo *info = chip_lookup(buf+2);
 	if (!info) return false;
 	hwinfo = (const void *)info;
+	geo = &info->geometry;
 	//Serial.printf("Flash size is %.2f Mbyte\n", (float)info->chipsize / 1048576.0f);
 	
 	//capacityID = buf[3];   //W25N01G has 1 die, W25N02G had 2 dies
@@ -164,14 +498,46 @@ bool LittleFS_SPINAND::begin(uint8_t cspin, SPIClass &spiport)
 	config.sync = &static_sync;
 	config.read_size = info->progsize;
 	config.prog_size = info->progsize;
+	if (subPageProgram) {
+		// each ECC sector of a page is programmed on its own, so small
+		// commits don't use a whole page.  littlefs programs each one
+		// once, keeping within the chip's partial program limit.
+		config.read_size = geo->subPageSize();
+		config.prog_size = geo->subPageSize();
+	}
 	config.block_size = info->erasesize;
 	config.block_count = info->chipsize / info->erasesize;
+	if (deviceID != W25M02) dieInterleave = false;
+	if (dieInterleave) {
+		// each littlefs block is a block on each die, see locate().
+		// Die 1's reserved blocks leave as many on die 0 unpaired.
+		config.block_size *= 2;
+		config.block_count -= geo->blocks() / 2;
+	}
 	config.block_cycles = 400;
 	config.cache_size = info->progsize;
 	config.lookahead_size = info->progsize;
 	config.name_max = LFS_NAME_MAX;
+	if (!tuneConfig(config.block_size)) return false; // RAM budget too small
+	hookCallbacks(); // track which blocks are erased
+	reportsBadBlocks = true;
 	configured = true;
 
+	bbmOps.context = this;
+	bbmOps.read = &bbm_read;
+	bbmOps.prog = &bbm_prog;
+	bbmOps.erase = &bbm_erase;
+	bbmOps.markedBad = &bbm_markedBad;
+	// the blocks above chipsize are the bad block spare area
+	const uint32_t chipBlocks = info->chipsize / info->erasesize;
+	if (!bbm.begin(&bbmOps, chipBlocks, geo->blocks() - chipBlocks,
+	  geo->blockSize(), geo->pageSize())) {
+		//Serial.println("bad block table failed");
+		configured = false;
+		port = nullptr;
+		return false;
+	}
+
 	//Serial.println("attempting to mount existing media");
 	if (lfs_mount(&lfs, &config) < 0) {
 		//Serial.println("couldn't mount media, attemping to format");
@@ -202,122 +568,217 @@ static void printtbuf(const void *buf, unsigned int len)
 	//Serial.println();
 }
 
-static bool blockIsBlank(struct lfs_config *config, lfs_block_t block, void *readBuf, bool full=true );
-static bool blockIsBlank(struct lfs_config *config, lfs_block_t block, void *readBuf, bool full)
+int LittleFS_SPINAND::read(lfs_block_t block, lfs_off_t offset, void *buf, lfs_size_t size)
 {
-	if (!readBuf) return false;
-	for (lfs_off_t offset=0; offset < config->block_size; offset += config->read_size) {
-		memset(readBuf, 0, config->read_size);
-		config->read(config, block, offset, readBuf, config->read_size);
-		const uint8_t *buf = (uint8_t *)readBuf;
-		//printtbuf(buf, 20);
-		for (unsigned int i=0; i < config->read_size; i++) {
-			if (buf[i] != 0xFF) return false;
+	if (!port) return LFS_ERR_IO;
+	uint8_t *p = (uint8_t *)buf;
+	int err = 0;
+
+	while (size > 0) {
+		uint32_t chipBlock, chipOffset;
+		lfs_size_t len = locate(block, offset, chipBlock, chipOffset);
+		if (len > size) len = size;
+		// only the die being read waits, the other may keep programming
+		int r = settleProg(geo->die(blockAddress(bbm.map(chipBlock))));
+		if (r < 0 && r != LFS_ERR_CORRUPT) return r; // littlefs finds a failed program itself
+		const uint32_t corrected = correctedPages;
+		r = readPhysical(bbm.map(chipBlock), chipOffset, p, len);
+		if (correctedPages != corrected) eccCorrected(block, correctedPages - corrected);
+		if (r == LFS_ERR_CORRUPT) {
+			bbm.retire(chipBlock); // replace it when littlefs erases it
+			err = r;
+		} else if (r < 0) {
+			return r;
 		}
-		if ( !full )
-			return true; // first bytes read as 0xFF
+		offset += len;
+		p += len;
+		size -= len;
 	}
-	return true; // all bytes read as 0xFF
+	return err;
 }
 
-int LittleFS_SPINAND::read(lfs_block_t block, lfs_off_t offset, void *buf, lfs_size_t size)
+int LittleFS_SPINAND::readPhysical(uint32_t block, uint32_t offset, void *buf, uint32_t size)
 {
-	if (!port) return LFS_ERR_IO;
-	const uint32_t addr = block * config.block_size + offset;
-	
-	if(deviceID == W25N01){
-		uint16_t targetPage = LINEAR_TO_PAGE(addr);
-		if(currentPageRead != targetPage){
-		  loadPage(addr);
-		  currentPageRead = targetPage;
-		}
-	} else {
-		loadPage(addr);
-	}
+	uint32_t addr = blockAddress(block) + offset;
+	int r = finishProg(geo->die(addr));
+	if (r < 0) return r;
+	uint8_t *p = (uint8_t *)buf;
 	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-	wait(progtime);
-	
-	uint16_t column = LINEAR_TO_COLUMN(addr);
+	bool uncorrectable = false;
+
+	while (size > 0) {
+		// the chip's data buffer holds one page, larger reads take several
+		const uint32_t targetPage = geo->page(addr);
+		const uint16_t column = geo->column(addr);
+		lfs_size_t len = geo->pageSize() - column;
+		if (len > size) len = size;
+
+		if (column == 0 && size > geo->pageSize() && pageInBuffer != targetPage) {
+			// several whole pages, stream them in continuous read mode
+			int n = readContinuous(addr, p, size);
+			if (n < 0) return LFS_ERR_IO;
+			if (n > 0) {
+				addr += n;
+				p += n;
+				size -= n;
+				continue;
+			}
+			// ECC reported a problem, read them again one page at a time
+		}
 
-	uint8_t cmd[4];
-	cmd[0] = 0x03;  //0x03, READ Data
-	cmd[1] = column >> 8; 
-	cmd[2] = column;
-	cmd[3] = 0;
-    
-  	port->beginTransaction(SPICONFIG_NAND);
-	digitalWrite(pin, LOW);
-	port->transfer(cmd, 4);
-	port->transfer(buf, size);
-    digitalWrite(pin, HIGH);
-    port->endTransaction();
-	wait(progtime);
+		bool pageBad = false;
+		if (pageInBuffer == targetPage) {
+			// the other die may have been selected since
+			if (deviceID == W25M02) selectDie(geo->die(addr));
+		} else {
+			loadPage(addr);
+			if (wait(progtime) < 0) return LFS_ERR_IO;
+			pageInBuffer = targetPage;
+
+			// Check ECC, the status is from the most recent page load
+			uint8_t statReg = readStatusRegister(0xC0, false);
+			uint8_t eccCode = eccStatus(statReg);
+			switch (eccCode) {
+			case ECC_OK: // Successful read, no ECC correction
+			  break;
+			case ECC_CORRECTED: // Successful read with ECC correction
+			  correctedPages++;  // counted toward scrubbing
+			  break;
+			case ECC_UNCORRECTABLE: // Uncorrectable ECC in a single page
+			case ECC_UNCORRECTABLE_MULTI: // Uncorrectable ECC in multiple pages
+			  //Serial.printf("Uncorrectable ECC (addr, code): %x, %x\n", addr, eccCode);
+			  pageBad = true;
+			  break;
+			}
+		}
 
-	// Check ECC
-	uint8_t statReg = readStatusRegister(0xC0, false);
-	uint8_t eccCode = (((statReg) & ((1 << 5)|(1 << 4))) >> 4);
-	
-	wait(progtime);
-	
-	switch (eccCode) {
-	case 0: // Successful read, no ECC correction
-	  break;
-	case 1: // Successful read with ECC correction
-	  //Serial.printf("Successful read with ECC correction (addr, code): %x, %x\n", addr, eccCode);
-	case 2: // Uncorrectable ECC in a single page
-	  //Serial.printf("Uncorrectable ECC in a single page (addr, code): %x, %x\n", addr, eccCode);
-	case 3: // Uncorrectable ECC in multiple pages
-	  addBBLUT(LINEAR_TO_BLOCK(addr));
-	  //deviceReset();
-	  //Serial.printf("Uncorrectable ECC in a multipe pages (addr, code): %x, %x\n", addr, eccCode);
-	  break;
+		uint8_t cmd[4];
+		cmd[0] = 0x03;  //0x03, READ Data
+		cmd[1] = column >> 8;
+		cmd[2] = column;
+		cmd[3] = 0;
+
+		port->beginTransaction(SPICONFIG_NAND);
+		digitalWrite(pin, LOW);
+		port->transfer(cmd, 4);
+		port->transfer(p, len);
+		digitalWrite(pin, HIGH);
+		port->endTransaction();
+
+		if (pageBad) {
+			uncorrectable = true;
+			pageInBuffer = UINT32_MAX; // check ECC again if read again
+		}
+		addr += len;
+		p += len;
+		size -= len;
 	}
 
 	//printtbuf(buf, 20);
-	return 0;
+	return uncorrectable ? LFS_ERR_CORRUPT : 0;
 }
 
 int LittleFS_SPINAND::prog(lfs_block_t block, lfs_off_t offset, const void *buf, lfs_size_t size)
 {
 	if (!port) return LFS_ERR_IO;
-	
-	uint8_t cmd1[4], die_select;
+	const uint8_t *p = (const uint8_t *)buf;
+
+	while (size > 0) {
+		// Program Execute writes one page, larger caches take several
+		uint32_t chipBlock, chipOffset;
+		locate(block, offset, chipBlock, chipOffset);
+		lfs_size_t len = geo->pageSize() - geo->column(offset);
+		if (len > size) len = size;
+		int r = settleProg(geo->die(blockAddress(bbm.map(chipBlock)))); // may move the block to a spare
+		if (r < 0) return r;
+		const uint32_t physical = bbm.map(chipBlock);
+		const uint32_t address = blockAddress(physical) + chipOffset;
+		// the first page carries the block's erase count
+		r = progPage(address, p, len, chipOffset == 0 ? eraseCount(block) : 0);
+		if (r < 0) return r;
+		// pages to keep if it fails, with this one when sub-page
+		// programs have already written the start of it
+		pending[geo->die(address)].block = physical;
+		pending[geo->die(address)].page = geo->page(chipOffset) + (geo->column(chipOffset) ? 1 : 0);
+		offset += len;
+		p += len;
+		size -= len;
+	}
+	return 0;
+}
 
-	const uint32_t address = block * config.block_size + offset;
-	
-	//Program Data Load
-	uint16_t columnAddress = LINEAR_TO_COLUMN(address);
-	uint32_t pageAddress = LINEAR_TO_PAGE(address);
-
-	if(deviceID == W25M02 || deviceID  == W25N02) {
-		if(pageAddress > pagesPerDie) {
-			//pageAddress -= pagesPerDie;
-			die_select = 1;
-			cmd1[1] = 1;
-		} else {
-			cmd1[1] = 0;
-			die_select = 0;
+// Used by bad block management, waits for each page
+int LittleFS_SPINAND::progPhysical(uint32_t block, uint32_t offset, const void *buf, uint32_t size)
+{
+	uint32_t address = blockAddress(block) + offset;
+	const uint8_t *p = (const uint8_t *)buf;
+
+	while (size > 0) {
+		lfs_size_t len = geo->pageSize() - geo->column(address);
+		if (len > size) len = size;
+		int r = progPage(address, p, len);
+		if (r == 0) r = finishProg(geo->die(address));
+		if (r < 0) return r;
+		address += len;
+		p += len;
+		size -= len;
+	}
+	return 0;
+}
+
+// Program Execute and Block Erase return without waiting, so the time
+// littlefs spends preparing the next page overlaps the programming, and
+// on W25M02 the other die can work meanwhile.  The next command for the
+// die, or sync, waits and checks the Program or Erase Fail bit.
+int LittleFS_SPINAND::finishProg(int die)
+{
+	const struct chipinfo *info = (const struct chipinfo *)hwinfo;
+	int r = 0;
+	for (uint8_t d = 0; d < 2; d++) {
+		pending_t &p = pending[d];
+		if (!p.op || (die >= 0 && d != die)) continue;
+		if (deviceID == W25M02) selectDie(d);
+		const bool erasing = (p.op == PENDING_ERASE);
+		p.op = 0;
+		if (wait(erasing ? info->erasetime : info->progtime) < 0) return LFS_ERR_IO;
+		uint8_t status = readStatusRegister(0xC0, false);
+		if (status & (erasing ? (1 << 2) : (1 << 3))) {  // E-FAIL, P-FAIL
+			p.failed = true;
+			r = LFS_ERR_CORRUPT;
 		}
-	} else {
-		cmd1[1] = 0;
 	}
-	
-	if(deviceID == W25M02) {
-		//issue Select Die command before issuing a page load
-		port->beginTransaction(SPICONFIG_NAND);
-		digitalWrite(pin, LOW);
-		port -> transfer(0xC2);
-		port -> transfer(die_select);
-		digitalWrite(pin, HIGH);
-		port->endTransaction();
-		if(pageAddress > pagesPerDie)
-			pageAddress -= pagesPerDie;		//W25M02 has 2 separate W25N01 dies addressed individually
-		cmd1[1] = 0;						//dummy block for write is 0.
-		const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-		wait(progtime);
-	} 
+	return r;
+}
+
+// finishProg(), and when a program or erase failed move the block's
+// data to a spare.  Returns LFS_ERR_CORRUPT so littlefs relocates.
+int LittleFS_SPINAND::settleProg(int die)
+{
+	int r = finishProg(die);
+	if (pending[0].failed || pending[1].failed) {
+		finishProg();  // the copy may use either die
+		for (uint8_t d = 0; d < 2; d++) {
+			pending_t &p = pending[d];
+			if (!p.failed) continue;
+			p.failed = false;
+			if (p.block != UINT32_MAX) bbm.progFailed(p.block, p.page);
+		}
+	}
+	return r;
+}
+
+int LittleFS_SPINAND::progPage(uint32_t address, const void *buf, lfs_size_t size, uint32_t eraseCount)
+{
+	const uint8_t d = geo->die(address);
+	int r = finishProg(d);  // the die's data buffer is busy until then
+	if (r < 0) return r;
+
+	//Program Data Load
+	uint16_t columnAddress = geo->column(address);
+	uint32_t page = rowAddress(address);  // selects the W25M02 die
 	
 	writeEnable();   //sets the WEL in Status Reg to 1 (bit 2)
+	pageInBuffer = UINT32_MAX;  // program data load replaces the data buffer
 	
 	uint8_t cmd[3];
 	cmd[0] = 0x02;  //program data load, 0x02,  write data to the data buffer
@@ -331,44 +792,138 @@ int LittleFS_SPINAND::prog(lfs_block_t block, lfs_off_t offset, const void *buf,
 	digitalWrite(pin, HIGH);
 	port->endTransaction();
 
-	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-	wait(progtime);
+	if (eraseCount && geo->tagColumn) {
+		// Random Program Data Load, 0x84, keeps the data loaded above
+		uint8_t tag[TAG_SIZE];
+		packTag(eraseCount, tag);
+		columnAddress = geo->pageSize() + geo->tagColumn;
+		cmd[0] = 0x84;
+		cmd[1] = columnAddress >> 8;
+		cmd[2] = columnAddress;
+		port->beginTransaction(SPICONFIG_NAND);
+		digitalWrite(pin, LOW);
+		port->transfer(cmd, 3);
+		port->transfer(tag, nullptr, TAG_SIZE);
+		digitalWrite(pin, HIGH);
+		port->endTransaction();
+	}
+
 	//uint8_t status = readStatusRegister(0xA0, false );  //0xA0 - status register
 	//if ((status &  (1 << 3)) == 1)   //Status Program Fail
 	//	Serial.println( "Programed Status: FAILED" );
 
 	//Program Execute, 0x10
+	uint8_t cmd1[4];
 	cmd1[0] = 0x10;   //Program Execute, write from data buffer to physical memory page sepc
-	//cmd1[1] defined above
-	cmd1[2] = pageAddress >> 8; 
-	cmd1[3] = pageAddress;
+	cmd1[1] = page >> 16;
+	cmd1[2] = page >> 8; 
+	cmd1[3] = page;
 	port->beginTransaction(SPICONFIG_NAND);
 	digitalWrite(pin, LOW);
 	port->transfer(cmd1, 4);
 	digitalWrite(pin, HIGH);
 	port->endTransaction();
 
-	return wait(progtime);
+	pending[d].op = PENDING_PROG;
+	pending[d].failed = false;
+	pending[d].page = 0;
+	pending[d].block = UINT32_MAX;  // prog() fills in the block
+	return 0;
 }
 
 int LittleFS_SPINAND::erase(lfs_block_t block)
 {
 	if (!port) return LFS_ERR_IO;
-	
-	const uint32_t addr = block * config.block_size;
-	
-	void *buffer = malloc(config.read_size);
-	if ( buffer != nullptr) {
-		if ( blockIsBlank(&config, block, buffer)) {
-			free(buffer);
-			return 0; // Already formatted exit no wait
+
+	// No blank check: reading 64 pages back takes far longer than a
+	// NAND block erase.  Blocks known to be erased never get here.
+	// With dieInterleave both dies erase at the same time.
+	for (uint32_t i = 0; i < (dieInterleave ? 2u : 1u); i++) {
+		uint32_t chipBlock, chipOffset;
+		locate(block, i * geo->pageSize(), chipBlock, chipOffset);
+		if (bbm.retiring(chipBlock)) {
+			int r = settleProg();
+			if (r < 0 && r != LFS_ERR_CORRUPT) return r;
+			r = bbm.replace(chipBlock, 0);
+			if (r == 0) continue;
+			if (r == LFS_ERR_IO) return r; // table not saved
 		}
-		free(buffer);
+		int r = settleProg(geo->die(blockAddress(bbm.map(chipBlock))));
+		if (r < 0 && r != LFS_ERR_CORRUPT) return r;
+
+		// settleProg leaves the die idle, even if it moved the block.  Don't
+		// wait for the erase, a failure is found by the next finishProg.
+		const uint32_t physical = bbm.map(chipBlock);
+		const uint32_t address = blockAddress(physical);
+		eraseSector(address);
+		pending_t &p = pending[geo->die(address)];
+		p.op = PENDING_ERASE;
+		p.failed = false;
+		p.page = 0;
+		p.block = physical;
 	}
+	return 0;
+}
 
-	eraseSector(addr);
+int LittleFS_SPINAND::erasePhysical(uint32_t block)
+{
+	const uint32_t address = blockAddress(block);
+	int r = finishProg(geo->die(address));
+	if (r < 0) return r;
+	eraseSector(address);
 	const uint32_t erasetime = ((const struct chipinfo *)hwinfo)->erasetime;
-	return 	wait(erasetime);
+	if (wait(erasetime) < 0) return LFS_ERR_IO;
+	uint8_t status = readStatusRegister(0xC0, false);
+	if (status & (1 << 2)) return LFS_ERR_CORRUPT;  // E-FAIL
+	return 0;
+}
+
+// The factory marks bad blocks with a non-FF first byte in the spare
+// area of their first page
+bool LittleFS_SPINAND::markedBad(uint32_t block)
+{
+	uint8_t mark = 0xFF;
+	if (readSpare(block, 0, &mark, 1) == LFS_ERR_IO) return false;
+	return mark != 0xFF;
+}
+
+// Read from the spare area of a chip block's first page.  Returns
+// LFS_ERR_CORRUPT if ECC could not correct the page.
+int LittleFS_SPINAND::readSpare(uint32_t block, uint32_t column, void *buf, uint32_t size)
+{
+	finishProg();
+	loadPage(blockAddress(block));
+	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
+	if (wait(progtime) < 0) return LFS_ERR_IO;
+	const uint8_t ecc = eccStatus(readStatusRegister(0xC0, false));
+	column += geo->pageSize();
+	uint8_t cmd[4];
+	cmd[0] = 0x03;
+	cmd[1] = column >> 8;
+	cmd[2] = column;
+	cmd[3] = 0;
+	port->beginTransaction(SPICONFIG_NAND);
+	digitalWrite(pin, LOW);
+	port->transfer(cmd, 4);
+	port->transfer(buf, size);
+	digitalWrite(pin, HIGH);
+	port->endTransaction();
+	return (ecc == ECC_OK || ecc == ECC_CORRECTED) ? 0 : LFS_ERR_CORRUPT;
+}
+
+// Largest erase count found in the spare areas of the chip blocks
+uint32_t LittleFS_SPINAND::storedEraseCount(lfs_block_t block)
+{
+	if (!geo->tagColumn) return 0; // not written on this chip
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < (dieInterleave ? 2u : 1u); i++) {
+		uint32_t chipBlock, chipOffset, n;
+		uint8_t tag[TAG_SIZE];
+		locate(block, i * geo->pageSize(), chipBlock, chipOffset);
+		if (readSpare(bbm.map(chipBlock), geo->tagColumn, tag, TAG_SIZE) < 0) continue;
+		if (unpackTag(tag, n) && n > count) count = n;
+	}
+	return count;
 }
  
 bool LittleFS_SPINAND::isReady()
@@ -405,8 +960,6 @@ int LittleFS_SPINAND::wait(uint32_t microseconds)
     port->transfer(0x06);  //Write Enable 0x06
     digitalWrite(pin, HIGH);
     port->endTransaction();
-	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-    wait(progtime);
 	
   status = readStatusRegister(0xC0, false);
   return status & (0x02);
@@ -415,45 +968,16 @@ int LittleFS_SPINAND::wait(uint32_t microseconds)
 
 void LittleFS_SPINAND::eraseSector(uint32_t address)
 {
-	uint32_t pageAddr = LINEAR_TO_PAGE(address) ;
-
-	//if(pageAddr > pagesPerDie) pageAddr -= pagesPerDie;
+	uint32_t page = rowAddress(address);  // selects the W25M02 die
 
 	uint8_t cmd[4];
-	uint8_t die_select = 0;
-
-	if(deviceID == W25M02 || deviceID  == W25N02) {
-		if(pageAddr > pagesPerDie) {
-			cmd[1] = 1;
-			die_select = 1;
-		} else {
-			cmd[1] = 0;
-			die_select = 0;
-		}
-	} else {
-		cmd[1] = 0;
-	}
-
-	if(deviceID == W25M02) {
-		//setup new LUT to issue Select Die command before issuing a page load
-		port->beginTransaction(SPICONFIG_NAND);
-		digitalWrite(pin, LOW);
-		port -> transfer(0xC2);   //die select
-		port -> transfer(die_select);
-		digitalWrite(pin, HIGH);
-		port->endTransaction();
-		if(pageAddr > pagesPerDie)
-			pageAddr -= pagesPerDie;		//W25M02 has 2 separate W25N01 dies addressed individually
-		cmd[1] = 0;						//dummy block for write is 0.
-		const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-		wait(progtime);
-	} 
-
     cmd[0] = 0xD8;   //Block erase, 0xD8
-    cmd[2] = pageAddr >> 8;
-    cmd[3] = pageAddr;
+    cmd[1] = page >> 16;
+    cmd[2] = page >> 8;
+    cmd[3] = page;
 
 	writeEnable();
+	pageInBuffer = UINT32_MAX;  // buffered page may be in this block
 	
 	port->beginTransaction(SPICONFIG_NAND);
 	digitalWrite(pin, LOW);
@@ -507,35 +1031,11 @@ uint8_t LittleFS_SPINAND::readStatusRegister(uint16_t reg, bool dump)
 ////////////////////////////////////////////////////////////
 void LittleFS_SPINAND::loadPage(uint32_t address)
 {
-    uint32_t targetPage = LINEAR_TO_PAGE(address);
+    uint32_t targetPage = rowAddress(address);  // selects the W25M02 die
   
-    uint8_t cmd[4], die_select;
-	
-	if(targetPage > pagesPerDie) {
-		die_select = 1;
-		cmd[1] = 1;
-	} else {
-		die_select = 0;
-		cmd[1] = 0;
-	}
-
-	if(deviceID == W25M02) {
-		//setup new LUT to issue Select Die command before issuing a page load
-		port->beginTransaction(SPICONFIG_NAND);
-		digitalWrite(pin, LOW);
-		port -> transfer(0xC2);
-		port -> transfer(die_select);
-		digitalWrite(pin, HIGH);
-		port->endTransaction();
-		if(targetPage > pagesPerDie)
-			targetPage -= pagesPerDie;		//W25M02 has 2 separate W25N01 dies addressed individually
-		cmd[1] = 0;						//dummy block for write is 0.
-		const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-		wait(progtime);		
-	} 
-
+    uint8_t cmd[4];
     cmd[0] = 0x13;   //Page Data Read
-	//cmd[1] defined above
+    cmd[1] = targetPage >> 16;
     cmd[2] = targetPage >> 8; 
     cmd[3] = targetPage;
 
@@ -544,40 +1044,120 @@ void LittleFS_SPINAND::loadPage(uint32_t address)
 	port->transfer(cmd, 4);
     digitalWrite(pin, HIGH);
     port->endTransaction();
-   
+	pageInBuffer = UINT32_MAX;  // caller sets it once the load completes
 }
-  
-uint8_t LittleFS_SPINAND::readECC(uint32_t targetPage, uint8_t *data, int length)
+
+// W25M02 is 2 W25N01 dies, each addressed from page 0.  Select the die
+// holding address and return the row (page) address within it.
+uint32_t LittleFS_SPINAND::rowAddress(uint32_t address)
 {
+	if (deviceID == W25M02) selectDie(geo->die(address));
+	return geo->row(address);
+}
 
-    uint16_t column = LINEAR_TO_COLUMNECC(targetPage*eccSize);
-	targetPage = LINEAR_TO_PAGEECC(targetPage*eccSize);
-	
-    uint8_t cmd[4], die_select;
-	
-	if(targetPage > pagesPerDie) {
-		die_select = 1;
-		cmd[1] = 1;
-	} else {
-		die_select = 0;
-		cmd[1] = 0;
+// Chip address of a block.  With setDieInterleave() even blocks are on
+// W25M02 die 0 and odd blocks on die 1, so each pair spans both dies.
+// config.block_count pairs fit below the reserved blocks at the top of
+// die 1, the rest of die 0 follows.  The reserved blocks aren't moved,
+// so the bad block table is found with either setting.
+uint32_t LittleFS_SPINAND::blockAddress(uint32_t block)
+{
+	if (dieInterleave && block < config.block_count * 2) {
+		block = ((block & 1) << geo->blockBits) | (block >> 1);
+	} else if (dieInterleave && block < config.block_count + (1ul << geo->blockBits)) {
+		block -= config.block_count;
 	}
+	return geo->blockAddress(block);
+}
+
+// With setDieInterleave() a littlefs block is a pair of chip blocks, the
+// same block on each W25M02 die, holding alternate pages.  littlefs
+// programs a whole cache at a time, so one die's Program Execute runs
+// while the next page loads into the other die.  Finds the chip block
+// (before bad block mapping) and offset in it, and returns how many
+// bytes follow there in order.
+uint32_t LittleFS_SPINAND::locate(lfs_block_t block, lfs_off_t offset, uint32_t &chipBlock, uint32_t &chipOffset)
+{
+	if (!dieInterleave) {
+		chipBlock = block;
+		chipOffset = offset;
+		return config.block_size - offset;
+	}
+	const uint32_t page = geo->page(offset);
+	chipBlock = block * 2 + (page & 1);
+	chipOffset = geo->pageAddress(page >> 1) + geo->column(offset);
+	return geo->pageSize() - geo->column(offset);
+}
+
+// Continuous read mode (BUF = 0) streams page after page from a single
+// Page Data Read.  The chip loads the next page while the current one
+// is shifted out, so only the first page costs a load time.  Returns
+// the number of bytes read, 0 if ECC was not clean (the caller reads
+// the pages again in buffered mode), or LFS_ERR_IO on timeout.
+int LittleFS_SPINAND::readContinuous(uint32_t address, uint8_t *buf, uint32_t size)
+{
+	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
+
+	// continuous read does not cross to the other die
+	const uint32_t max = geo->dieSize() - (address & (geo->dieSize() - 1));
+	if (size > max) size = max;
+	if (size <= geo->pageSize()) return 0;
+
+	// BUF is per die, select it before changing the read mode
+	if (deviceID == W25M02) selectDie(geo->die(address));
+	writeStatusRegister(0xB0, (1 << 4));  // ECC enabled, BUF = 0
+	loadPage(address);
+	int r = wait(progtime);
+	if (r == 0) {
+		uint8_t cmd[4];
+		cmd[0] = 0x03;  //0x03, READ Data, 3 dummy bytes in continuous mode
+		cmd[1] = 0;
+		cmd[2] = 0;
+		cmd[3] = 0;
 
-	if(deviceID == W25M02) {
-		//setup new LUT to issue Select Die command before issuing a page load
 		port->beginTransaction(SPICONFIG_NAND);
 		digitalWrite(pin, LOW);
-		port -> transfer(0xC2);
-		port -> transfer(die_select);
+		port->transfer(cmd, 4);
+		port->transfer(buf, size);
 		digitalWrite(pin, HIGH);
 		port->endTransaction();
-		if(targetPage > pagesPerDie)
-			targetPage -= pagesPerDie;		//W25M02 has 2 separate W25N01 dies addressed individually
-		cmd[1] = 0;						//dummy block for write is 0.
-	} 
+		r = wait(progtime);  // the chip may still be loading the next page
+	}
+	writeStatusRegister(0xB0, (1 << 4) | (1 << 3));  // back to buffered read
+	pageInBuffer = UINT32_MAX;  // holds whatever page followed
+	if (r < 0) return LFS_ERR_IO;
 
+	// ECC status covers every page of the continuous read
+	uint8_t statReg = readStatusRegister(0xC0, false);
+	if (eccStatus(statReg) != ECC_OK) return 0;
+	return size;
+}
+
+// W25M02 is 2 W25N01 dies, each with its own data buffer.  Only send
+// the Select Die command when changing dies.
+void LittleFS_SPINAND::selectDie(uint8_t die_select)
+{
+	if (die_select == dieSelected) return;
+	port->beginTransaction(SPICONFIG_NAND);
+	digitalWrite(pin, LOW);
+	port -> transfer(0xC2);   //die select
+	port -> transfer(die_select);
+	digitalWrite(pin, HIGH);
+	port->endTransaction();
+	dieSelected = die_select;
+}
+  
+uint8_t LittleFS_SPINAND::readECC(uint32_t targetPage, uint8_t *data, int length)
+{
+	settleProg();
+
+	// PAGE_ECCSIZE includes the spare area, so is not a power of 2
+    uint16_t column = (targetPage * eccSize) % PAGE_ECCSIZE;
+	targetPage = rowAddress(geo->pageAddress((targetPage * eccSize) / PAGE_ECCSIZE));  // selects the W25M02 die
+	
+    uint8_t cmd[4];
     cmd[0] = 0x13;   //Page Data Read
-	//cmd[1] defined above
+    cmd[1] = targetPage >> 16;
     cmd[2] = targetPage >> 8; 
     cmd[3] = targetPage;
 
@@ -586,6 +1166,7 @@ uint8_t LittleFS_SPINAND::readECC(uint32_t targetPage, uint8_t *data, int length
 	port->transfer(cmd, 4);
     digitalWrite(pin, HIGH);
     port->endTransaction();
+	pageInBuffer = UINT32_MAX;
 
 	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
 	wait(progtime);
@@ -603,21 +1184,19 @@ uint8_t LittleFS_SPINAND::readECC(uint32_t targetPage, uint8_t *data, int length
     digitalWrite(pin, HIGH);
     port->endTransaction();
 
-	wait(progtime);
-
 	  // Check ECC
 	  uint8_t statReg = readStatusRegister(0xC0, false);
-	  uint8_t eccCode = (((statReg) & ((1 << 5)|(1 << 4))) >> 4);
+	  uint8_t eccCode = eccStatus(statReg);
 
 	  switch (eccCode) {
-	  case 0: // Successful read, no ECC correction
+	  case ECC_OK: // Successful read, no ECC correction
 		break;
-	  case 1: // Successful read with ECC correction
-	  case 2: // Uncorrectable ECC in a single page
-	  case 3: // Uncorrectable ECC in multiple pages
+	  case ECC_CORRECTED: // Successful read with ECC correction
+	  case ECC_UNCORRECTABLE: // Uncorrectable ECC in a single page
+	  case ECC_UNCORRECTABLE_MULTI: // Uncorrectable ECC in multiple pages
 		//addError(address, eccCode);
 		//Serial.printf("ECC Error (addr, code): %x, %x\n", address, eccCode);
-		addBBLUT(LINEAR_TO_BLOCK(targetPage*eccSize));
+		//addBBLUT(geo->block(geo->pageAddress(targetPage)));
 		//deviceReset();
 		break;
 	}
@@ -628,13 +1207,14 @@ uint8_t LittleFS_SPINAND::readECC(uint32_t targetPage, uint8_t *data, int length
 
 void LittleFS_SPINAND::readBBLUT(uint16_t *LBA, uint16_t *PBA, uint8_t *linkStatus)
 {
+	finishProg();
     //uint16_t LBA, PBA;
     //uint16_t temp;
     //uint16_t openEntries = 0;
 	//BBLUT_TABLE_ENTRY_COUNT     20
 	//BBLUT_TABLE_ENTRY_SIZE      4  // in bytes
 	
-    uint8_t data[20 * 4];
+    uint8_t data[BBLUT_ENTRIES * 4];
 
   	port->beginTransaction(SPICONFIG_NAND);
 	digitalWrite(pin, LOW);
@@ -646,101 +1226,15 @@ void LittleFS_SPINAND::readBBLUT(uint16_t *LBA, uint16_t *PBA, uint8_t *linkStat
     digitalWrite(pin, HIGH);
     port->endTransaction();
 
-	//See page 33 of the reference manual for W25N01G
-    //Serial.println("Status of the links");
-    for(int i = 0, offset = 0 ; i < 20 ; i++, offset += 4) {
-      LBA[i] = data[offset+ 0] << 8 | data[offset+ 1];
-      PBA[i] =  data[offset+ 2] << 8 | data[offset+ 3]; 
-      
-	  if (LBA[i] == 0x0000) {
-		linkStatus[i] = 0;
-        //openEntries++;
-      } else  {
-        //Serial.printf("\tEntry: %d: Logical BA - %d, Physical BA - %d\n", i, LBA[i], PBA[i]);
-        linkStatus[i] = (uint8_t) (LBA[i] >> 14);
-        //if(linkStatus[i] == 3) Serial.println("\t    This link is enabled and its a Valid Link!");
-        //if(linkStatus[i] == 4) Serial.println("\t    This link was enabled but its not valid any more!");
-        //if(linkStatus[i] == 1) Serial.println("\t    Not Applicable!");
-      }
-	  
-    }
-    //Serial.printf("OpenEntries: %d\n", openEntries);
+	parseBBLUT(data, LBA, PBA, linkStatus);
 }
 
+// Replace a block with a spare from the reserved area, keeping its data.
+// Returns 0 on success, 1 when no spare block is left.
 uint8_t LittleFS_SPINAND::addBBLUT(uint32_t block_address)
 {
-  if(deviceID == W25N01) {
-	//check BBLUT FULL
-	uint8_t lutFull = 0;
-	lutFull = readStatusRegister(0xC0, false);
-	
-	if(lutFull & (1 << 6)) {
-		Serial.printf("Lut Full!!!!");
-		exit(1);
-	}
-	
-	//Read BBLUT
-	uint16_t LBA[20], PBA[20], openEntries = 0;
-	uint8_t  LUT_STATUS[20];
-	uint8_t firstOpenEntry = 0;
-	
-	readBBLUT(LBA, PBA, LUT_STATUS);
-	
-	Serial.println("Status of the links");
-	for(uint16_t i = 0; i < 20; i++){
-		if(LUT_STATUS[i] > 0) {
-			Serial.printf("\tEntry: %d: Logical BA - %d, Physical BA - %d\n", i, LBA[i], PBA[i]);
-			LUT_STATUS[i] = (uint8_t) (LBA[i] >> 14);
-			if(LUT_STATUS[i] == 3) Serial.println("\t    This link is enabled and its a Valid Link!");
-			if(LUT_STATUS[i] == 4) Serial.println("\t    This link was enabled but its not valid any more!");
-			if(LUT_STATUS[i] == 1) Serial.println("\t    Not Applicable!");
-		} else {
-			openEntries++;
-		}
-	} Serial.printf("OpenEntries: %d\n", openEntries);
-	
-	
-	//Need to determine if the address is already in the list and what the first open entry is.
-	for(uint16_t i = 0; i < 20; i++){
-		if(LUT_STATUS[i] > 0) {
-			if(LBA[i] == block_address) {
-				Serial.printf("Address: %d, already in BBLUT!\n", block_address);
-				return 0;
-			}
-		}
-	}
-	
-	firstOpenEntry = 20 - openEntries;	
-	Serial.printf("First Open Entry: %d\n", firstOpenEntry);
-	
-	//Write BBLUT with next sequential block
-	#ifdef LATER
-	uint8_t cmd[5];
-	
-	uint16_t pba, lba;
-	pba = block_address;
-	const uint32_t blocksize = ((const struct chipinfo *)hwinfo)->erasesize;
-	const uint32_t chipsize = ((const struct chipinfo *)hwinfo)->chipsize;
-	lba = LINEAR_TO_BLOCK((firstOpenEntry+1)*blocksize + chipsize);
-	Serial.printf("PBA: %d, LBA: %d\n", pba, lba);
-	
-	cmd[0] = 0xA1;
-	cmd[1] = pba >> 8;
-	cmd[2] = pba;
-	cmd[3] = lba >> 8;
-	cmd[4] = lba;
-	
-	//port->beginTransaction(SPICONFIG_NAND);
-	//digitalWrite(pin, LOW);
-	//port->transfer(cmd, 5);
-    //digitalWrite(pin, HIGH);
-    //port->endTransaction();
-	#endif
-	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-	wait(progtime);
-	
-  }
-	return 0;
+	settleProg();
+	return bbm.replace(block_address, geo->pagesPerBlock()) == 0 ? 0 : 1;
 }
 
 void LittleFS_SPINAND::deviceReset()
@@ -751,6 +1245,9 @@ void LittleFS_SPINAND::deviceReset()
     port->transfer(0xFF);
     digitalWrite(pin, HIGH);
     port->endTransaction();
+	pageInBuffer = UINT32_MAX;
+	dieSelected = 0xFF;
+	memset(pending, 0, sizeof(pending));  // reset aborts a program or erase in progress
   
   wait(500000);
 
@@ -766,14 +1263,12 @@ void LittleFS_SPINAND::deviceReset()
 
 bool LittleFS_SPINAND::lowLevelFormat(char progressChar, Print* pr)
 {
-	uint32_t eraseAddr;
 	bool val;
 	val = LittleFS::lowLevelFormat(progressChar, pr);
 	
-	for(uint16_t blocks = 0; blocks < reservedBBMBlocks; blocks++) {
-		eraseAddr = (config.block_count + blocks) * config.block_size;
-		eraseSector(eraseAddr);
-	}
+	// the reserved blocks hold the bad block table and its spares
+	settleProg();
+	if (bbm.eraseSpares() < 0) val = false;
 	
 	return val;
 }
@@ -948,6 +1443,7 @@ bool LittleFS_QPINAND::begin() {
 	const struct chipinfo *info = chip_lookup(buf+1);
 	if (!info) return false;
 	hwinfo = info;
+	geo = &info->geometry;
 	//Serial.printf("Flash size is %.2f Mbyte\n", (float)info->chipsize / 1048576.0f);
 	
 	// configure FlexSPI2 for chip's size
@@ -980,12 +1476,29 @@ bool LittleFS_QPINAND::begin() {
 	config.sync = &static_sync;
 	config.read_size = info->progsize;
 	config.prog_size = info->progsize;
+	if (subPageProgram) {
+		// each ECC sector of a page is programmed on its own, so small
+		// commits don't use a whole page.  littlefs programs each one
+		// once, keeping within the chip's partial program limit.
+		config.read_size = geo->subPageSize();
+		config.prog_size = geo->subPageSize();
+	}
 	config.block_size = info->erasesize;
 	config.block_count = info->chipsize / info->erasesize;
+	if (deviceID != W25M02) dieInterleave = false;
+	if (dieInterleave) {
+		// each littlefs block is a block on each die, see locate().
+		// Die 1's reserved blocks leave as many on die 0 unpaired.
+		config.block_size *= 2;
+		config.block_count -= geo->blocks() / 2;
+	}
 	config.block_cycles = 400;
 	config.cache_size = info->progsize;
 	config.lookahead_size = info->progsize;
 	config.name_max = LFS_NAME_MAX;
+	if (!tuneConfig(config.block_size)) return false; // RAM budget too small
+	hookCallbacks(); // track which blocks are erased
+	reportsBadBlocks = true;
 	configured = true;
 	
   // cmd index 8 = read Status register
@@ -1026,6 +1539,20 @@ bool LittleFS_QPINAND::begin() {
   //writeStatusRegister(0xB0, (1 << 3));
   writeStatusRegister(0xB0, (1 << 4) | (1 << 3));
   readStatusRegister(0xB0, false);
+
+	bbmOps.context = this;
+	bbmOps.read = &bbm_read;
+	bbmOps.prog = &bbm_prog;
+	bbmOps.erase = &bbm_erase;
+	bbmOps.markedBad = &bbm_markedBad;
+	// the blocks above chipsize are the bad block spare area
+	const uint32_t chipBlocks = info->chipsize / info->erasesize;
+	if (!bbm.begin(&bbmOps, chipBlocks, geo->blocks() - chipBlocks,
+	  geo->blockSize(), geo->pageSize())) {
+		//Serial.println("bad block table failed");
+		configured = false;
+		return false;
+	}
   
 	//Serial.println("attempting to mount existing media");
 	if (lfs_mount(&lfs, &config) < 0) {
@@ -1048,118 +1575,254 @@ bool LittleFS_QPINAND::begin() {
 
 int LittleFS_QPINAND::read(lfs_block_t block, lfs_off_t offset, void *buf, lfs_size_t size)
 {
-  const uint32_t address = block * config.block_size + offset;
-  uint32_t newTargetPage;
-  uint32_t targetPage = LINEAR_TO_PAGE(address);
-  uint8_t val;
-  
-  //Page Data Read - 0x13
-  FLEXSPI2_LUT48 = LUT0(CMD_SDR, PINS1, 0x13) | LUT1(ADDR_SDR, PINS1, 0x18);
-  
-  if(currentPageRead != targetPage){
-	//need to create LUT for W25M02 Die Select command, 
-	if(deviceID == W25M02) {
-		if(targetPage >= pagesPerDie ) {
-			targetPage -= pagesPerDie;
-			val = 1;
-		} else {
-			val = 0;
-		}
-		newTargetPage = targetPage;
-		
-		// die select 0xc2
-		FLEXSPI2_LUT44 = LUT0(CMD_SDR, PINS1, 0xC2) | LUT1(WRITE_SDR, PINS1, 1); 
-		flexspi2_ip_write(11, 0x00800000, &val, 1);
-	} else {
-		if(targetPage > pagesPerDie ) {
-			//targetPage -= sectorSize;
-			newTargetPage = (1 << 16) | ((uint8_t)targetPage >> 8) | ((uint8_t) targetPage);
-		} else {
-			newTargetPage = targetPage;
+	uint8_t *p = (uint8_t *)buf;
+	int err = 0;
+
+	while (size > 0) {
+		uint32_t chipBlock, chipOffset;
+		lfs_size_t len = locate(block, offset, chipBlock, chipOffset);
+		if (len > size) len = size;
+		// only the die being read waits, the other may keep programming
+		int r = settleProg(geo->die(blockAddress(bbm.map(chipBlock))));
+		if (r < 0 && r != LFS_ERR_CORRUPT) return r; // littlefs finds a failed program itself
+		const uint32_t corrected = correctedPages;
+		r = readPhysical(bbm.map(chipBlock), chipOffset, p, len);
+		if (correctedPages != corrected) eccCorrected(block, correctedPages - corrected);
+		if (r == LFS_ERR_CORRUPT) {
+			bbm.retire(chipBlock); // replace it when littlefs erases it
+			err = r;
+		} else if (r < 0) {
+			return r;
 		}
+		offset += len;
+		p += len;
+		size -= len;
 	}
-	
-	
-    flexspi2_ip_command(12, 0x00800000 + newTargetPage);   // Page data read Lut
-	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-	wait(progtime);
+	return err;
+}
 
-    currentPageRead = targetPage;
+int LittleFS_QPINAND::readPhysical(uint32_t block, uint32_t offset, void *buf, uint32_t size)
+{
+  uint32_t address = blockAddress(block) + offset;
+  int r = finishProg(geo->die(address));
+  if (r < 0) return r;
+  uint8_t *p = (uint8_t *)buf;
+  bool uncorrectable = false;
+  
+  while (size > 0) {
+   // the chip's data buffer holds one page, larger reads take several
+   const uint32_t page = geo->page(address);
+   uint16_t column = geo->column(address);
+   lfs_size_t len = geo->pageSize() - column;
+   if (len > size) len = size;
+
+   if (column == 0 && size > geo->pageSize() && pageInBuffer != page) {
+	// several whole pages, stream them in continuous read mode
+	int n = readContinuous(address, p, size);
+	if (n < 0) return LFS_ERR_IO;
+	if (n > 0) {
+		address += n;
+		p += n;
+		size -= n;
+		continue;
+	}
+	// ECC reported a problem, read them again one page at a time
+   }
+
+   bool pageBad = false;
+   if (pageInBuffer == page) {
+	// the other die may have been selected since
+	if (deviceID == W25M02) selectDie(geo->die(address));
+   } else {
+	//Page Data Read - 0x13
+	FLEXSPI2_LUT48 = LUT0(CMD_SDR, PINS1, 0x13) | LUT1(ADDR_SDR, PINS1, 0x18);
+	const uint32_t targetPage = rowAddress(address);  // selects the W25M02 die
+    flexspi2_ip_command(12, 0x00800000 + targetPage);   // Page data read Lut
+	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
+	if (wait(progtime) < 0) {
+		pageInBuffer = UINT32_MAX;
+		return LFS_ERR_IO;
+	}
+    pageInBuffer = page;
+
+    // Check ECC, the status is from the most recent page load
+    uint8_t statReg = readStatusRegister(0xC0, false);
+    uint8_t eccCode = eccStatus(statReg);
+
+    switch (eccCode) {
+      case ECC_OK: // Successful read, no ECC correction
+        break;
+      case ECC_CORRECTED: // Successful read with ECC correction
+        //Serial.printf("Successful read with ECC correction (addr, code): %x, %x\n", addr, eccCode);
+        correctedPages++;  // counted toward scrubbing
+        break;
+      case ECC_UNCORRECTABLE: // Uncorrectable ECC in a single page
+        //Serial.printf("Uncorrectable ECC in a single page (addr, code): %x, %x\n", address, eccCode);
+      case ECC_UNCORRECTABLE_MULTI: // Uncorrectable ECC in multiple pages
+        //Serial.printf("Uncorrectable ECC in a single page (addr, code): %x, %x\n", address, eccCode);
+	    pageBad = true;
+	    break;
+    }
+   }
+
+   flexspi2_ip_read(14, 0x00800000 + column, p, len);
+   if (pageBad) {
+	uncorrectable = true;
+	pageInBuffer = UINT32_MAX; // check ECC again if read again
+   }
+   address += len;
+   p += len;
+   size -= len;
   }
 
-  uint16_t column = LINEAR_TO_COLUMN(address);
-  flexspi2_ip_read(14, 0x00800000 + column, buf, size);
-  
+	//Serial.print("Read: "); printtbuf(buf, 40);
+	return uncorrectable ? LFS_ERR_CORRUPT : 0;
+}
 
-  
-  //printtbuf(buf, 20);
+// Continuous read mode (BUF = 0), see LittleFS_SPINAND::readContinuous
+int LittleFS_QPINAND::readContinuous(uint32_t address, uint8_t *buf, uint32_t size)
+{
+	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
 
-  // Check ECC
-  uint8_t statReg = readStatusRegister(0xC0, false);
-  uint8_t eccCode = (((statReg) & ((1 << 5)|(1 << 4))) >> 4);
-
-
-  switch (eccCode) {
-    case 0: // Successful read, no ECC correction
-      break;
-    case 1: // Successful read with ECC correction
-      //Serial.printf("Successful read with ECC correction (addr, code): %x, %x\n", addr, eccCode);
-    case 2: // Uncorrectable ECC in a single page
-      //Serial.printf("Uncorrectable ECC in a single page (addr, code): %x, %x\n", address, eccCode);
-    case 3: // Uncorrectable ECC in multiple pages
-      //Serial.printf("Uncorrectable ECC in a single page (addr, code): %x, %x\n", address, eccCode);
-	  addBBLUT(LINEAR_TO_BLOCK(address));
-	  //deviceReset();
-	  break;
+	// continuous read does not cross to the other die
+	const uint32_t max = geo->dieSize() - (address & (geo->dieSize() - 1));
+	if (size > max) size = max;
+	const uint32_t maxsize = 0xFFFF & ~(geo->pageSize() - 1);  // IP command data size limit
+	if (size > maxsize) size = maxsize;
+	if (size <= geo->pageSize()) return 0;
+
+	// BUF is per die, select it before changing the read mode
+	const uint32_t targetPage = rowAddress(address);
+	writeStatusRegister(0xB0, (1 << 4));  // ECC enabled, BUF = 0
+
+	//Page Data Read - 0x13
+	FLEXSPI2_LUT48 = LUT0(CMD_SDR, PINS1, 0x13) | LUT1(ADDR_SDR, PINS1, 0x18);
+	flexspi2_ip_command(12, 0x00800000 + targetPage);
+	int r = wait(progtime);
+	if (r == 0) {
+		// the column address bits are dummy in continuous mode
+		flexspi2_ip_read(14, 0x00800000, buf, size);
+		r = wait(progtime);  // the chip may still be loading the next page
+	}
+	writeStatusRegister(0xB0, (1 << 4) | (1 << 3));  // back to buffered read
+	pageInBuffer = UINT32_MAX;  // holds whatever page followed
+	if (r < 0) return LFS_ERR_IO;
 
-  }
+	// ECC status covers every page of the continuous read
+	uint8_t statReg = readStatusRegister(0xC0, false);
+	if (eccStatus(statReg) != ECC_OK) return 0;
+	return size;
+}
 
-	//Serial.print("Read: "); printtbuf(buf, 40);
+int LittleFS_QPINAND::prog(lfs_block_t block, lfs_off_t offset, const void *buf, lfs_size_t size)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+
+	while (size > 0) {
+		// Program Execute writes one page, larger caches take several
+		uint32_t chipBlock, chipOffset;
+		locate(block, offset, chipBlock, chipOffset);
+		lfs_size_t len = geo->pageSize() - geo->column(offset);
+		if (len > size) len = size;
+		int r = settleProg(geo->die(blockAddress(bbm.map(chipBlock)))); // may move the block to a spare
+		if (r < 0) return r;
+		const uint32_t physical = bbm.map(chipBlock);
+		const uint32_t address = blockAddress(physical) + chipOffset;
+		// the first page carries the block's erase count
+		r = progPage(address, p, len, chipOffset == 0 ? eraseCount(block) : 0);
+		if (r < 0) return r;
+		// pages to keep if it fails, with this one when sub-page
+		// programs have already written the start of it
+		pending[geo->die(address)].block = physical;
+		pending[geo->die(address)].page = geo->page(chipOffset) + (geo->column(chipOffset) ? 1 : 0);
+		offset += len;
+		p += len;
+		size -= len;
+	}
 	return 0;
 }
 
-int LittleFS_QPINAND::prog(lfs_block_t block, lfs_off_t offset, const void *buf, lfs_size_t size)
+// Used by bad block management, waits for each page
+int LittleFS_QPINAND::progPhysical(uint32_t block, uint32_t offset, const void *buf, uint32_t size)
 {
-	const uint32_t address = block * config.block_size + offset;
-	uint32_t newTargetPage;
-	uint8_t val;
-	
-	uint32_t pageAddress = LINEAR_TO_PAGE(address);
-	uint16_t columnAddress = LINEAR_TO_COLUMN(address);
-	
-		
-	//need to create LUT for W25M02 Die Select command, 
-	if(deviceID == W25M02) {
-		if(pageAddress > pagesPerDie ) {
-			pageAddress -= pagesPerDie;
-			val = 1;
-		} else {
-			val = 0;
+	uint32_t address = blockAddress(block) + offset;
+	const uint8_t *p = (const uint8_t *)buf;
+
+	while (size > 0) {
+		lfs_size_t len = geo->pageSize() - geo->column(address);
+		if (len > size) len = size;
+		int r = progPage(address, p, len);
+		if (r == 0) r = finishProg(geo->die(address));
+		if (r < 0) return r;
+		address += len;
+		p += len;
+		size -= len;
+	}
+	return 0;
+}
+
+// Program Execute and Block Erase return without waiting, see
+// LittleFS_SPINAND::finishProg
+int LittleFS_QPINAND::finishProg(int die)
+{
+	const struct chipinfo *info = (const struct chipinfo *)hwinfo;
+	int r = 0;
+	for (uint8_t d = 0; d < 2; d++) {
+		pending_t &p = pending[d];
+		if (!p.op || (die >= 0 && d != die)) continue;
+		if (deviceID == W25M02) selectDie(d);
+		const bool erasing = (p.op == PENDING_ERASE);
+		p.op = 0;
+		if (wait(erasing ? info->erasetime : info->progtime) < 0) return LFS_ERR_IO;
+		uint8_t status = readStatusRegister(0xC0, false);
+		if (status & (erasing ? (1 << 2) : (1 << 3))) {  // E-FAIL, P-FAIL
+			p.failed = true;
+			r = LFS_ERR_CORRUPT;
 		}
-		newTargetPage = pageAddress;
-
-		// die select 0xc2
-		FLEXSPI2_LUT44 = LUT0(CMD_SDR, PINS1, 0xC2) | LUT1(WRITE_SDR, PINS1, 1); 
-		flexspi2_ip_write(11, 0x00800000, &val, 1);
-		const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-		wait(progtime);
-	} else {
-		if(pageAddress > pagesPerDie ) {
-			//targetPage -= sectorSize;
-			newTargetPage = (1 << 16) | ((uint8_t)pageAddress >> 8) | ((uint8_t) pageAddress);
-		} else {
-			newTargetPage = pageAddress;
+	}
+	return r;
+}
+
+// finishProg() plus bad block replacement, see LittleFS_SPINAND::settleProg
+int LittleFS_QPINAND::settleProg(int die)
+{
+	int r = finishProg(die);
+	if (pending[0].failed || pending[1].failed) {
+		finishProg();  // the copy may use either die
+		for (uint8_t d = 0; d < 2; d++) {
+			pending_t &p = pending[d];
+			if (!p.failed) continue;
+			p.failed = false;
+			if (p.block != UINT32_MAX) bbm.progFailed(p.block, p.page);
 		}
 	}
+	return r;
+}
+
+int LittleFS_QPINAND::progPage(uint32_t address, const void *buf, lfs_size_t size, uint32_t eraseCount)
+{
+	const uint8_t d = geo->die(address);
+	int r = finishProg(d);  // the die's data buffer is busy until then
+	if (r < 0) return r;
+
+	uint32_t newTargetPage = rowAddress(address);  // selects the W25M02 die
+	uint16_t columnAddress = geo->column(address);
 		
 	writeEnable();   //sets the WEL in Status Reg to 1 (bit 2)
+	pageInBuffer = UINT32_MAX;  // program data load replaces the data buffer
 
 	//Program Data Load - 0x32
 	FLEXSPI2_LUT52 = LUT0(CMD_SDR, PINS1, 0x32) | LUT1(CADDR_SDR, PINS1, 0x10);
 	FLEXSPI2_LUT53 = LUT0(WRITE_SDR, PINS4, 1);
 	flexspi2_ip_write(13, 0x00800000 + columnAddress, buf, size);
-	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-	wait(progtime);
+
+	if (eraseCount && geo->tagColumn) {
+		// Quad Random Program Data Load - 0x34, keeps the data loaded above
+		uint8_t tag[TAG_SIZE];
+		packTag(eraseCount, tag);
+		FLEXSPI2_LUT52 = LUT0(CMD_SDR, PINS1, 0x34) | LUT1(CADDR_SDR, PINS1, 0x10);
+		flexspi2_ip_write(13, 0x00800000 + geo->pageSize() + geo->tagColumn, tag, TAG_SIZE);
+	}
 
 	//uint8_t status = readStatusRegister(0xC0, false );  //Status Register
 	//if ((status &  (1 << 3)) == 1)  //Status Program Fail
@@ -1170,27 +1833,89 @@ int LittleFS_QPINAND::prog(lfs_block_t block, lfs_off_t offset, const void *buf,
 	//cmd 15 - program execute - 0x10
 	flexspi2_ip_command(15, 0x00800000 + newTargetPage);	
 
-	return wait(progtime);
+	pending[d].op = PENDING_PROG;
+	pending[d].failed = false;
+	pending[d].page = 0;
+	pending[d].block = UINT32_MAX;  // prog() fills in the block
+	return 0;
 }
 
 int LittleFS_QPINAND::erase(lfs_block_t block)
-{	
-	const uint32_t addr = block * config.block_size;
-	
-	void *buffer = malloc(config.read_size);
-	if ( buffer != nullptr) {
-		if ( blockIsBlank(&config, block, buffer)) {
-			free(buffer);
-			return 0; // Already formatted exit no wait
+{
+	// No blank check, see LittleFS_SPINAND::erase
+	for (uint32_t i = 0; i < (dieInterleave ? 2u : 1u); i++) {
+		uint32_t chipBlock, chipOffset;
+		locate(block, i * geo->pageSize(), chipBlock, chipOffset);
+		if (bbm.retiring(chipBlock)) {
+			int r = settleProg();
+			if (r < 0 && r != LFS_ERR_CORRUPT) return r;
+			r = bbm.replace(chipBlock, 0);
+			if (r == 0) continue;
+			if (r == LFS_ERR_IO) return r; // table not saved
 		}
-		free(buffer);
+		int r = settleProg(geo->die(blockAddress(bbm.map(chipBlock))));
+		if (r < 0 && r != LFS_ERR_CORRUPT) return r;
+
+		// a failure is found by the next finishProg
+		const uint32_t physical = bbm.map(chipBlock);
+		const uint32_t address = blockAddress(physical);
+		eraseSector(address);
+		pending_t &p = pending[geo->die(address)];
+		p.op = PENDING_ERASE;
+		p.failed = false;
+		p.page = 0;
+		p.block = physical;
 	}
-	
-	eraseSector(addr);
+	return 0;
+}
+
+int LittleFS_QPINAND::erasePhysical(uint32_t block)
+{
+	const uint32_t address = blockAddress(block);
+	int r = finishProg(geo->die(address));
+	if (r < 0) return r;
+	eraseSector(address);
 	const uint32_t erasetime = ((const struct chipinfo *)hwinfo)->erasetime;
-	wait(erasetime);
+	if (wait(erasetime) < 0) return LFS_ERR_IO;
+	uint8_t status = readStatusRegister(0xC0, false);
+	if (status & (1 << 2)) return LFS_ERR_CORRUPT;  // E-FAIL
 	return 0;
 }
+
+// Factory bad block mark, see LittleFS_SPINAND::markedBad
+bool LittleFS_QPINAND::markedBad(uint32_t block)
+{
+	uint8_t mark = 0xFF;
+	if (readSpare(block, 0, &mark, 1) == LFS_ERR_IO) return false;
+	return mark != 0xFF;
+}
+
+// Spare area of a chip block's first page, see LittleFS_SPINAND::readSpare
+int LittleFS_QPINAND::readSpare(uint32_t block, uint32_t column, void *buf, uint32_t size)
+{
+	uint8_t first;
+	finishProg();
+	pageInBuffer = UINT32_MAX;
+	// load the block's first page, the spare area follows its data
+	int r = readPhysical(block, 0, &first, 1);
+	if (r == LFS_ERR_IO) return r;
+	flexspi2_ip_read(14, 0x00800000 + geo->pageSize() + column, buf, size);
+	return r;
+}
+
+uint32_t LittleFS_QPINAND::storedEraseCount(lfs_block_t block)
+{
+	if (!geo->tagColumn) return 0; // not written on this chip
+	uint32_t count = 0;
+	for (uint32_t i = 0; i < (dieInterleave ? 2u : 1u); i++) {
+		uint32_t chipBlock, chipOffset, n;
+		uint8_t tag[TAG_SIZE];
+		locate(block, i * geo->pageSize(), chipBlock, chipOffset);
+		if (readSpare(bbm.map(chipBlock), geo->tagColumn, tag, TAG_SIZE) < 0) continue;
+		if (unpackTag(tag, n) && n > count) count = n;
+	}
+	return count;
+}
  
 
  
@@ -1256,9 +1981,6 @@ bool LittleFS_QPINAND::writeEnable()
   uint8_t status;
   FLEXSPI2_LUT44 = LUT0(CMD_SDR, PINS1, 0x06);  //Write enable 0x06
   flexspi2_ip_command(11, 0x00800000); //Write Enable
-  // Assume that we're about to do some writing, so the device is just about to become busy
-  const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-  wait(progtime);
   
   status = readStatusRegister(0xC0, false);
   return status & (0x02);
@@ -1271,39 +1993,10 @@ bool LittleFS_QPINAND::writeEnable()
 void LittleFS_QPINAND::eraseSector(uint32_t address)
 {
 
-
-
-  uint32_t pageAddr = LINEAR_TO_PAGE(address) ;
-  //if(pageAddr > sectorSize) pageAddr -= sectorSize;
-
-	uint32_t newTargetPage;
-	uint8_t val;
-	
-	//need to create LUT for W25M02 Die Select command, 
-	if(deviceID == W25M02) {
-		if(pageAddr > pagesPerDie ) {
-			pageAddr -= pagesPerDie;
-			val = 1;
-		} else {
-			val = 0;
-		}
-		newTargetPage = pageAddr;
-
-		// die select 0xc2
-		FLEXSPI2_LUT44 = LUT0(CMD_SDR, PINS1, 0xC2) | LUT1(WRITE_SDR, PINS1, 1); 
-		flexspi2_ip_write(11, 0, &val, 1);
-		const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-		wait(progtime);
-	} else {
-		if(pageAddr > pagesPerDie ) {
-			//targetPage -= sectorSize;
-			newTargetPage = (1 << 16) | ((uint8_t)pageAddr >> 8) | ((uint8_t) pageAddr);
-		} else {
-			newTargetPage = pageAddr;
-		}
-	}
+	uint32_t newTargetPage = rowAddress(address);  // selects the W25M02 die
 	
 	writeEnable();   //sets the WEL in Status Reg to 1 (bit 2)
+	pageInBuffer = UINT32_MAX;  // buffered page may be in this block
 	// cmd index 12, Block Erase 0xD8
 	FLEXSPI2_LUT48 = LUT0(CMD_SDR, PINS1, 0xD8) | LUT1(ADDR_SDR, PINS1, 0x18);
 	flexspi2_ip_command(12, 0x00800000 + newTargetPage);
@@ -1315,62 +2008,79 @@ void LittleFS_QPINAND::eraseSector(uint32_t address)
 }
 
 
-uint8_t LittleFS_QPINAND::readECC(uint32_t targetPage, uint8_t *buf, int size)
+// W25M02 dies each start at page 0, see LittleFS_SPINAND::rowAddress
+uint32_t LittleFS_QPINAND::rowAddress(uint32_t address)
+{
+	if (deviceID == W25M02) selectDie(geo->die(address));
+	return geo->row(address);
+}
+
+// Chip address of a block, see LittleFS_SPINAND::blockAddress
+uint32_t LittleFS_QPINAND::blockAddress(uint32_t block)
 {
+	if (dieInterleave && block < config.block_count * 2) {
+		block = ((block & 1) << geo->blockBits) | (block >> 1);
+	} else if (dieInterleave && block < config.block_count + (1ul << geo->blockBits)) {
+		block -= config.block_count;
+	}
+	return geo->blockAddress(block);
+}
 
-  uint16_t column = LINEAR_TO_COLUMNECC(targetPage*eccSize);
-  targetPage = LINEAR_TO_PAGEECC(targetPage*eccSize);
+// Chip block and offset holding a littlefs block's data, see
+// LittleFS_SPINAND::locate
+uint32_t LittleFS_QPINAND::locate(lfs_block_t block, lfs_off_t offset, uint32_t &chipBlock, uint32_t &chipOffset)
+{
+	if (!dieInterleave) {
+		chipBlock = block;
+		chipOffset = offset;
+		return config.block_size - offset;
+	}
+	const uint32_t page = geo->page(offset);
+	chipBlock = block * 2 + (page & 1);
+	chipOffset = geo->pageAddress(page >> 1) + geo->column(offset);
+	return geo->pageSize() - geo->column(offset);
+}
 
-  uint32_t newTargetPage;
-  uint8_t val;
+// Select Die 0xC2 is accepted while the other die is busy
+void LittleFS_QPINAND::selectDie(uint8_t die_select)
+{
+	if (die_select == dieSelected) return;
+	FLEXSPI2_LUT44 = LUT0(CMD_SDR, PINS1, 0xC2) | LUT1(WRITE_SDR, PINS1, 1);
+	flexspi2_ip_write(11, 0x00800000, &die_select, 1);
+	dieSelected = die_select;
+}
+
+uint8_t LittleFS_QPINAND::readECC(uint32_t targetPage, uint8_t *buf, int size)
+{
+  settleProg();
+
+  // PAGE_ECCSIZE includes the spare area, so is not a power of 2
+  uint16_t column = (targetPage * eccSize) % PAGE_ECCSIZE;
+  uint32_t newTargetPage = rowAddress(geo->pageAddress((targetPage * eccSize) / PAGE_ECCSIZE));  // selects the W25M02 die
   
   //Page Data Read - 0x13
   FLEXSPI2_LUT48 = LUT0(CMD_SDR, PINS1, 0x13) | LUT1(ADDR_SDR, PINS1, 0x18);
-  
-	//need to create LUT for W25M02 Die Select command, 
-	if(deviceID == W25M02) {
-		if(targetPage >= pagesPerDie ) {
-			targetPage -= pagesPerDie;
-			val = 1;
-		} else {
-			val = 0;
-		}
-		newTargetPage = targetPage;
-		
-		// die select 0xc2
-		FLEXSPI2_LUT44 = LUT0(CMD_SDR, PINS1, 0xC2) | LUT1(WRITE_SDR, PINS1, 1); 
-		flexspi2_ip_write(11, 0, &val, 1);
-	} else {
-		if(targetPage > pagesPerDie ) {
-			//targetPage -= sectorSize;
-			newTargetPage = (1 << 16) | ((uint8_t)targetPage >> 8) | ((uint8_t) targetPage);
-		} else {
-			newTargetPage = targetPage;
-		}
-	}
-	
 	
     flexspi2_ip_command(12, 0x00800000 + newTargetPage);   // Page data read Lut
 	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
 	wait(progtime);
-
-    currentPageRead = targetPage;
+    pageInBuffer = UINT32_MAX;
 
   flexspi2_ip_read(14, 0x00800000 + column, buf, size);
   
   // Check ECC
   uint8_t statReg = readStatusRegister(0xC0, false);
-  uint8_t eccCode = (((statReg) & ((1 << 5)|(1 << 4))) >> 4);
+  uint8_t eccCode = eccStatus(statReg);
   
 	  switch (eccCode) {
-	  case 0: // Successful read, no ECC correction
+	  case ECC_OK: // Successful read, no ECC correction
 		break;
-	  case 1: // Successful read with ECC correction
-	  case 2: // Uncorrectable ECC in a single page
-	  case 3: // Uncorrectable ECC in multiple pages
+	  case ECC_CORRECTED: // Successful read with ECC correction
+	  case ECC_UNCORRECTABLE: // Uncorrectable ECC in a single page
+	  case ECC_UNCORRECTABLE_MULTI: // Uncorrectable ECC in multiple pages
 		//addError(address, eccCode);
 		//Serial.printf("ECC Error (addr, code): %x, %x\n", address, eccCode);
-	  //addBBLUT(LINEAR_TO_BLOCK(targetPage*eccSize));
+	  //addBBLUT(geo->block(geo->pageAddress(newTargetPage)));
 		//deviceReset();
 		break;
 	}
@@ -1381,108 +2091,29 @@ uint8_t LittleFS_QPINAND::readECC(uint32_t targetPage, uint8_t *buf, int size)
 
 void LittleFS_QPINAND::readBBLUT(uint16_t *LBA, uint16_t *PBA, uint8_t *linkStatus)
 {
+	finishProg();
     //uint16_t LBA, PBA;
     //uint16_t linkStatus[20];
     //uint16_t openEntries = 0;
 	//BBLUT_TABLE_ENTRY_COUNT     20
 	//BBLUT_TABLE_ENTRY_SIZE      4  // in bytes
 	
-    uint8_t data[20 * 4];
+    uint8_t data[BBLUT_ENTRIES * 4];
 
     FLEXSPI2_LUT40 = LUT0(CMD_SDR, PINS1, 0xA5) | LUT1(DUMMY_SDR, 8, 1);  //Read BBM_LUT 0xA5
     FLEXSPI2_LUT41 = LUT0(READ_SDR, PINS1, 1);
     flexspi2_ip_read(10, 0x00800000, data, sizeof(data));
 
 
-	//See page 33 of the reference manual for W25N01G
-    //Serial.println("Status of the links");
-    for(int i = 0, offset = 0 ; i < 20 ; i++, offset += 4) {
-      LBA[i] = data[offset+ 0] << 8 | data[offset+ 1];
-      PBA[i] =  data[offset+ 2] << 8 | data[offset+ 3]; 
-      
-	  if (LBA[i] == 0x0000) {
-		linkStatus[i] = 0;
-        //openEntries++;
-      } else  {
-        //Serial.printf("\tEntry: %d: Logical BA - %d, Physical BA - %d\n", i, LBA[i], PBA[i]);
-        linkStatus[i] = (uint8_t) (LBA[i] >> 14);
-        //if(linkStatus[i] == 3) Serial.println("\t    This link is enabled and its a Valid Link!");
-        //if(linkStatus[i] == 4) Serial.println("\t    This link was enabled but its not valid any more!");
-        //if(linkStatus[i] == 1) Serial.println("\t    Not Applicable!");
-      }
-	  
-    }
-    //Serial.printf("OpenEntries: %d\n", openEntries);
+	parseBBLUT(data, LBA, PBA, linkStatus);
 }
 
+// Replace a block with a spare from the reserved area, keeping its data.
+// Returns 0 on success, 1 when no spare block is left.
 uint8_t LittleFS_QPINAND::addBBLUT(uint32_t block_address)
 {
-  if(deviceID == W25N01) {
-	//check BBLUT FULL
-	uint8_t lutFull = 0;
-	lutFull = readStatusRegister(0xC0, false);
-	
-	if(lutFull & (1 << 6)) {
-		Serial.printf("Lut Full!!!!");
-		exit(1);
-	}
-	
-	//Read BBLUT
-	uint16_t LBA[20], PBA[20], openEntries = 0;
-	uint8_t  LUT_STATUS[20];
-	uint8_t firstOpenEntry = 0;
-	
-	readBBLUT(LBA, PBA, LUT_STATUS);
-	
-	Serial.println("Status of the links");
-	for(uint16_t i = 0; i < 20; i++){
-		if(LUT_STATUS[i] > 0) {
-			Serial.printf("\tEntry: %d: Logical BA - %d, Physical BA - %d\n", i, LBA[i], PBA[i]);
-			LUT_STATUS[i] = (uint8_t) (LBA[i] >> 14);
-			if(LUT_STATUS[i] == 3) Serial.println("\t    This link is enabled and its a Valid Link!");
-			if(LUT_STATUS[i] == 4) Serial.println("\t    This link was enabled but its not valid any more!");
-			if(LUT_STATUS[i] == 1) Serial.println("\t    Not Applicable!");
-		} else {
-			openEntries++;
-		}
-	} Serial.printf("OpenEntries: %d\n", openEntries);
-	
-	
-	//Need to determine if the address is already in the list and what the first open entry is.
-	for(uint16_t i = 0; i < 20; i++){
-		if(LUT_STATUS[i] > 0) {
-			if(LBA[i] == block_address) {
-				Serial.printf("Address: %d, already in BBLUT!\n", block_address);
-				return 0;
-			}
-		}
-	}
-	
-	firstOpenEntry = 20 - openEntries;	
-	Serial.printf("First Open Entry: %d\n", firstOpenEntry);
-	
-	//Write BBLUT with next sequential block
-	uint16_t pba, lba;
-	pba = block_address;
-	const uint32_t blocksize = ((const struct chipinfo *)hwinfo)->erasesize;
-	const uint32_t chipsize = ((const struct chipinfo *)hwinfo)->chipsize;
-	//lba = LINEAR_TO_BLOCK((firstOpenEntry+1)*config.block_size);
-	lba = LINEAR_TO_BLOCK((firstOpenEntry+1)*blocksize + chipsize);
-	Serial.printf("PBA: %d, LBA: %d\n", pba, lba);
-	#ifdef LATER	
-	uint8_t cmd[4];
-	cmd[0] = pba >> 8;
-	cmd[1] = pba;
-	cmd[2] = lba >> 8;
-	cmd[3] = lba;
-	
-   //FLEXSPI2_LUT44 = LUT0(CMD_SDR, PINS1, 0xA1) | LUT0(WRITE_SDR, PINS1, 1);  
-   //flexspi2_ip_write(8, 0, cmd, 4);
-	#endif	
-	const uint32_t progtime = ((const struct chipinfo *)hwinfo)->progtime;
-	wait(progtime);
-  }
-	return 0;
+	settleProg();
+	return bbm.replace(block_address, geo->pagesPerBlock()) == 0 ? 0 : 1;
 }
 
 void LittleFS_QPINAND::deviceReset()
@@ -1490,6 +2121,9 @@ void LittleFS_QPINAND::deviceReset()
   //cmd index 9 - WG reset, see function deviceReset()
   FLEXSPI2_LUT36 = LUT0(CMD_SDR, PINS1, 0xFF);
   flexspi2_ip_command(9, 0x00800000); //reset
+  pageInBuffer = UINT32_MAX;
+  dieSelected = 0xFF;
+  memset(pending, 0, sizeof(pending));  // reset aborts a program or erase in progress
 
   wait(500000);
 
@@ -1505,14 +2139,12 @@ void LittleFS_QPINAND::deviceReset()
 
 bool LittleFS_QPINAND::lowLevelFormat(char progressChar)
 {
-	uint32_t eraseAddr;
 	bool val;
 	val = LittleFS::lowLevelFormat(progressChar);
 	
-	for(uint16_t blocks = 0; blocks < reservedBBMBlocks; blocks++) {
-		eraseAddr = (config.block_count + blocks) * config.block_size;
-		eraseSector(eraseAddr);
-	}
+	// the reserved blocks hold the bad block table and its spares
+	settleProg();
+	if (bbm.eraseSpares() < 0) val = false;
 	
 	return val;
 }
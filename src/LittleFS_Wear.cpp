@@ -0,0 +1,464 @@
+/* LittleFS for Teensy
+ * Copyright (c) 2020, Paul Stoffregen, paul@pjrc.com
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice, development funding notice, and this permission
+ * notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <Arduino.h>
+#include <LittleFS.h>
+
+// Erase counts are saved in this file, a small header followed by one
+// uint32_t per block.  The file is only rewritten by saveWearStats(), so
+// erases since the last save are lost at power down.
+#define WEAR_STATS_FILE   "/.wearstats"
+#define WEAR_STATS_MAGIC  0x52414557  // "WEAR"
+
+// Static wear leveling copies a cold file to this temporary name, using the
+// most worn free blocks, then renames it over the original.
+#define WEAR_MOVE_FILE    "/.wearmove"
+#define WEAR_MOVE_DEPTH   8	// deepest directory nesting searched
+
+enum { WEAR_IDLE = 0, WEAR_SCAN, WEAR_COPY };
+
+struct LittleFSWearMove {
+	uint32_t threshold;	// erase count spread which starts a move
+	uint32_t checkAt;	// eraseTotal when the spread is next checked
+	uint32_t coldLimit;	// files averaging at most this many erases move
+	uint8_t phase;
+	uint8_t depth;
+	bool scrub;		// moving files off blocks needing ECC correction
+	lfs_off_t offset[WEAR_MOVE_DEPTH];
+	char path[128];		// directory while scanning, file while copying
+	lfs_dir_t dir;
+	lfs_file_t src;
+	lfs_file_t dst;
+};
+
+FLASHMEM
+bool LittleFS::enableWearStats(bool preferLeastWorn)
+{
+	if (!mounted) return false;
+	if (!eraseCounts) {
+		const lfs_size_t len = config.block_count * sizeof(uint32_t);
+		eraseCounts = (uint32_t *)malloc(len);
+		if (!eraseCounts) return false;
+		memset(eraseCounts, 0, len);
+		lfs_file_t file;
+		if (lfs_file_open(&lfs, &file, WEAR_STATS_FILE, LFS_O_RDONLY) >= 0) {
+			uint32_t header[2];
+			if (lfs_file_read(&lfs, &file, header, sizeof(header)) == sizeof(header)
+			  && header[0] == WEAR_STATS_MAGIC && header[1] == config.block_count) {
+				if (lfs_file_read(&lfs, &file, eraseCounts, len) != (lfs_ssize_t)len) {
+					memset(eraseCounts, 0, len); // damaged, start over
+				}
+			}
+			lfs_file_close(&lfs, &file);
+		}
+		// erases since the last saveWearStats(), if the media keeps counts
+		for (lfs_block_t block=0; block < config.block_count; block++) {
+			const uint32_t n = storedEraseCount(block);
+			if (n > eraseCounts[block]) eraseCounts[block] = n;
+		}
+		eraseUnsaved = 0;
+		eraseTotal = 0;
+		hookCallbacks();
+	}
+	config.wear = preferLeastWorn ? &static_wear : nullptr;
+	return true;
+}
+
+FLASHMEM
+bool LittleFS::saveWearStats()
+{
+	if (!mounted || !eraseCounts) return false;
+	lfs_file_t file;
+	if (lfs_file_open(&lfs, &file, WEAR_STATS_FILE,
+	  LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) < 0) return false;
+	const uint32_t header[2] = {WEAR_STATS_MAGIC, config.block_count};
+	const lfs_size_t len = config.block_count * sizeof(uint32_t);
+	eraseUnsaved = 0;
+	bool ok = lfs_file_write(&lfs, &file, header, sizeof(header)) == sizeof(header)
+	  && lfs_file_write(&lfs, &file, eraseCounts, len) == (lfs_ssize_t)len;
+	if (lfs_file_close(&lfs, &file) < 0) ok = false;
+	return ok;
+}
+
+// Fill in stats and, optionally, a histogram of bins evenly spaced from the
+// least to the most erased block.
+FLASHMEM
+bool LittleFS::getWearStats(LittleFSWearStats &stats, uint32_t *histogram, unsigned int bins)
+{
+	if (!eraseCounts) return false;
+	const lfs_block_t count = config.block_count;
+	uint32_t lo = UINT32_MAX, hi = 0;
+	uint64_t total = 0;
+	for (lfs_block_t block=0; block < count; block++) {
+		const uint32_t n = eraseCounts[block];
+		if (n < lo) lo = n;
+		if (n > hi) hi = n;
+		total += n;
+	}
+	stats.blocks = count;
+	stats.minErase = lo;
+	stats.maxErase = hi;
+	stats.totalErase = total;
+	stats.meanErase = (float)total / (float)count;
+	stats.totalCorrected = eccTotal;
+	stats.scrubPending = 0;
+	stats.scrubbed = scrubMoves;
+	if (eccCounts) {
+		for (lfs_block_t block=0; block < count; block++) {
+			if (eccCounts[block] >= scrubThreshold) stats.scrubPending++;
+		}
+	}
+	if (histogram && bins > 0) {
+		memset(histogram, 0, bins * sizeof(uint32_t));
+		const uint64_t range = (uint64_t)hi - lo + 1;
+		for (lfs_block_t block=0; block < count; block++) {
+			histogram[(uint64_t)(eraseCounts[block] - lo) * bins / range]++;
+		}
+	}
+	return true;
+}
+
+uint32_t LittleFS::static_wear(const struct lfs_config *c, lfs_block_t block)
+{
+	const LittleFS *fs = ((const LittleFSConfig *)c)->fs;
+	const uint32_t n = fs->eraseCounts[block];
+	return fs->wearInvert ? ~n : n;
+}
+
+// Close a file used by maintenance.  Once unmounted the filesystem may be
+// gone, so only the cache buffer lfs_file_close() would free is freed.
+static void maintenance_close(lfs_t *lfs, lfs_file_t *file, bool mounted)
+{
+	if (mounted) {
+		lfs_file_close(lfs, file);
+	} else {
+		lfs_free(file->cache.buffer);
+	}
+}
+
+// Forget work in progress when the media is formatted.  Call while still
+// mounted, so the journal and wear leveling files are properly closed.
+// The user's open files and directories aren't touched.
+void LittleFS::maintenanceReset()
+{
+	if (wearMove) {
+		if (wearMove->phase == WEAR_COPY) {
+			maintenance_close(&lfs, &wearMove->dst, mounted);
+			maintenance_close(&lfs, &wearMove->src, mounted);
+		} else if (wearMove->phase == WEAR_SCAN && mounted) {
+			lfs_dir_close(&lfs, &wearMove->dir);
+		}
+		wearMove->phase = WEAR_IDLE;
+		wearMove->checkAt = eraseTotal;
+	}
+	usedValid = false;
+	mediaWritten = true;
+	if (eccCounts) memset(eccCounts, 0, config.block_count * sizeof(uint16_t));
+	scrubQueued = 0;
+	if (journal) {
+		maintenance_close(&lfs, journal, mounted);
+		free(journal);
+		journal = nullptr;
+	}
+}
+
+FLASHMEM
+bool LittleFS::enableStaticWearLeveling(uint32_t threshold)
+{
+	if (!mounted) return false;
+	if (threshold == 0) {
+		if (wearMove) {
+			wearMove->threshold = 0;
+			if (!eccCounts) wearMoveFree(); // scrubbing uses it too
+		}
+		return true;
+	}
+	if (!eraseCounts && !enableWearStats()) return false;
+	if (!wearMoveAlloc()) return false;
+	wearMove->threshold = threshold;
+	wearMove->checkAt = eraseTotal;
+	return true;
+}
+
+// NAND ECC corrects a few bit errors per page, and reports when it had
+// to.  Blocks which keep needing correction are rewritten, by moving the
+// files using them, before their errors grow past what ECC can fix.  The
+// counts are in RAM only and restart from zero at each begin().
+FLASHMEM
+bool LittleFS::enableScrub(uint32_t threshold)
+{
+	if (!mounted) return false;
+	if (threshold == 0) {
+		free(eccCounts);
+		eccCounts = nullptr;
+		scrubQueued = 0;
+		if (wearMove && wearMove->threshold == 0) wearMoveFree();
+		return true;
+	}
+	if (!eraseCounts && !enableWearStats()) return false;
+	if (!wearMoveAlloc()) return false;
+	if (!eccCounts) {
+		eccCounts = (uint16_t *)malloc(config.block_count * sizeof(uint16_t));
+		if (!eccCounts) return false;
+		memset(eccCounts, 0, config.block_count * sizeof(uint16_t));
+		eccTotal = 0;
+		scrubMoves = 0;
+		scrubQueued = 0;
+	}
+	scrubThreshold = (threshold < 0xFFFF) ? threshold : 0xFFFF;
+	return true;
+}
+
+void LittleFS::eccCorrected(lfs_block_t block, uint32_t pages)
+{
+	if (!eccCounts || block >= config.block_count) return;
+	eccTotal += pages;
+	const uint32_t n = eccCounts[block];
+	if (n < scrubThreshold && n + pages >= scrubThreshold) scrubQueued++;
+	eccCounts[block] = (n + pages < 0xFFFF) ? n + pages : 0xFFFF;
+}
+
+FLASHMEM
+bool LittleFS::wearMoveAlloc()
+{
+	if (wearMove) return true;
+	wearMove = (LittleFSWearMove *)malloc(sizeof(LittleFSWearMove));
+	if (!wearMove) return false;
+	memset(wearMove, 0, sizeof(LittleFSWearMove));
+	lfs_remove(&lfs, WEAR_MOVE_FILE); // left over if power was lost mid-move
+	return true;
+}
+
+FLASHMEM
+void LittleFS::wearMoveFree()
+{
+	if (wearMove->phase == WEAR_COPY) wearMoveFinish(false);
+	if (wearMove->phase == WEAR_SCAN) lfs_dir_close(&lfs, &wearMove->dir);
+	free(wearMove);
+	wearMove = nullptr;
+}
+
+struct wearSum {
+	const uint32_t *counts;
+	uint32_t erases;
+	uint32_t blocks;
+	const uint16_t *ecc;	// when scrubbing
+	uint16_t eccLimit;
+	uint32_t weak;		// blocks at eccLimit
+};
+
+static int cb_sumWear(void *data, lfs_block_t block)
+{
+	struct wearSum *sum = (struct wearSum *)data;
+	sum->erases += sum->counts[block];
+	sum->blocks++;
+	if (sum->ecc && sum->ecc[block] >= sum->eccLimit) sum->weak++;
+	return 0;
+}
+
+// Open a file found by the directory scan and, if its blocks are cold,
+// start copying it.  w->path already holds the file's full name.
+FLASHMEM
+bool LittleFS::wearMoveStart(struct lfs_info *info)
+{
+	LittleFSWearMove *w = wearMove;
+	if (strcmp(w->path, WEAR_STATS_FILE) == 0 || strcmp(w->path, WEAR_MOVE_FILE) == 0) {
+		return false;
+	}
+	if (lfs_file_open(&lfs, &w->src, w->path, LFS_O_RDONLY) < 0) return false;
+	struct wearSum sum = {eraseCounts, 0, 0, w->scrub ? eccCounts : nullptr, scrubThreshold, 0};
+	int err = lfs_file_traverse(&lfs, &w->src, cb_sumWear, &sum);
+	// inline files have no blocks of their own to move
+	if (err < 0 || sum.blocks == 0
+	  || (w->scrub ? sum.weak == 0 : sum.erases / sum.blocks > w->coldLimit)) {
+		lfs_file_close(&lfs, &w->src);
+		return false;
+	}
+	if (lfs_file_open(&lfs, &w->dst, WEAR_MOVE_FILE,
+	  LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) < 0) {
+		lfs_file_close(&lfs, &w->src);
+		return false;
+	}
+	//Serial.printf("wear move %s, %u blocks\n", w->path, sum.blocks);
+	w->phase = WEAR_COPY;
+	return true;
+}
+
+// Complete or abandon the copy.  The copy only replaces the original if
+// nothing else changed or opened the original while the copy was made.
+FLASHMEM
+void LittleFS::wearMoveFinish(bool ok)
+{
+	LittleFSWearMove *w = wearMove;
+	if (lfs_file_close(&lfs, &w->dst) < 0) ok = false;
+	if (ok) {
+		for (lfs_t::lfs_mlist *m = lfs.mlist; m; m = m->next) {
+			if (m != (lfs_t::lfs_mlist *)&w->src && m->type == LFS_TYPE_REG
+			  && m->id == w->src.id && m->m.pair[0] == w->src.m.pair[0]
+			  && m->m.pair[1] == w->src.m.pair[1]) {
+				ok = false;
+			}
+		}
+	}
+	if (ok) {
+		lfs_file_t now;
+		if (lfs_file_open(&lfs, &now, w->path, LFS_O_RDONLY) < 0) {
+			ok = false;
+		} else {
+			if (now.ctz.head != w->src.ctz.head || now.ctz.size != w->src.ctz.size) ok = false;
+			lfs_file_close(&lfs, &now);
+		}
+	}
+	lfs_file_close(&lfs, &w->src);
+	if (ok) {
+		// every attribute goes with the copy, not only the 'c' and 'm'
+		// file times, as littlefs has no way to list them
+		uint8_t *attr = (uint8_t *)malloc(lfs.attr_max);
+		if (!attr) ok = false;
+		for (unsigned int type = 0; ok && type < 256; type++) {
+			lfs_ssize_t n = lfs_getattr(&lfs, w->path, type, attr, lfs.attr_max);
+			if (n == LFS_ERR_NOATTR) continue;
+			if (n < 0 || lfs_setattr(&lfs, WEAR_MOVE_FILE, type, attr, n) < 0) ok = false;
+		}
+		free(attr);
+		if (ok && lfs_rename(&lfs, WEAR_MOVE_FILE, w->path) < 0) ok = false;
+	}
+	if (!ok) lfs_remove(&lfs, WEAR_MOVE_FILE);
+	w->phase = WEAR_IDLE;
+	if (w->scrub) {
+		// look again for other files on weak blocks
+		if (ok) {
+			scrubMoves++;
+			scrubQueued++;
+		}
+		return;
+	}
+	// after a move, look again right away for more cold files
+	w->checkAt = ok ? eraseTotal : eraseTotal + config.block_count / 16 + 1;
+}
+
+bool LittleFS::staticWearLevel(uint32_t budget_us)
+{
+	LittleFSWearMove *w = wearMove;
+	elapsedMicros usec = 0;
+	uint32_t (*wear)(const struct lfs_config *c, lfs_block_t block) = config.wear;
+	config.wear = &static_wear;
+	do {
+		// wear leveling copies go to the most worn free blocks,
+		// scrubbing copies to the least worn
+		wearInvert = !w->scrub;
+		if (w->phase == WEAR_IDLE) {
+			if (scrubQueued && eccCounts) {
+				// blocks reached the scrub threshold, find their files
+				scrubQueued = 0;
+				if (lfs_dir_open(&lfs, &w->dir, "/") < 0) break;
+				w->scrub = true;
+				strcpy(w->path, "/");
+				w->depth = 0;
+				w->phase = WEAR_SCAN;
+				continue;
+			}
+			w->scrub = false;
+			if (w->threshold == 0 || (int32_t)(eraseTotal - w->checkAt) < 0) {
+				if (eraseUnsaved >= config.block_count / 4 + 64) saveWearStats();
+				break;
+			}
+			uint32_t lo = UINT32_MAX, hi = 0;
+			uint64_t total = 0;
+			for (lfs_block_t block=0; block < config.block_count; block++) {
+				const uint32_t n = eraseCounts[block];
+				if (n < lo) lo = n;
+				if (n > hi) hi = n;
+				total += n;
+			}
+			// files whose blocks average well below the mean are cold.
+			// Once moved to worn blocks they stay put until the mean
+			// catches up, which limits how often any file is moved.
+			const uint32_t mean = total / config.block_count;
+			if (hi - lo < w->threshold || mean - lo <= w->threshold / 2
+			  || lfs_dir_open(&lfs, &w->dir, "/") < 0) {
+				w->checkAt = eraseTotal + config.block_count / 16 + 1;
+				continue;
+			}
+			w->coldLimit = mean - w->threshold / 2;
+			strcpy(w->path, "/");
+			w->depth = 0;
+			w->phase = WEAR_SCAN;
+		} else if (w->phase == WEAR_SCAN) {
+			struct lfs_info info;
+			int r = lfs_dir_read(&lfs, &w->dir, &info);
+			if (r <= 0) {
+				lfs_dir_close(&lfs, &w->dir);
+				if (r < 0 || w->depth == 0) {
+					// searched everything, no cold files
+					w->phase = WEAR_IDLE;
+					w->checkAt = eraseTotal + config.block_count / 16 + 1;
+					continue;
+				}
+				// finished a subdirectory, resume its parent
+				char *p = strrchr(w->path, '/');
+				if (p == w->path) p++;
+				*p = 0;
+				w->depth--;
+				if (lfs_dir_open(&lfs, &w->dir, w->path) < 0
+				  || lfs_dir_seek(&lfs, &w->dir, w->offset[w->depth]) < 0) {
+					w->phase = WEAR_IDLE;
+					w->checkAt = eraseTotal + config.block_count / 16 + 1;
+				}
+				continue;
+			}
+			if (strcmp(info.name, ".") == 0 || strcmp(info.name, "..") == 0) continue;
+			size_t len = strlen(w->path);
+			if (len + strlen(info.name) + 2 > sizeof(w->path)) continue;
+			if (len > 1) w->path[len++] = '/';
+			strcpy(w->path + len, info.name);
+			if (info.type == LFS_TYPE_DIR) {
+				if (w->depth < WEAR_MOVE_DEPTH) {
+					lfs_soff_t pos = lfs_dir_tell(&lfs, &w->dir);
+					lfs_dir_close(&lfs, &w->dir);
+					if (pos < 0 || lfs_dir_open(&lfs, &w->dir, w->path) < 0) {
+						w->phase = WEAR_IDLE;
+						w->checkAt = eraseTotal + config.block_count / 16 + 1;
+						continue;
+					}
+					w->offset[w->depth++] = pos;
+					continue;
+				}
+			} else if (wearMoveStart(&info)) {
+				lfs_dir_close(&lfs, &w->dir);
+				continue;
+			}
+			w->path[len > 1 ? len - 1 : len] = 0;
+		} else { // WEAR_COPY
+			uint8_t buf[256];
+			lfs_ssize_t n = lfs_file_read(&lfs, &w->src, buf, sizeof(buf));
+			if (n <= 0) {
+				wearMoveFinish(n == 0);
+			} else if (lfs_file_write(&lfs, &w->dst, buf, n) != n) {
+				wearMoveFinish(false);
+			}
+		}
+	} while (usec < budget_us);
+	wearInvert = false;
+	config.wear = wear;
+	return w->phase != WEAR_IDLE || (scrubQueued && eccCounts);
+}
@@ -54,6 +54,17 @@ static int lfs_bd_read(lfs_t *lfs,
             diff = lfs_min(diff, pcache->off-off);
         }
 
+        if (lfs->cfg->memory) {
+            // memory mapped, no need to cache
+            memcpy(data, (const uint8_t *)lfs->cfg->memory
+                    + (size_t)block*lfs->cfg->block_size + off, diff);
+
+            data += diff;
+            off += diff;
+            size -= diff;
+            continue;
+        }
+
         if (block == rcache->block &&
                 off < rcache->off + rcache->size) {
             if (off >= rcache->off) {
@@ -140,6 +151,27 @@ static int lfs_bd_cmp(lfs_t *lfs,
     return LFS_CMP_EQ;
 }
 
+static int lfs_bd_crc(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache, lfs_size_t hint,
+        lfs_block_t block, lfs_off_t off, lfs_size_t size, uint32_t *crc) {
+    lfs_size_t diff = 0;
+
+    for (lfs_off_t i = 0; i < size; i += diff) {
+        uint8_t dat[8];
+        diff = lfs_min(size-i, sizeof(dat));
+        int err = lfs_bd_read(lfs,
+                pcache, rcache, hint-i,
+                block, off+i, &dat, diff);
+        if (err) {
+            return err;
+        }
+
+        *crc = lfs_crc(*crc, &dat, diff);
+    }
+
+    return 0;
+}
+
 #ifndef LFS_READONLY
 static int lfs_bd_flush(lfs_t *lfs,
         lfs_cache_t *pcache, lfs_cache_t *rcache, bool validate) {
@@ -153,7 +185,7 @@ static int lfs_bd_flush(lfs_t *lfs,
             return err;
         }
 
-        if (validate) {
+        if (validate && !lfs->cfg->memory) {
             // check data on disk
             lfs_cache_drop(lfs, rcache);
             int res = lfs_bd_cmp(lfs,
@@ -490,6 +522,8 @@ static lfs_ssize_t lfs_file_rawread(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size);
 static int lfs_file_rawclose(lfs_t *lfs, lfs_file_t *file);
 static lfs_soff_t lfs_file_rawsize(lfs_t *lfs, lfs_file_t *file);
+static int lfs_file_rawtraverse(lfs_t *lfs, lfs_file_t *file,
+        int (*cb)(void *data, lfs_block_t block), void *data);
 
 static lfs_ssize_t lfs_fs_rawsize(lfs_t *lfs);
 static int lfs_fs_rawtraverse(lfs_t *lfs,
@@ -531,6 +565,40 @@ static void lfs_alloc_drop(lfs_t *lfs) {
 }
 
 #ifndef LFS_READONLY
+// number of lookahead entries searched for a less worn free block, and
+// how much more worn a free block must be before it is passed over
+#ifndef LFS_WEAR_WINDOW
+#define LFS_WEAR_WINDOW 32
+#endif
+#ifndef LFS_WEAR_SLACK
+#define LFS_WEAR_SLACK 8
+#endif
+
+static lfs_block_t lfs_alloc_leastworn(lfs_t *lfs, lfs_block_t off) {
+    uint32_t offwear = lfs->cfg->wear(lfs->cfg,
+            (lfs->free.off + off) % lfs->cfg->block_count);
+    lfs_block_t best = off;
+    uint32_t bestwear = offwear;
+    lfs_block_t end = lfs_min(lfs->free.size, off + LFS_WEAR_WINDOW);
+    for (lfs_block_t i = off + 1; i < end && bestwear > 0; i++) {
+        if (!(lfs->free.buffer[i / 32] & (1U << (i % 32)))) {
+            uint32_t wear = lfs->cfg->wear(lfs->cfg,
+                    (lfs->free.off + i) % lfs->cfg->block_count);
+            if (wear < bestwear) {
+                best = i;
+                bestwear = wear;
+            }
+        }
+    }
+
+    // compare the difference, bestwear + bestwear/8 overflows when wear
+    // counts are near UINT32_MAX
+    if (offwear - bestwear <= bestwear/8 + LFS_WEAR_SLACK) {
+        return off;
+    }
+    return best;
+}
+
 static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
     while (true) {
         while (lfs->free.i != lfs->free.size) {
@@ -540,6 +608,25 @@ static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
 
             if (!(lfs->free.buffer[off / 32] & (1U << (off % 32)))) {
                 // found a free block
+                if (lfs->cfg->wear) {
+                    lfs_block_t best = lfs_alloc_leastworn(lfs, off);
+                    if (best != off) {
+                        // pass over the more worn free blocks before best,
+                        // they don't count against ack since they were
+                        // not used, and are found again on the next pass
+                        lfs->free.ack += 1;
+                        while (lfs->free.i != best) {
+                            if (lfs->free.buffer[lfs->free.i / 32]
+                                    & (1U << (lfs->free.i % 32))) {
+                                lfs->free.ack -= 1;
+                            }
+                            lfs->free.i += 1;
+                        }
+                        lfs->free.i += 1;
+                        lfs->free.ack -= 1;
+                        off = best;
+                    }
+                }
                 *block = (lfs->free.off + off) % lfs->cfg->block_count;
 
                 // eagerly find next off so an alloc ack can
@@ -961,20 +1048,16 @@ static lfs_stag_t lfs_dir_fetchmatch(lfs_t *lfs,
             }
 
             // crc the entry first, hopefully leaving it in the cache
-            for (lfs_off_t j = sizeof(tag); j < lfs_tag_dsize(tag); j++) {
-                uint8_t dat;
-                err = lfs_bd_read(lfs,
-                        NULL, &lfs->rcache, lfs->cfg->block_size,
-                        dir->pair[0], off+j, &dat, 1);
-                if (err) {
-                    if (err == LFS_ERR_CORRUPT) {
-                        dir->erased = false;
-                        break;
-                    }
-                    return err;
+            err = lfs_bd_crc(lfs,
+                    NULL, &lfs->rcache, lfs->cfg->block_size,
+                    dir->pair[0], off+sizeof(tag),
+                    lfs_tag_dsize(tag)-sizeof(tag), &crc);
+            if (err) {
+                if (err == LFS_ERR_CORRUPT) {
+                    dir->erased = false;
+                    break;
                 }
-
-                crc = lfs_crc(crc, &dat, 1);
+                return err;
             }
 
             // directory modification tags?
@@ -1402,24 +1485,26 @@ static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
     lfs_off_t off = commit->begin;
     lfs_off_t noff = off1;
     while (off < end) {
+        // leave it up to caching to make this efficient
         uint32_t crc = 0xffffffff;
-        for (lfs_off_t i = off; i < noff+sizeof(uint32_t); i++) {
-            // check against written crc, may catch blocks that
-            // become readonly and match our commit size exactly
-            if (i == off1 && crc != crc1) {
-                return LFS_ERR_CORRUPT;
-            }
+        err = lfs_bd_crc(lfs,
+                NULL, &lfs->rcache, noff+sizeof(uint32_t)-off,
+                commit->block, off, noff-off, &crc);
+        if (err) {
+            return err;
+        }
 
-            // leave it up to caching to make this efficient
-            uint8_t dat;
-            err = lfs_bd_read(lfs,
-                    NULL, &lfs->rcache, noff+sizeof(uint32_t)-i,
-                    commit->block, i, &dat, 1);
-            if (err) {
-                return err;
-            }
+        // check against written crc, may catch blocks that
+        // become readonly and match our commit size exactly
+        if (noff == off1 && crc != crc1) {
+            return LFS_ERR_CORRUPT;
+        }
 
-            crc = lfs_crc(crc, &dat, 1);
+        err = lfs_bd_crc(lfs,
+                NULL, &lfs->rcache, sizeof(uint32_t),
+                commit->block, noff, sizeof(uint32_t), &crc);
+        if (err) {
+            return err;
         }
 
         // detected write error?
@@ -2753,17 +2838,36 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
             };
             lfs_cache_drop(lfs, &lfs->rcache);
 
+            // copy over a cache line at a time, the rest of the file is
+            // usually much larger than the change, if there is no memory
+            // for it copy a byte at a time and leave it up to caching
+            uint8_t byte;
+            lfs_size_t chunk = lfs->cfg->cache_size;
+            uint8_t *data = lfs_malloc(chunk);
+            if (!data) {
+                data = &byte;
+                chunk = 1;
+            }
+
             while (file->pos < file->ctz.size) {
-                // copy over a byte at a time, leave it up to caching
-                // to make this efficient
-                uint8_t data;
-                lfs_ssize_t res = lfs_file_rawread(lfs, &orig, &data, 1);
-                if (res < 0) {
-                    return res;
+                // stop where a cache line read at orig's offset would
+                // end, writing drops the cache, so a chunk should not
+                // need two reads
+                lfs_size_t diff = lfs_min(chunk, file->ctz.size - file->pos);
+                if ((orig.flags & LFS_F_READING) &&
+                        orig.off < lfs->cfg->block_size) {
+                    diff = lfs_min(diff, lfs->cfg->cache_size - (orig.off
+                            - lfs_aligndown(orig.off, lfs->cfg->read_size)));
                 }
 
-                res = lfs_file_rawwrite(lfs, file, &data, 1);
+                lfs_ssize_t res = lfs_file_rawread(lfs, &orig, data, diff);
+                if (res >= 0) {
+                    res = lfs_file_rawwrite(lfs, file, data, res);
+                }
                 if (res < 0) {
+                    if (data != &byte) {
+                        lfs_free(data);
+                    }
                     return res;
                 }
 
@@ -2774,6 +2878,10 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
                 }
             }
 
+            if (data != &byte) {
+                lfs_free(data);
+            }
+
             // write out what we have
             while (true) {
                 int err = lfs_bd_flush(lfs, &file->cache, &lfs->rcache, true);
@@ -2919,8 +3027,13 @@ static lfs_ssize_t lfs_file_rawread(lfs_t *lfs, lfs_file_t *file,
                 return err;
             }
         } else {
+            // reads of at least a cache go straight to the block device,
+            // so it sees one large sequential request rather than many
+            // cache sized ones
+            lfs_size_t hint = (diff >= lfs->cfg->cache_size)
+                    ? lfs->cfg->cache_size : lfs->cfg->block_size;
             int err = lfs_bd_read(lfs,
-                    NULL, &file->cache, lfs->cfg->block_size,
+                    NULL, &file->cache, hint,
                     file->block, file->off, data, diff);
             if (err) {
                 return err;
@@ -2962,16 +3075,35 @@ static lfs_ssize_t lfs_file_rawwrite(lfs_t *lfs, lfs_file_t *file,
     }
 
     if (!(file->flags & LFS_F_WRITING) && file->pos > file->ctz.size) {
-        // fill with zeros
+        // fill with zeros, a cache line at a time if there is memory
+        // for it, otherwise a byte at a time
         lfs_off_t pos = file->pos;
         file->pos = file->ctz.size;
 
+        uint8_t byte = 0;
+        lfs_size_t chunk = lfs->cfg->cache_size;
+        uint8_t *zeros = lfs_malloc(chunk);
+        if (zeros) {
+            memset(zeros, 0, chunk);
+        } else {
+            zeros = &byte;
+            chunk = 1;
+        }
+
         while (file->pos < pos) {
-            lfs_ssize_t res = lfs_file_rawwrite(lfs, file, &(uint8_t){0}, 1);
+            lfs_ssize_t res = lfs_file_rawwrite(lfs, file, zeros,
+                    lfs_min(chunk, pos - file->pos));
             if (res < 0) {
+                if (zeros != &byte) {
+                    lfs_free(zeros);
+                }
                 return res;
             }
         }
+
+        if (zeros != &byte) {
+            lfs_free(zeros);
+        }
     }
 
     if ((file->flags & LFS_F_INLINE) &&
@@ -3057,6 +3189,72 @@ relocate:
     file->flags &= ~LFS_F_ERRED;
     return size;
 }
+
+static lfs_ssize_t lfs_file_rawrewrite(lfs_t *lfs, lfs_file_t *file,
+        const void *buffer, lfs_size_t size) {
+    LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
+
+    // write out anything pending, the data must be in the file's blocks
+    int err = lfs_file_flush(lfs, file);
+    if (err) {
+        return err;
+    }
+
+    if ((file->flags & LFS_F_INLINE) ||
+            file->pos + size > file->ctz.size) {
+        return LFS_ERR_INVAL;
+    }
+
+    // read-modify-write whole cache lines, which are aligned for both
+    // read and prog, using rcache's buffer
+    const uint8_t *data = buffer;
+    lfs_size_t nsize = size;
+    lfs_cache_drop(lfs, &lfs->rcache);
+    while (nsize > 0) {
+        lfs_block_t block;
+        lfs_off_t off;
+        err = lfs_ctz_find(lfs, NULL, &file->cache,
+                file->ctz.head, file->ctz.size,
+                file->pos, &block, &off);
+        lfs_cache_drop(lfs, &file->cache);
+        if (err) {
+            return err;
+        }
+
+        lfs_size_t diff = lfs_min(nsize, lfs->cfg->block_size - off);
+        while (diff > 0) {
+            lfs_off_t line = lfs_aligndown(off, lfs->cfg->cache_size);
+            lfs_size_t n = lfs_min(diff, line + lfs->cfg->cache_size - off);
+            if (n < lfs->cfg->cache_size) {
+                err = lfs->cfg->read(lfs->cfg, block, line,
+                        lfs->rcache.buffer, lfs->cfg->cache_size);
+                if (err) {
+                    return err;
+                }
+            }
+
+            memcpy(&lfs->rcache.buffer[off - line], data, n);
+            err = lfs->cfg->prog(lfs->cfg, block, line,
+                    lfs->rcache.buffer, lfs->cfg->cache_size);
+            if (err) {
+                return err;
+            }
+
+            file->pos += n;
+            off += n;
+            data += n;
+            diff -= n;
+            nsize -= n;
+        }
+    }
+
+    err = lfs->cfg->sync(lfs->cfg);
+    if (err) {
+        return err;
+    }
+
+    return size;
+}
 #endif
 
 static lfs_soff_t lfs_file_rawseek(lfs_t *lfs, lfs_file_t *file,
@@ -3177,6 +3375,24 @@ static lfs_soff_t lfs_file_rawsize(lfs_t *lfs, lfs_file_t *file) {
     return file->ctz.size;
 }
 
+static int lfs_file_rawtraverse(lfs_t *lfs, lfs_file_t *file,
+        int (*cb)(void *data, lfs_block_t block), void *data) {
+    if (file->flags & LFS_F_INLINE) {
+        // inline files live in their directory's metadata pair
+        return 0;
+    }
+
+#ifndef LFS_READONLY
+    if (file->flags & LFS_F_WRITING) {
+        return lfs_ctz_traverse(lfs, &file->cache, &lfs->rcache,
+                file->block, file->pos, cb, data);
+    }
+#endif
+
+    return lfs_ctz_traverse(lfs, NULL, &lfs->rcache,
+            file->ctz.head, file->ctz.size, cb, data);
+}
+
 
 /// General fs operations ///
 static int lfs_rawstat(lfs_t *lfs, const char *path, struct lfs_info *info) {
@@ -3729,6 +3945,13 @@ static int lfs_rawmount(lfs_t *lfs, const struct lfs_config *cfg) {
             }
 
             // check superblock configuration
+            if (superblock.block_size != lfs->cfg->block_size) {
+                LFS_ERROR("Invalid block size (%"PRIu32" != %"PRIu32")",
+                        superblock.block_size, lfs->cfg->block_size);
+                err = LFS_ERR_INVAL;
+                goto cleanup;
+            }
+
             if (superblock.name_max) {
                 if (superblock.name_max > lfs->name_max) {
                     LFS_ERROR("Unsupported name_max (%"PRIu32" > %"PRIu32")",
@@ -5186,6 +5409,25 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
 }
 #endif
 
+#ifndef LFS_READONLY
+lfs_ssize_t lfs_file_rewrite(lfs_t *lfs, lfs_file_t *file,
+        const void *buffer, lfs_size_t size) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_rewrite(%p, %p, %p, %"PRIu32")",
+            (void*)lfs, (void*)file, buffer, size);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_rawrewrite(lfs, file, buffer, size);
+
+    LFS_TRACE("lfs_file_rewrite -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+#endif
+
 lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
         lfs_soff_t off, int whence) {
     int err = LFS_LOCK(lfs->cfg);
@@ -5265,6 +5507,23 @@ lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file) {
     return res;
 }
 
+int lfs_file_traverse(lfs_t *lfs, lfs_file_t *file,
+        int (*cb)(void *, lfs_block_t), void *data) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_traverse(%p, %p, %p, %p)",
+            (void*)lfs, (void*)file, (void*)(uintptr_t)cb, data);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    err = lfs_file_rawtraverse(lfs, file, cb, data);
+
+    LFS_TRACE("lfs_file_traverse -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
 #ifndef LFS_READONLY
 int lfs_mkdir(lfs_t *lfs, const char *path) {
     int err = LFS_LOCK(lfs->cfg);
@@ -263,6 +263,17 @@ struct lfs_config {
     // can help bound the metadata compaction time. Must be <= block_size.
     // Defaults to block_size when zero.
     lfs_size_t metadata_max;
+
+    // Optional wear estimate for a block, such as its erase count. When
+    // provided, the block allocator prefers the least worn of the free
+    // blocks just ahead of its current position. May be NULL.
+    uint32_t (*wear)(const struct lfs_config *c, lfs_block_t block);
+
+    // Optional pointer to the storage, when it's plain memory holding
+    // block_count*block_size bytes. When provided, reads copy straight
+    // from it instead of going through read and the read cache, and
+    // programs are not read back to validate them. May be NULL.
+    void *memory;
 };
 
 // File info structure
@@ -569,6 +580,20 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size);
 #endif
 
+#ifndef LFS_READONLY
+// Overwrite data in the blocks the file already uses, without copy on write
+//
+// Only for block devices which can program over programmed data without an
+// erase, such as RAM or FRAM. The data must lie within the file and the file
+// must not be inline. The update is not power-loss safe, and other open
+// handles of the file may keep seeing the old data.
+//
+// Returns the number of bytes written, or a negative error code on failure,
+// LFS_ERR_INVAL if the data can not be written in place.
+lfs_ssize_t lfs_file_rewrite(lfs_t *lfs, lfs_file_t *file,
+        const void *buffer, lfs_size_t size);
+#endif
+
 // Change the position of the file
 //
 // The change in position is determined by the offset and whence flag.
@@ -601,6 +626,16 @@ int lfs_file_rewind(lfs_t *lfs, lfs_file_t *file);
 // Returns the size of the file, or a negative error code on failure.
 lfs_soff_t lfs_file_size(lfs_t *lfs, lfs_file_t *file);
 
+// Traverse through the data blocks of a file
+//
+// The provided callback will be called with each block address holding the
+// file's data. Inline files are stored in their directory's metadata and
+// produce no callbacks.
+//
+// Returns a negative error code on failure.
+int lfs_file_traverse(lfs_t *lfs, lfs_file_t *file,
+        int (*cb)(void*, lfs_block_t), void *data);
+
 
 /// Directory operations ///
 